@@ -0,0 +1,567 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "tinyshell.h"
+
+/*
+ * Arithmetic expansion - $(( )) and let.
+ *
+ * An expression is compiled into a short stack-machine program the
+ * first time it is seen.  Programs are cached by expression text, so
+ * "i = i + 1" in a loop body is parsed once and then only evaluated.
+ */
+
+/* opcodes */
+enum {
+    A_NUM,      /* push val */
+    A_VAR,      /* push value of name */
+    A_STORE,    /* name = top (value stays on the stack) */
+    A_INCR,     /* ++name / --name by val, push the new value */
+    A_POSTINCR, /* name++ / name-- by val, push the old value */
+    A_POP,
+    A_JZ,       /* pop, jump to val if zero */
+    A_JNZ,      /* pop, jump to val if non-zero */
+    A_JMP,
+    A_BOOL,     /* top = (top != 0) */
+    A_NEG, A_NOT, A_BNOT,
+    A_MUL, A_DIV, A_MOD, A_ADD, A_SUB, A_SHL, A_SHR,
+    A_LT, A_LE, A_GT, A_GE, A_EQ, A_NE,
+    A_BAND, A_BXOR, A_BOR
+};
+
+struct ains {
+    int op;
+    long long val;
+    const char *name;
+};
+
+struct acode {
+    int n;
+    struct ains *ins;
+};
+
+#define ACACHE_MAX 256      /* cached programs before the cache is reset */
+#define ARITH_DEPTH 32      /* variables that hold expressions */
+
+static struct htab cache;
+static int depth;
+
+/*
+ * Compiler - precedence climbing over the expression text
+ */
+struct acomp {
+    const char *p;
+    struct ains *ins;
+    int n, cap;
+    char *names;            /* variable names, NUL separated */
+    size_t nlen, ncap;
+    int failed;
+};
+
+static int emit(struct acomp *c, int op, long long val, const char *name) {
+    if (c->n == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 16;
+        if ((c->ins = realloc(c->ins, c->cap * sizeof(*c->ins))) == NULL)
+            app_error("out of memory");
+    }
+    c->ins[c->n].op = op;
+    c->ins[c->n].val = val;
+    c->ins[c->n].name = name;
+    return c->n++;
+}
+
+/* names are stored as offsets until the program is finalized */
+static const char *add_name(struct acomp *c, const char *s, size_t len) {
+    size_t off = c->nlen;
+
+    if (c->nlen + len + 1 > c->ncap) {
+        while (c->nlen + len + 1 > c->ncap)
+            c->ncap = c->ncap ? c->ncap * 2 : 64;
+        if ((c->names = realloc(c->names, c->ncap)) == NULL)
+            app_error("out of memory");
+    }
+    memcpy(c->names + off, s, len);
+    c->names[off + len] = '\0';
+    c->nlen += len + 1;
+    return (const char *)(off + 1);     /* never NULL */
+}
+
+static void skip_blanks(struct acomp *c) {
+    while (isspace((unsigned char)*c->p))
+        c->p++;
+}
+
+static void aerror(struct acomp *c, const char *what) {
+    if (!c->failed)
+        fprintf(stderr, "tsh: arithmetic: %s near `%s'\n", what, c->p);
+    c->failed = 1;
+}
+
+/* match an operator, refusing to split a longer one (e.g. '<' in '<=') */
+static int accept(struct acomp *c, const char *op) {
+    size_t n = strlen(op);
+
+    skip_blanks(c);
+    if (strncmp(c->p, op, n) != 0)
+        return 0;
+    if (n == 1 && c->p[1] == '=' && strchr("<>=!", op[0]) == NULL)
+        return 0;       /* '+' must not match '+=' */
+    if (n == 1 && strchr("<>", op[0]) && (c->p[1] == op[0] || c->p[1] == '='))
+        return 0;
+    if (n == 1 && strchr("&|", op[0]) && (c->p[1] == op[0] || c->p[1] == '='))
+        return 0;
+    if (n == 1 && strchr("<>=!", op[0]) && c->p[1] == '=')
+        return 0;
+    if (n == 1 && strchr("+-", op[0]) && c->p[1] == op[0])
+        return 0;
+    if (n == 2 && strchr("<>", op[0]) && op[1] == op[0] && c->p[2] == '=')
+        return 0;
+    c->p += n;
+    return 1;
+}
+
+static void comp_expr(struct acomp *c);
+static void comp_assign(struct acomp *c);
+
+static int name_len(const char *s) {
+    int n = 0;
+
+    if (!isalpha((unsigned char)*s) && *s != '_')
+        return 0;
+    while (isalnum((unsigned char)s[n]) || s[n] == '_')
+        n++;
+    return n;
+}
+
+static void comp_primary(struct acomp *c) {
+    const char *name;
+    long long val;
+    char *end;
+    int len;
+
+    skip_blanks(c);
+    if (*c->p == '(') {
+        c->p++;
+        comp_expr(c);
+        skip_blanks(c);
+        if (*c->p != ')') {
+            aerror(c, "missing `)'");
+            return;
+        }
+        c->p++;
+        return;
+    }
+    if (isdigit((unsigned char)*c->p)) {
+        errno = 0;
+        val = strtoll(c->p, &end, 0);
+        if (errno != 0 || isalnum((unsigned char)*end)) {
+            aerror(c, "invalid number");
+            return;
+        }
+        c->p = end;
+        emit(c, A_NUM, val, NULL);
+        return;
+    }
+    if ((len = name_len(c->p)) > 0) {
+        name = add_name(c, c->p, len);
+        c->p += len;
+        if (accept(c, "++"))
+            emit(c, A_POSTINCR, 1, name);
+        else if (accept(c, "--"))
+            emit(c, A_POSTINCR, -1, name);
+        else
+            emit(c, A_VAR, 0, name);
+        return;
+    }
+    aerror(c, *c->p ? "syntax error" : "operand expected");
+}
+
+static void comp_unary(struct acomp *c) {
+    const char *name;
+    int len;
+
+    skip_blanks(c);
+    if (accept(c, "++") || accept(c, "--")) {
+        long long d = (c->p[-1] == '+') ? 1 : -1;
+
+        skip_blanks(c);
+        if ((len = name_len(c->p)) == 0) {
+            aerror(c, "variable expected");
+            return;
+        }
+        name = add_name(c, c->p, len);
+        c->p += len;
+        emit(c, A_INCR, d, name);
+    }
+    else if (accept(c, "-")) {
+        comp_unary(c);
+        emit(c, A_NEG, 0, NULL);
+    }
+    else if (accept(c, "+"))
+        comp_unary(c);
+    else if (accept(c, "!")) {
+        comp_unary(c);
+        emit(c, A_NOT, 0, NULL);
+    }
+    else if (accept(c, "~")) {
+        comp_unary(c);
+        emit(c, A_BNOT, 0, NULL);
+    }
+    else
+        comp_primary(c);
+}
+
+/* binary operators by precedence level, loosest first */
+static const struct {
+    const char *op;
+    int code;
+    int level;
+} binops[] = {
+    { "|",  A_BOR,  0 },
+    { "^",  A_BXOR, 1 },
+    { "&",  A_BAND, 2 },
+    { "==", A_EQ,   3 }, { "!=", A_NE, 3 },
+    { "<=", A_LE,   4 }, { ">=", A_GE, 4 }, { "<", A_LT, 4 }, { ">", A_GT, 4 },
+    { "<<", A_SHL,  5 }, { ">>", A_SHR, 5 },
+    { "+",  A_ADD,  6 }, { "-", A_SUB, 6 },
+    { "*",  A_MUL,  7 }, { "/", A_DIV, 7 }, { "%", A_MOD, 7 },
+    { NULL, 0, 0 }
+};
+
+#define MAXLEVEL 7
+
+static void comp_binary(struct acomp *c, int level) {
+    int i, matched;
+
+    if (level > MAXLEVEL) {
+        comp_unary(c);
+        return;
+    }
+    comp_binary(c, level + 1);
+    do {
+        matched = 0;
+        for (i = 0; binops[i].op && !c->failed; i++) {
+            if (binops[i].level == level && accept(c, binops[i].op)) {
+                comp_binary(c, level + 1);
+                emit(c, binops[i].code, 0, NULL);
+                matched = 1;
+                break;
+            }
+        }
+    } while (matched && !c->failed);
+}
+
+/* && and || short-circuit and yield 0 or 1 */
+static void comp_logand(struct acomp *c) {
+    int j;
+
+    comp_binary(c, 0);
+    while (!c->failed && accept(c, "&&")) {
+        emit(c, A_BOOL, 0, NULL);
+        j = emit(c, A_JZ, 0, NULL);
+        comp_binary(c, 0);
+        emit(c, A_BOOL, 0, NULL);
+        emit(c, A_JMP, c->n + 2, NULL);
+        c->ins[j].val = c->n;
+        emit(c, A_NUM, 0, NULL);
+    }
+}
+
+static void comp_logor(struct acomp *c) {
+    int j;
+
+    comp_logand(c);
+    while (!c->failed && accept(c, "||")) {
+        j = emit(c, A_JNZ, 0, NULL);
+        comp_logand(c);
+        emit(c, A_BOOL, 0, NULL);
+        emit(c, A_JMP, c->n + 2, NULL);
+        c->ins[j].val = c->n;
+        emit(c, A_NUM, 1, NULL);
+    }
+}
+
+static void comp_cond(struct acomp *c) {
+    int jz, jmp;
+
+    comp_logor(c);
+    if (c->failed || !accept(c, "?"))
+        return;
+    jz = emit(c, A_JZ, 0, NULL);
+    comp_assign(c);
+    if (!accept(c, ":")) {
+        aerror(c, "`:' expected");
+        return;
+    }
+    jmp = emit(c, A_JMP, 0, NULL);
+    c->ins[jz].val = c->n;
+    comp_cond(c);
+    c->ins[jmp].val = c->n;
+}
+
+static void comp_assign(struct acomp *c) {
+    static const struct {
+        const char *op;
+        int code;
+    } ops[] = {
+        { "*=", A_MUL }, { "/=", A_DIV }, { "%=", A_MOD }, { "+=", A_ADD },
+        { "-=", A_SUB }, { "<<=", A_SHL }, { ">>=", A_SHR }, { "&=", A_BAND },
+        { "^=", A_BXOR }, { "|=", A_BOR }, { NULL, 0 }
+    };
+    const char *save, *name;
+    int i, len;
+
+    skip_blanks(c);
+    save = c->p;
+    if ((len = name_len(c->p)) > 0) {
+        c->p += len;
+        skip_blanks(c);
+        if (c->p[0] == '=' && c->p[1] != '=') {
+            c->p++;
+            name = add_name(c, save, len);
+            comp_assign(c);
+            emit(c, A_STORE, 0, name);
+            return;
+        }
+        for (i = 0; ops[i].op; i++) {
+            if (strncmp(c->p, ops[i].op, strlen(ops[i].op)) == 0) {
+                c->p += strlen(ops[i].op);
+                name = add_name(c, save, len);
+                emit(c, A_VAR, 0, name);
+                comp_assign(c);
+                emit(c, ops[i].code, 0, NULL);
+                emit(c, A_STORE, 0, name);
+                return;
+            }
+        }
+        c->p = save;
+    }
+    comp_cond(c);
+}
+
+static void comp_expr(struct acomp *c) {
+    comp_assign(c);
+    while (!c->failed && accept(c, ",")) {
+        emit(c, A_POP, 0, NULL);
+        comp_assign(c);
+    }
+}
+
+/*
+ * compile - turn expr into a program in a single allocation.
+ *     Return NULL after reporting a syntax error.
+ */
+static struct acode *compile(const char *expr) {
+    struct acomp c;
+    struct acode *code;
+    char *names;
+    int i;
+
+    memset(&c, 0, sizeof(c));
+    c.p = expr;
+    skip_blanks(&c);
+    if (*c.p == '\0')
+        emit(&c, A_NUM, 0, NULL);       /* $(( )) is 0 */
+    else
+        comp_expr(&c);
+    skip_blanks(&c);
+    if (!c.failed && *c.p != '\0')
+        aerror(&c, "syntax error");
+    if (c.failed) {
+        free(c.ins);
+        free(c.names);
+        return NULL;
+    }
+
+    code = malloc(sizeof(*code) + c.n * sizeof(struct ains) + c.nlen);
+    if (code == NULL)
+        app_error("out of memory");
+    code->n = c.n;
+    code->ins = (struct ains *)(code + 1);
+    names = (char *)(code->ins + c.n);
+    if (c.nlen > 0)
+        memcpy(names, c.names, c.nlen);
+    for (i = 0; i < c.n; i++) {
+        code->ins[i] = c.ins[i];
+        if (c.ins[i].name != NULL)
+            code->ins[i].name = names + ((size_t)c.ins[i].name - 1);
+    }
+    free(c.ins);
+    free(c.names);
+    return code;
+}
+
+static int var_value(const char *name, long long *val);
+
+static void set_value(const char *name, long long val) {
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%lld", val);
+    var_set(name, buf);
+}
+
+/*
+ * run - execute a program.  Return 0 and the value of the expression
+ *     in *result, or -1 after reporting a runtime error.
+ */
+static int run(struct acode *code, long long *result) {
+    long long small[32], *stack = small, a, b;
+    struct ains *in;
+    int pc, sp = 0, status = 0;
+
+    if (code->n > 32 && (stack = malloc(code->n * sizeof(*stack))) == NULL)
+        app_error("out of memory");
+
+    for (pc = 0; pc < code->n && status == 0; pc++) {
+        in = &code->ins[pc];
+        switch (in->op) {
+            case A_NUM:
+                stack[sp++] = in->val;
+                break;
+            case A_VAR:
+                if (var_value(in->name, &stack[sp++]) < 0)
+                    status = -1;
+                break;
+            case A_STORE:
+                set_value(in->name, stack[sp - 1]);
+                break;
+            case A_INCR:
+            case A_POSTINCR:
+                if (var_value(in->name, &a) < 0) {
+                    status = -1;
+                    break;
+                }
+                set_value(in->name, a + in->val);
+                stack[sp++] = (in->op == A_INCR) ? a + in->val : a;
+                break;
+            case A_POP:
+                sp--;
+                break;
+            case A_JZ:
+                if (stack[--sp] == 0)
+                    pc = in->val - 1;
+                break;
+            case A_JNZ:
+                if (stack[--sp] != 0)
+                    pc = in->val - 1;
+                break;
+            case A_JMP:
+                pc = in->val - 1;
+                break;
+            case A_BOOL:
+                stack[sp - 1] = (stack[sp - 1] != 0);
+                break;
+            case A_NEG:
+                stack[sp - 1] = -(unsigned long long)stack[sp - 1];
+                break;
+            case A_NOT:
+                stack[sp - 1] = !stack[sp - 1];
+                break;
+            case A_BNOT:
+                stack[sp - 1] = ~stack[sp - 1];
+                break;
+            default:
+                b = stack[--sp];
+                a = stack[sp - 1];
+                switch (in->op) {
+                    case A_MUL:  a = (unsigned long long)a * b; break;
+                    case A_ADD:  a = (unsigned long long)a + b; break;
+                    case A_SUB:  a = (unsigned long long)a - b; break;
+                    case A_SHL:  a = (unsigned long long)a << (b & 63); break;
+                    case A_SHR:  a >>= (b & 63); break;
+                    case A_LT:   a = a < b; break;
+                    case A_LE:   a = a <= b; break;
+                    case A_GT:   a = a > b; break;
+                    case A_GE:   a = a >= b; break;
+                    case A_EQ:   a = a == b; break;
+                    case A_NE:   a = a != b; break;
+                    case A_BAND: a &= b; break;
+                    case A_BXOR: a ^= b; break;
+                    case A_BOR:  a |= b; break;
+                    case A_DIV:
+                    case A_MOD:
+                        if (b == 0) {
+                            fprintf(stderr, "tsh: arithmetic: division by 0\n");
+                            status = -1;
+                        }
+                        else if (b == -1)   /* LLONG_MIN / -1 traps */
+                            a = (in->op == A_DIV) ? -(unsigned long long)a : 0;
+                        else
+                            a = (in->op == A_DIV) ? a / b : a % b;
+                        break;
+                }
+                stack[sp - 1] = a;
+        }
+    }
+    if (status == 0)
+        *result = stack[sp - 1];
+    if (stack != small)
+        free(stack);
+    return status;
+}
+
+/*
+ * arith_eval - evaluate expression expr.  Return 0 with the value in
+ *     *result, or -1 after reporting an error.
+ */
+int arith_eval(const char *expr, long long *result) {
+    struct htab_ent *e;
+    struct acode *code;
+    unsigned i;
+    int status;
+
+    if ((e = htab_find(&cache, expr)) == NULL) {
+        if ((code = compile(expr)) == NULL)
+            return -1;
+        if (cache.count >= ACACHE_MAX && depth == 0) {
+            /* simplest eviction: start over (nothing is running) */
+            for (i = 0; i < cache.nbuckets; i++)
+                while (cache.buckets[i] != NULL)
+                    free(htab_remove(&cache, cache.buckets[i]->key));
+        }
+        e = htab_insert(&cache, expr);
+        e->val = code;
+    }
+
+    if (depth >= ARITH_DEPTH) {
+        fprintf(stderr, "tsh: arithmetic: expression recursion level exceeded\n");
+        return -1;
+    }
+    depth++;
+    status = run(e->val, result);
+    depth--;
+    return status;
+}
+
+/* a variable's value is a number, or else an expression itself */
+static int var_value(const char *name, long long *val) {
+    const char *s = var_get(name);
+    char *end;
+
+    if (s == NULL || *s == '\0') {
+        *val = 0;
+        return 0;
+    }
+    errno = 0;
+    *val = strtoll(s, &end, 0);
+    if (errno == 0 && *end == '\0')
+        return 0;
+    return arith_eval(s, val);
+}
+
+/* let expr ... - status is 0 if the last expression is non-zero */
+int builtin_let(int argc, char **argv) {
+    long long val = 0;
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr, "let: expression expected\n");
+        return 2;
+    }
+    for (i = 1; i < argc; i++)
+        if (arith_eval(argv[i], &val) < 0)
+            return 2;
+    return val == 0;
+}
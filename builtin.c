@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "tinyshell.h"
+
+/*
+ * echo [-n] [arg ...]
+ */
+int builtin_echo(int argc, char **argv) {
+    int i = 1, newline = 1;
+
+    if (argc > 1 && strcmp(argv[1], "-n") == 0) {
+        newline = 0;
+        i++;
+    }
+    for (; i < argc; i++) {
+        fputs(argv[i], stdout);
+        if (i < argc - 1)
+            putchar(' ');
+    }
+    if (newline)
+        putchar('\n');
+    return 0;
+}
+
+int builtin_true(int argc, char **argv) {
+    return 0;
+}
+
+int builtin_false(int argc, char **argv) {
+    return 1;
+}
+
+/* pwd */
+int builtin_pwd(int argc, char **argv) {
+    char *cwd = getcwd(NULL, 0);
+
+    if (cwd == NULL) {
+        fprintf(stderr, "pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    puts(cwd);
+    free(cwd);
+    return 0;
+}
+
+/* cd [dir | -] - change directory, keeping PWD and OLDPWD */
+int builtin_cd(int argc, char **argv) {
+    const char *dir = (argc > 1) ? argv[1] : var_get("HOME");
+    char *old, *cwd;
+
+    if (argc > 1 && strcmp(dir, "-") == 0 && (dir = var_get("OLDPWD")) == NULL) {
+        fprintf(stderr, "cd: OLDPWD not set\n");
+        return 1;
+    }
+    if (dir == NULL) {
+        fprintf(stderr, "cd: HOME not set\n");
+        return 1;
+    }
+    old = getcwd(NULL, 0);
+    if (chdir(dir) < 0) {
+        fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+        free(old);
+        return 1;
+    }
+    if (old != NULL)
+        var_set("OLDPWD", old);
+    if ((cwd = getcwd(NULL, 0)) != NULL)
+        var_set("PWD", cwd);
+    if (argc > 1 && strcmp(argv[1], "-") == 0 && cwd != NULL)
+        puts(cwd);
+    free(old);
+    free(cwd);
+    return 0;
+}
+
+/*
+ * test / [ - evaluate a conditional expression.
+ * Return 0 (true), 1 (false) or 2 (usage error).
+ */
+static int test_int(const char *s, long long *val) {
+    char *end;
+
+    errno = 0;
+    *val = strtoll(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || errno != 0) {
+        fprintf(stderr, "test: %s: integer expression expected\n", s);
+        return -1;
+    }
+    return 0;
+}
+
+static int test_unary(const char *op, const char *arg) {
+    struct stat st;
+
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') {
+        fprintf(stderr, "test: %s: unary operator expected\n", op);
+        return 2;
+    }
+    switch (op[1]) {
+        case 'n': return arg[0] == '\0';
+        case 'z': return arg[0] != '\0';
+        case 'e': return stat(arg, &st) != 0;
+        case 'f': return stat(arg, &st) != 0 || !S_ISREG(st.st_mode);
+        case 'd': return stat(arg, &st) != 0 || !S_ISDIR(st.st_mode);
+        case 's': return stat(arg, &st) != 0 || st.st_size == 0;
+        case 'L':
+        case 'h': return lstat(arg, &st) != 0 || !S_ISLNK(st.st_mode);
+        case 'r': return access(arg, R_OK) != 0;
+        case 'w': return access(arg, W_OK) != 0;
+        case 'x': return access(arg, X_OK) != 0;
+    }
+    fprintf(stderr, "test: %s: unary operator expected\n", op);
+    return 2;
+}
+
+static int is_binop(const char *op) {
+    static const char *ops[] = {
+        "=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL
+    };
+    int i;
+
+    for (i = 0; ops[i]; i++)
+        if (strcmp(op, ops[i]) == 0)
+            return 1;
+    return 0;
+}
+
+static int test_binary(const char *a, const char *op, const char *b) {
+    long long x, y;
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+        return strcmp(a, b) != 0;
+    if (strcmp(op, "!=") == 0)
+        return strcmp(a, b) == 0;
+    if (test_int(a, &x) < 0 || test_int(b, &y) < 0)
+        return 2;
+    if (strcmp(op, "-eq") == 0) return !(x == y);
+    if (strcmp(op, "-ne") == 0) return !(x != y);
+    if (strcmp(op, "-lt") == 0) return !(x < y);
+    if (strcmp(op, "-le") == 0) return !(x <= y);
+    if (strcmp(op, "-gt") == 0) return !(x > y);
+    return !(x >= y);
+}
+
+static int test_expr(int argc, char **argv) {
+    int i, l, r;
+
+    /* -o binds loosest, then -a */
+    for (i = argc - 2; i > 0; i--) {
+        if (strcmp(argv[i], "-o") == 0) {
+            if ((l = test_expr(i, argv)) == 2)
+                return 2;
+            if ((r = test_expr(argc - i - 1, argv + i + 1)) == 2)
+                return 2;
+            return l && r;
+        }
+    }
+    for (i = argc - 2; i > 0; i--) {
+        if (strcmp(argv[i], "-a") == 0) {
+            if ((l = test_expr(i, argv)) == 2)
+                return 2;
+            if ((r = test_expr(argc - i - 1, argv + i + 1)) == 2)
+                return 2;
+            return l || r;
+        }
+    }
+
+    switch (argc) {
+        case 0:
+            return 1;
+        case 1:
+            return argv[0][0] == '\0';
+        case 2:
+            if (strcmp(argv[0], "!") == 0)
+                return !test_expr(1, argv + 1);
+            return test_unary(argv[0], argv[1]);
+        case 3:
+            if (is_binop(argv[1]))
+                return test_binary(argv[0], argv[1], argv[2]);
+            if (strcmp(argv[0], "!") == 0) {
+                r = test_expr(2, argv + 1);
+                return (r == 2) ? 2 : !r;
+            }
+            break;
+        default:
+            if (strcmp(argv[0], "!") == 0) {
+                r = test_expr(argc - 1, argv + 1);
+                return (r == 2) ? 2 : !r;
+            }
+    }
+    fprintf(stderr, "test: too many arguments\n");
+    return 2;
+}
+
+int builtin_test(int argc, char **argv) {
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing `]'\n");
+            return 2;
+        }
+        argc--;
+    }
+    return test_expr(argc - 1, argv + 1);
+}
+
+/* export name[=value] ... */
+int builtin_export(int argc, char **argv) {
+    char *eq;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if ((eq = strchr(argv[i], '=')) != NULL) {
+            *eq = '\0';
+            var_export(argv[i], eq + 1);
+            *eq = '=';
+        }
+        else
+            var_export(argv[i], NULL);
+    }
+    return 0;
+}
+
+/* unset [-f] name ... */
+int builtin_unset(int argc, char **argv) {
+    int i = 1, funcs = 0;
+
+    if (argc > 1 && strcmp(argv[1], "-f") == 0) {
+        funcs = 1;
+        i++;
+    }
+    for (; i < argc; i++) {
+        if (funcs)
+            func_remove(argv[i]);
+        else
+            var_unset(argv[i]);
+    }
+    return 0;
+}
+
+/* alias [name[=value] ...] */
+int builtin_alias(int argc, char **argv) {
+    int i, status = 0;
+    char *eq;
+
+    if (argc == 1)
+        return alias_print(NULL);
+    for (i = 1; i < argc; i++) {
+        if ((eq = strchr(argv[i], '=')) != NULL) {
+            *eq = '\0';
+            if (alias_define(argv[i], eq + 1) < 0)
+                status = 1;
+            *eq = '=';
+        }
+        else if (alias_print(argv[i]) < 0) {
+            fprintf(stderr, "alias: %s: not found\n", argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/* unalias name ... */
+int builtin_unalias(int argc, char **argv) {
+    int i, status = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (alias_remove(argv[i]) < 0) {
+            fprintf(stderr, "unalias: %s: not found\n", argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
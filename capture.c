@@ -0,0 +1,223 @@
+#define _GNU_SOURCE     /* memfd_create, fallocate */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "tinyshell.h"
+
+/*
+ * Output capture - a job started with the capture prefix writes its
+ * stdout and stderr into a pipe that the shell drains from its event
+ * loop, so the job never waits on us for longer than one ev_wait.
+ * What is drained goes to a buffer of CAP_BUF bytes, and a full buffer
+ * is spilled to a memfd.  The memfd keeps the last CAP_KEEP bytes;
+ * older output is punched out of it.
+ *
+ * deletejob calls cap_close from the SIGCHLD handler, so everything
+ * here that it reaches sticks to system calls: the buffers are mapped,
+ * not malloc'd.
+ */
+
+int cap_live;           /* captures whose pipe is still open */
+
+/* cap_open - a new capture; *wfd gets the pipe end for the job. NULL on error */
+struct capture *cap_open(int *wfd) {
+    struct capture *c;
+    int pd[2];
+
+    c = mmap(NULL, sizeof(*c), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (c == MAP_FAILED)
+        return NULL;
+    c->buf = mmap(NULL, CAP_BUF, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (c->buf == MAP_FAILED || pipe2(pd, O_CLOEXEC) < 0) {
+        if (c->buf != MAP_FAILED)
+            munmap(c->buf, CAP_BUF);
+        munmap(c, sizeof(*c));
+        return NULL;
+    }
+    fcntl(pd[0], F_SETFL, O_NONBLOCK);
+    c->fd = pd[0];
+    c->memfd = -1;
+    c->lo = c->hi = 0;
+    c->len = 0;
+    cap_live++;
+    *wfd = pd[1];
+    return c;
+}
+
+/* cap_spill - move the buffer to the memfd, dropping the oldest output */
+static void cap_spill(struct capture *c) {
+    size_t off;
+    ssize_t r;
+    long long lo;
+
+    if (c->memfd < 0)
+        c->memfd = memfd_create("tsh-output", MFD_CLOEXEC);
+    for (off = 0; c->memfd >= 0 && off < c->len; off += r)
+        if ((r = pwrite(c->memfd, c->buf + off, c->len - off, c->hi + off)) <= 0)
+            break;
+    if (off < c->len)
+        c->lo = c->hi + c->len;     /* nowhere to keep it */
+    c->hi += c->len;
+    c->len = 0;
+    if (c->hi - c->lo > CAP_KEEP) {
+        /* the memfd is sparse: offsets stay those of the whole output */
+        lo = (c->hi - CAP_KEEP) & ~(long long)(CAP_BUF - 1);
+        if (lo > c->lo && fallocate(c->memfd,
+                    FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, c->lo, lo - c->lo) == 0)
+            c->lo = lo;
+    }
+}
+
+/*
+ * cap_drain - read what the job has written so far.  Bounded, so that
+ *     a chatty job cannot keep the shell from its other events; the
+ *     rest stays ready in the pipe.  Return the bytes read; the fd is
+ *     closed at EOF.
+ */
+long cap_drain(struct capture *c) {
+    ssize_t r;
+    long got = 0;
+    int i;
+
+    for (i = 0; c->fd >= 0 && i < 16; i++) {
+        if (c->len == CAP_BUF)
+            cap_spill(c);
+        r = read(c->fd, c->buf + c->len, CAP_BUF - c->len);
+        if (r > 0) {
+            c->len += r;
+            got += r;
+            continue;
+        }
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && errno == EAGAIN)
+            break;
+        /* a forked subshell may share the pipe: unwatch it explicitly */
+        ev_del(c->fd);
+        close(c->fd);
+        c->fd = -1;
+        cap_live--;
+    }
+    return got;
+}
+
+/*
+ * cap_child - in a child of the job, once wfd is on its stdout and
+ *     stderr: close both ends of the pipe.  They are close-on-exec, but
+ *     a subshell, function, builtin or filter never execs, and would
+ *     keep the pipe open past its exit in whatever it forks.
+ */
+void cap_child(struct capture *c, int wfd) {
+    if (wfd > 2)
+        close(wfd);
+    if (c->fd > 2)
+        close(c->fd);
+}
+
+/*
+ * cap_close - the job is deleted: take what is left in the pipe and
+ *     release the buffer, keeping only the memfd for `output`.
+ */
+void cap_close(struct capture *c) {
+    int i;
+
+    for (i = 0; i < 16 && c->fd >= 0 && cap_drain(c) > 0; i++)
+        ;
+    if (c->fd >= 0) {
+        /* still held open by something the job left behind */
+        ev_del(c->fd);
+        close(c->fd);
+        c->fd = -1;
+        cap_live--;
+    }
+    if (c->len > 0)
+        cap_spill(c);
+    if (c->buf != NULL)
+        munmap(c->buf, CAP_BUF);
+    c->buf = NULL;
+}
+
+/* cap_free - forget c altogether */
+void cap_free(struct capture *c) {
+    if (c == NULL)
+        return;
+    if (c->fd >= 0) {
+        ev_del(c->fd);
+        close(c->fd);
+        cap_live--;
+    }
+    if (c->memfd >= 0)
+        close(c->memfd);
+    if (c->buf != NULL)
+        munmap(c->buf, CAP_BUF);
+    munmap(c, sizeof(*c));
+}
+
+/* cap_read - up to n bytes of the output from offset off, which is kept */
+static ssize_t cap_read(const struct capture *c, long long off, char *buf,
+        size_t n) {
+    if (off >= c->hi) {
+        if (off - c->hi >= (long long)c->len)
+            return 0;
+        if (n > c->len - (off - c->hi))
+            n = c->len - (off - c->hi);
+        memcpy(buf, c->buf + (off - c->hi), n);
+        return n;
+    }
+    if ((long long)n > c->hi - off)
+        n = c->hi - off;
+    return pread(c->memfd, buf, n, off);
+}
+
+/*
+ * cap_copy - write the output from offset from (or the oldest kept) to
+ *     out.  Return the offset reached, or -1 if out failed.
+ */
+long long cap_copy(const struct capture *c, long long from, int out) {
+    char buf[8192];
+    ssize_t n, w, r;
+
+    if (from < c->lo)
+        from = c->lo;
+    while ((n = cap_read(c, from, buf, sizeof(buf))) > 0) {
+        for (w = 0; w < n; w += r) {
+            if ((r = write(out, buf + w, n - w)) < 0) {
+                if (errno != EINTR)
+                    return -1;
+                r = 0;
+            }
+        }
+        from += n;
+    }
+    return from;
+}
+
+/* cap_tail - offset where the last `lines` lines of the kept output start */
+long long cap_tail(const struct capture *c, int lines) {
+    char buf[8192];
+    long long end = c->hi + c->len, off = end, start;
+    ssize_t n, i;
+
+    if (lines <= 0)
+        return end;
+    /* a final line without its newline counts as a line too */
+    if (end > c->lo && cap_read(c, end - 1, buf, 1) == 1 && buf[0] == '\n')
+        off--;
+    while (off > c->lo) {
+        start = (off - (long long)sizeof(buf) > c->lo) ? off - (long long)sizeof(buf) : c->lo;
+        if (start < c->hi && off > c->hi)
+            start = c->hi;      /* one read: from the memfd or the buffer */
+        if ((n = cap_read(c, start, buf, off - start)) != off - start)
+            break;
+        for (i = n - 1; i >= 0; i--)
+            if (buf[i] == '\n' && --lines == 0)
+                return start + i + 1;
+        off = start;
+    }
+    return c->lo;
+}
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include "tinyshell.h"
+
+/*
+ * The shell sleeps in exactly one place: epoll_pwait on this set.
+ * Callers register the descriptors they care about (job pidfds, ...)
+ * tagged with a kind and an id, and get the tags back when they fire.
+ */
+static int epfd = -1;
+
+/*
+ * When several sessions share the thread (tsh --multi), ev_wait must
+ * not sleep itself: it calls ev_yield, which lets the other sessions
+ * run and comes back once our set may be ready or timeout ms passed.
+ */
+void (*ev_yield)(int fd, int timeout);
+
+static int ev_init(void) {
+    if (epfd < 0 && (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1");
+    return epfd;
+}
+
+/* watch fd for input; ev_wait reports it as (kind, id) */
+int ev_add(int fd, unsigned kind, unsigned id) {
+    struct epoll_event e;
+
+    e.events = EPOLLIN;
+    e.data.u64 = ((uint64_t)kind << 32) | id;
+    return epoll_ctl(ev_init(), EPOLL_CTL_ADD, fd, &e);
+}
+
+/* stop watching fd (closing it has the same effect) */
+void ev_del(int fd) {
+    if (epfd >= 0)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/*
+ * ev_wait - sleep until a watched fd is ready, a signal outside mask is
+ *     caught, or timeout ms pass (-1: forever).  Return the number of
+ *     events stored in evs, or -1 with errno EINTR.
+ */
+int ev_wait(struct ev *evs, int max, int timeout, const sigset_t *mask) {
+    struct epoll_event e[64];
+    int i, n;
+
+    if (max > 64)
+        max = 64;
+    if (ev_yield != NULL && timeout != 0) {
+        ev_yield(ev_init(), timeout);
+        timeout = 0;
+    }
+    n = epoll_pwait(ev_init(), e, max, timeout, mask);
+    for (i = 0; i < n; i++) {
+        evs[i].kind = e[i].data.u64 >> 32;
+        evs[i].id = (unsigned)e[i].data.u64;
+    }
+    return n;
+}
+
+/* ev_swap - install epoll set fd (-1: none yet), returning the old one */
+int ev_swap(int fd) {
+    int old = epfd;
+
+    epfd = fd;
+    return old;
+}
+
+/* children must not share our epoll set */
+void ev_close(void) {
+    if (epfd >= 0) {
+        close(epfd);
+        epfd = -1;
+    }
+}
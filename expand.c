@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glob.h>
+#include "tinyshell.h"
+
+struct arena scratch;
+
+/* positional parameters: pos_argv[1..pos_argc-1] are $1, $2, ... */
+static char *top_argv[] = { "tsh", NULL };
+int pos_argc = 1;
+char **pos_argv = top_argv;
+
+int expand_error;
+
+/* the field being assembled by expand_word */
+struct field {
+    char *buf;
+    size_t len, cap;
+    int present;            /* emit even if empty (quoted "" or "$x") */
+    int glob;               /* has unquoted *, ? or [ (X_GLOB) */
+    int flags;
+};
+
+static void field_putn(struct field *f, const char *s, size_t n) {
+    if (f->len + n + 1 > f->cap) {
+        while (f->len + n + 1 > f->cap)
+            f->cap = f->cap ? f->cap * 2 : 128;
+        if ((f->buf = realloc(f->buf, f->cap)) == NULL)
+            app_error("out of memory");
+    }
+    memcpy(f->buf + f->len, s, n);
+    f->len += n;
+    f->present = 1;
+}
+
+void strvec_push(struct strvec *sv, char *s) {
+    if (sv->n + 1 >= sv->cap) {
+        sv->cap = sv->cap ? sv->cap * 2 : 16;
+        if ((sv->v = realloc(sv->v, sv->cap * sizeof(char *))) == NULL)
+            app_error("out of memory");
+    }
+    sv->v[sv->n++] = s;
+    sv->v[sv->n] = NULL;
+}
+
+/*
+ * field_glob - emit a field built under X_GLOB: the sorted pathnames
+ *     it matches, or, with no unquoted glob character or no match, the
+ *     field itself with the escaping of quoted characters removed.
+ */
+static void field_glob(struct field *f, struct strvec *out) {
+    glob_t g;
+    size_t i;
+    char *s, *d;
+
+    if (f->glob && glob(f->buf, 0, NULL, &g) == 0) {
+        for (i = 0; i < g.gl_pathc; i++)
+            strvec_push(out, arena_strdup(&scratch, g.gl_pathv[i]));
+        globfree(&g);
+        return;
+    }
+    d = arena_strndup(&scratch, f->buf, f->len);
+    strvec_push(out, d);
+    for (s = d; *s; s++) {
+        if (*s == '\\' && s[1])
+            s++;
+        *d++ = *s;
+    }
+    *d = '\0';
+}
+
+static void field_emit(struct field *f, struct strvec *out) {
+    if (f->present) {
+        if (f->flags & X_GLOB) {
+            field_putn(f, "", 0);
+            f->buf[f->len] = '\0';
+            field_glob(f, out);
+        }
+        else
+            strvec_push(out, arena_strndup(&scratch, f->buf ? f->buf : "", f->len));
+    }
+    f->len = 0;
+    f->present = 0;
+    f->glob = 0;
+}
+
+/* append literal text, backslash-escaping glob characters if asked */
+static void field_lit(struct field *f, const char *s, size_t n, int escape) {
+    size_t i;
+
+    if (!escape) {
+        field_putn(f, s, n);
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        if (strchr("*?[]\\", s[i]))
+            field_putn(f, "\\", 1);
+        field_putn(f, &s[i], 1);
+    }
+    f->present = 1;
+}
+
+/*
+ * field_text - append unquoted text.  Under X_GLOB, note whether it has
+ *     glob characters, and escape backslashes so that they stay literal
+ *     in the pattern as they do in a plain word.
+ */
+static void field_text(struct field *f, const char *s, size_t n) {
+    size_t i, j;
+
+    if (!(f->flags & X_GLOB)) {
+        field_putn(f, s, n);
+        return;
+    }
+    for (i = j = 0; i < n; i++) {
+        if (s[i] == '\\') {
+            field_putn(f, s + j, i - j);
+            field_putn(f, "\\", 1);
+            j = i;
+        }
+        else if (strchr("*?[", s[i]))
+            f->glob = 1;
+    }
+    field_putn(f, s + j, n - j);
+}
+
+/* append an unquoted expansion, starting a new field at each blank */
+static void field_split(struct field *f, const char *s, struct strvec *out) {
+    const char *p;
+
+    while (*s) {
+        if (strchr(" \t\n", *s)) {
+            field_emit(f, out);
+            s++;
+            continue;
+        }
+        for (p = s; *p && !strchr(" \t\n", *p); p++)
+            ;
+        field_text(f, s, p - s);
+        s = p;
+    }
+}
+
+/* value of $?, $#, $$ ... (buf receives numeric results) */
+static const char *param_value(const char *name, char *buf, size_t size) {
+    switch (*name) {
+        case '?':
+            snprintf(buf, size, "%d", last_status);
+            return buf;
+        case '$':
+            snprintf(buf, size, "%d", (int)shell_pid);
+            return buf;
+        case '!':
+            if (last_bgpid == 0)
+                return "";
+            snprintf(buf, size, "%d", (int)last_bgpid);
+            return buf;
+        case '#':
+            snprintf(buf, size, "%d", pos_argc - 1);
+            return buf;
+        case '0':
+            if (name[1] == '\0')
+                return "tsh";
+            /* fall through */
+        default:
+            if (*name >= '0' && *name <= '9' && atoi(name) < pos_argc)
+                return pos_argv[atoi(name)];
+            return "";
+    }
+}
+
+/* value of $(( )): the expression is expanded first, then evaluated */
+static const char *arith_value(struct wpart *wp, char *buf, size_t size) {
+    const char *expr = wp->sub->text;
+    long long val;
+
+    if (!(wp->sub->flags & W_LITERAL))
+        expr = expand_str(wp->sub, 0);
+    if (arith_eval(expr, &val) < 0) {
+        expand_error = 1;
+        return "";
+    }
+    snprintf(buf, size, "%lld", val);
+    return buf;
+}
+
+/*
+ * expand_args - $@ and $*.  Quoted "$@" yields one field per parameter
+ *     and quoted "$*" joins them with spaces.
+ */
+static void expand_args(struct field *f, struct wpart *wp, int flags,
+        struct strvec *out) {
+    int i;
+
+    for (i = 1; i < pos_argc; i++) {
+        if (i > 1) {
+            if (wp->quoted && wp->text[0] == '@')
+                field_emit(f, out);
+            else if (wp->quoted || !(flags & X_SPLIT))
+                field_putn(f, " ", 1);
+            else
+                field_emit(f, out);
+        }
+        if (wp->quoted)
+            field_lit(f, pos_argv[i], strlen(pos_argv[i]),
+                    flags & (X_PATTERN | X_GLOB));
+        else if (flags & X_SPLIT)
+            field_split(f, pos_argv[i], out);
+        else
+            field_text(f, pos_argv[i], strlen(pos_argv[i]));
+    }
+}
+
+/*
+ * expand_word - expand w and append the resulting fields to out.
+ *
+ * Strings are allocated from the scratch arena; literal words are
+ * passed through without copying.  Return the number of fields added.
+ */
+int expand_word(struct word *w, int flags, struct strvec *out) {
+    struct field f = { NULL, 0, 0, 0, 0, flags };
+    struct wpart *wp;
+    char num[32], *owned;
+    const char *val;
+    int i, n = out->n;
+
+    if ((w->flags & W_LITERAL) &&
+            !((flags & X_PATTERN) && (w->flags & W_QUOTED)) &&
+            !((flags & X_GLOB) && strpbrk(w->text, "*?["))) {
+        strvec_push(out, (char *)w->text);
+        return 1;
+    }
+
+    for (i = 0; i < w->nparts; i++) {
+        wp = &w->parts[i];
+        if (wp->type == WP_LIT) {
+            if (wp->quoted)
+                field_lit(&f, wp->text, wp->len, flags & (X_PATTERN | X_GLOB));
+            else
+                field_text(&f, wp->text, wp->len);
+            continue;
+        }
+        if (wp->type == WP_PARAM && (wp->text[0] == '@' || wp->text[0] == '*')) {
+            /* "$@" with no parameters expands to no field at all */
+            if (pos_argc == 1 && w->nparts == 1) {
+                free(f.buf);
+                return 0;
+            }
+            expand_args(&f, wp, flags, out);
+            continue;
+        }
+        owned = NULL;
+        if (wp->type == WP_VAR)
+            val = var_get(wp->text);
+        else if (wp->type == WP_ARITH)
+            val = arith_value(wp, num, sizeof(num));
+        else if (wp->type == WP_CMDSUB)
+            val = owned = cmd_subst(wp->cmd);
+        else
+            val = param_value(wp->text, num, sizeof(num));
+        if (val == NULL)
+            val = "";
+        if (wp->quoted) {
+            field_lit(&f, val, strlen(val), flags & (X_PATTERN | X_GLOB));
+            f.present = 1;
+        }
+        else if (flags & X_SPLIT)
+            field_split(&f, val, out);
+        else
+            field_text(&f, val, strlen(val));
+        free(owned);
+    }
+    if (w->flags & W_QUOTED)
+        f.present = 1;
+    if (!(flags & X_SPLIT))
+        f.present = 1;
+    field_emit(&f, out);
+    free(f.buf);
+    return out->n - n;
+}
+
+/* expand w to a single string without field splitting */
+char *expand_str(struct word *w, int flags) {
+    struct strvec sv = { 0 };
+    char *s;
+
+    expand_word(w, flags & ~(X_SPLIT | X_GLOB), &sv);
+    s = sv.v[0];
+    free(sv.v);
+    return s;
+}
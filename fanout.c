@@ -0,0 +1,114 @@
+#define _GNU_SOURCE     /* tee, splice */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include "tinyshell.h"
+
+/*
+ * fanout - copy pipe in to each of the n pipes in out, for prod |+ a |+ b.
+ *
+ * Data never enters user space.  Each round, tee(2) duplicates what
+ * is in `in` into a private pipe per consumer, and splice(2) moves it
+ * into the last one, which consumes it from `in`.  The private pipes
+ * are empty and as large as `in`, so every copy takes the whole
+ * round.  That cannot be guaranteed for the consumers' own pipes,
+ * and tee cannot resume part way.  Each private pipe is then spliced
+ * to its consumer as that consumer makes room, so a slow consumer
+ * does not hold back the others within a round.  No new round starts
+ * until all are drained, so the slowest consumer sets the pace for
+ * the producer: backpressure, with at most one pipeful in flight.
+ * A consumer that exits is dropped, and the others go on.
+ *
+ * Runs in the forked fan-out process of the job; returns its status.
+ */
+int fanout(int in, int *out, int n) {
+    int priv[MAXPIPES][2];
+    size_t pending[MAXPIPES];
+    struct pollfd pfd[MAXPIPES];
+    int who[MAXPIPES];
+    int size, k, first, last, live = n, np, i;
+    ssize_t m, r;
+
+    signal(SIGPIPE, SIG_IGN);
+    if ((size = fcntl(in, F_GETPIPE_SZ)) < 0)
+        size = 65536;
+    for (k = 0; k < n; k++) {
+        if (pipe2(priv[k], O_CLOEXEC) < 0) {
+            perror("tsh: fan-out: pipe");
+            return 1;
+        }
+        fcntl(priv[k][1], F_SETPIPE_SZ, size);
+    }
+
+    while (live > 0) {
+        for (first = 0; out[first] < 0; first++)
+            ;
+        for (last = n - 1; out[last] < 0; last--)
+            ;
+        /* wait for input; the first copy tells how much this round is */
+        if (first == last)
+            m = splice(in, NULL, priv[last][1], NULL, size, SPLICE_F_MOVE);
+        else
+            m = tee(in, priv[first][1], size, 0);
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m <= 0)
+            break;
+        for (k = first + 1; k < last; k++)
+            if (out[k] >= 0 && tee(in, priv[k][1], m, 0) != m)
+                goto fail;
+        for (r = 0; first != last && r < m; r += i) {
+            if ((i = splice(in, NULL, priv[last][1], NULL, m - r, SPLICE_F_MOVE)) <= 0)
+                goto fail;
+        }
+        for (k = 0; k < n; k++)
+            pending[k] = (out[k] >= 0) ? m : 0;
+
+        /* drain the private pipes as the consumers take it */
+        for (;;) {
+            for (k = 0, np = 0; k < n; k++) {
+                if (pending[k] > 0) {
+                    pfd[np].fd = out[k];
+                    pfd[np].events = POLLOUT;
+                    who[np++] = k;
+                }
+            }
+            if (np == 0)
+                break;
+            if (poll(pfd, np, -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                goto fail;
+            }
+            for (i = 0; i < np; i++) {
+                k = who[i];
+                if (pfd[i].revents == 0)
+                    continue;
+                r = splice(priv[k][0], NULL, out[k], NULL, pending[k],
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (r > 0)
+                    pending[k] -= r;
+                else if (r < 0 && (errno == EAGAIN || errno == EINTR))
+                    continue;
+                else {
+                    /* the consumer is gone: stop feeding it */
+                    close(out[k]);
+                    close(priv[k][0]);
+                    close(priv[k][1]);
+                    out[k] = -1;
+                    pending[k] = 0;
+                    live--;
+                }
+            }
+        }
+    }
+    return 0;
+
+fail:
+    perror("tsh: fan-out");
+    return 1;
+}
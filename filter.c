@@ -0,0 +1,678 @@
+#define _GNU_SOURCE     /* memrchr, memmem */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FILTER_X86
+#endif
+#include "tinyshell.h"
+
+/*
+ * In-process filters - grep -F, grep -c, wc -l, head -n and tail -n
+ * are the commonest pipeline stages, and little more than a loop over
+ * a buffer.  A forked stage whose command is one of them, called by
+ * its bare name and with options that are handled here, runs the loop
+ * itself instead of exec'ing the tool.  Anything else, or a path like
+ * /usr/bin/grep, execs as before.
+ *
+ * The name must also resolve, the way it would be exec'd, to the
+ * system's own tool: the same file as /usr/bin/NAME or /bin/NAME.  A
+ * wc of the user's, earlier in PATH or in the current directory, runs
+ * as itself.
+ *
+ * Input is read in large aligned blocks, and the inner loops - counting
+ * newlines and finding a fixed string - have SSE2 and AVX2 versions,
+ * picked by what the CPU has on first use.  Input is taken as bytes,
+ * as grep -a and LC_ALL=C would.
+ */
+
+#define FBUF  (1 << 18)     /* read size; a buffer grows for longer lines */
+#define OBUF  (1 << 16)
+
+/* kernels - scalar versions first, also for the tails of the vector ones */
+static size_t count_nl_scalar(const char *p, size_t n) {
+    const char *end = p + n;
+    size_t c = 0;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        c++;
+        p++;
+    }
+    return c;
+}
+
+static const char *search_scalar(const char *p, size_t n, const char *s,
+        size_t k) {
+    return memmem(p, n, s, k);
+}
+
+#ifdef FILTER_X86
+__attribute__((target("sse2")))
+static size_t count_nl_sse2(const char *p, size_t n) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    __m128i acc, sum = _mm_setzero_si128();
+    size_t i = 0;
+    int k;
+
+    while (i + 16 <= n) {
+        /* byte lanes hold up to 255 matches before they are summed */
+        acc = _mm_setzero_si128();
+        for (k = 0; k < 255 && i + 16 <= n; k++, i += 16)
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(
+                        _mm_loadu_si128((const __m128i *)(p + i)), nl));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(acc, _mm_setzero_si128()));
+    }
+    return _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)) +
+        count_nl_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t count_nl_avx2(const char *p, size_t n) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    __m256i acc0, acc1, sum = _mm256_setzero_si256();
+    size_t i = 0;
+    int k;
+
+    while (i + 64 <= n) {
+        acc0 = acc1 = _mm256_setzero_si256();
+        for (k = 0; k < 255 && i + 64 <= n; k++, i += 64) {
+            acc0 = _mm256_sub_epi8(acc0, _mm256_cmpeq_epi8(
+                        _mm256_loadu_si256((const __m256i *)(p + i)), nl));
+            acc1 = _mm256_sub_epi8(acc1, _mm256_cmpeq_epi8(
+                        _mm256_loadu_si256((const __m256i *)(p + i + 32)), nl));
+        }
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(acc0, _mm256_setzero_si256()));
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(acc1, _mm256_setzero_si256()));
+    }
+    return _mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1) +
+        _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3) +
+        count_nl_scalar(p + i, n - i);
+}
+
+/*
+ * The searches compare a block of positions at once against the first
+ * and the last byte of s; only where both match is the rest compared.
+ */
+__attribute__((target("sse2")))
+static const char *search_sse2(const char *p, size_t n, const char *s,
+        size_t k) {
+    __m128i first, last, eq;
+    unsigned mask;
+    size_t i;
+
+    if (k < 2)
+        return (k == 0) ? p : memchr(p, s[0], n);
+    first = _mm_set1_epi8(s[0]);
+    last = _mm_set1_epi8(s[k - 1]);
+    for (i = 0; i + k - 1 + 16 <= n; i += 16) {
+        eq = _mm_and_si128(
+                _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i *)(p + i))),
+                _mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i *)(p + i + k - 1))));
+        for (mask = _mm_movemask_epi8(eq); mask != 0; mask &= mask - 1)
+            if (memcmp(p + i + __builtin_ctz(mask) + 1, s + 1, k - 2) == 0)
+                return p + i + __builtin_ctz(mask);
+    }
+    return search_scalar(p + i, n - i, s, k);
+}
+
+__attribute__((target("avx2")))
+static const char *search_avx2(const char *p, size_t n, const char *s,
+        size_t k) {
+    __m256i first, last, eq;
+    unsigned mask;
+    size_t i;
+
+    if (k < 2)
+        return (k == 0) ? p : memchr(p, s[0], n);
+    first = _mm256_set1_epi8(s[0]);
+    last = _mm256_set1_epi8(s[k - 1]);
+    for (i = 0; i + k - 1 + 32 <= n; i += 32) {
+        eq = _mm256_and_si256(
+                _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i *)(p + i))),
+                _mm256_cmpeq_epi8(last, _mm256_loadu_si256((const __m256i *)(p + i + k - 1))));
+        for (mask = _mm256_movemask_epi8(eq); mask != 0; mask &= mask - 1)
+            if (memcmp(p + i + __builtin_ctz(mask) + 1, s + 1, k - 2) == 0)
+                return p + i + __builtin_ctz(mask);
+    }
+    return search_scalar(p + i, n - i, s, k);
+}
+#endif
+
+static size_t (*count_nl)(const char *p, size_t n);
+static const char *(*search)(const char *p, size_t n, const char *s, size_t k);
+
+static void kernels_init(void) {
+    count_nl = count_nl_scalar;
+    search = search_scalar;
+#ifdef FILTER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        count_nl = count_nl_avx2;
+        search = search_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        count_nl = count_nl_sse2;
+        search = search_sse2;
+    }
+#endif
+}
+
+/* buffered output to fd 1; a failed write ends the filter with status 2 */
+static char obuf[OBUF];
+static size_t olen;
+static int oerr;
+
+static void out_raw(const char *p, size_t n) {
+    ssize_t r;
+
+    while (n > 0 && !oerr) {
+        if ((r = write(STDOUT_FILENO, p, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            oerr = errno;
+            break;
+        }
+        p += r;
+        n -= r;
+    }
+}
+
+static void out_flush(void) {
+    out_raw(obuf, olen);
+    olen = 0;
+}
+
+static void out(const char *p, size_t n) {
+    if (olen + n > OBUF) {
+        out_flush();
+        if (n >= OBUF) {
+            out_raw(p, n);
+            return;
+        }
+    }
+    memcpy(obuf + olen, p, n);
+    olen += n;
+}
+
+/* out_end - flush; return status, or 2 with a message if output failed */
+static int out_end(const char *cmd, int status) {
+    out_flush();
+    if (oerr) {
+        fprintf(stderr, "%s: write error: %s\n", cmd, strerror(oerr));
+        return 2;
+    }
+    return status;
+}
+
+/* input: buf[off, len) is read but not consumed */
+struct input {
+    int fd;
+    char *buf;
+    size_t cap, off, len;
+    int eof;
+};
+
+static char *abuf(size_t size) {
+    void *p = NULL;
+
+    if (posix_memalign(&p, 64, size + 1) != 0)
+        app_error("out of memory");
+    return p;
+}
+
+static void in_init(struct input *in, int fd) {
+    in->fd = fd;
+    in->cap = FBUF;
+    in->buf = abuf(in->cap);
+    in->off = in->len = 0;
+    in->eof = 0;
+}
+
+/*
+ * in_fill - move what is unconsumed to the front and read more after
+ *     it, growing the buffer if it is full.  Return bytes read, 0 at EOF
+ *     or -1 on error.
+ */
+static ssize_t in_fill(struct input *in) {
+    char *nbuf;
+    ssize_t r;
+
+    if (in->off > 0) {
+        memmove(in->buf, in->buf + in->off, in->len - in->off);
+        in->len -= in->off;
+        in->off = 0;
+    }
+    if (in->len == in->cap) {
+        nbuf = abuf(in->cap * 2);
+        memcpy(nbuf, in->buf, in->len);
+        free(in->buf);
+        in->buf = nbuf;
+        in->cap *= 2;
+    }
+    while ((r = read(in->fd, in->buf + in->len, in->cap - in->len)) < 0 &&
+            errno == EINTR)
+        ;
+    if (r > 0)
+        in->len += r;
+    else if (r == 0)
+        in->eof = 1;
+    return r;
+}
+
+/* open_arg - fd for a file operand ("-" is stdin), or -1 (reported) */
+static int open_arg(const char *cmd, const char *name, const char *fmt) {
+    int fd;
+
+    if (strcmp(name, "-") == 0)
+        return STDIN_FILENO;
+    if ((fd = open(name, O_RDONLY | O_CLOEXEC)) < 0)
+        fprintf(stderr, fmt, cmd, name, strerror(errno));
+    return fd;
+}
+
+/* count - the N of -n N or -N, all digits; -1 if not that */
+static long long count_arg(const char *s) {
+    const char *p;
+
+    for (p = s; isdigit((unsigned char)*p); p++)
+        ;
+    return (p == s || *p != '\0' || p - s > 18) ? -1 : atoll(s);
+}
+
+/*
+ * grep [-Fcv] pattern [file ...]
+ *     Without -F the pattern must have no regex characters, and so
+ *     means the same.  With several files, lines are prefixed name:.
+ */
+struct grep {
+    const char *pat;
+    size_t k;
+    int count, invert;
+    const char *prefix;     /* "name:" before each line, or NULL */
+};
+
+/* grep_lines - select among the whole lines in p[0, n) */
+static long long grep_lines(const struct grep *g, const char *p, size_t n) {
+    const char *end = p + n, *m, *ls, *le, *q;
+    long long sel = 0;
+
+    while (p < end) {
+        /* the next match and the start of its line */
+        if ((m = search(p, end - p, g->pat, g->k)) == NULL)
+            ls = m = end;
+        else if ((ls = memrchr(p, '\n', m - p)) == NULL)
+            ls = p;
+        else
+            ls++;
+        /* p[0, ls) is lines that do not match */
+        if (g->invert && ls > p) {
+            sel += count_nl(p, ls - p);
+            if (!g->count && g->prefix == NULL)
+                out(p, ls - p);
+            for (q = p; !g->count && g->prefix != NULL && q < ls; q = le) {
+                le = (const char *)memchr(q, '\n', ls - q) + 1;
+                out(g->prefix, strlen(g->prefix));
+                out(q, le - q);
+            }
+        }
+        if (m == end)
+            break;
+        le = (const char *)memchr(m, '\n', end - m) + 1;
+        if (!g->invert) {
+            sel++;
+            if (!g->count) {
+                if (g->prefix != NULL)
+                    out(g->prefix, strlen(g->prefix));
+                out(ls, le - ls);
+            }
+        }
+        p = le;
+    }
+    return sel;
+}
+
+/* grep_fd - run g over fd; return the lines selected, or -1 on error */
+static long long grep_fd(const struct grep *g, int fd) {
+    struct input in;
+    const char *nl;
+    long long sel = 0;
+    size_t end;
+    ssize_t r;
+
+    in_init(&in, fd);
+    do {
+        if ((r = in_fill(&in)) < 0)
+            break;
+        if (in.eof) {
+            /* a last line without a newline is output with one */
+            if (in.len > 0 && in.buf[in.len - 1] != '\n')
+                in.buf[in.len++] = '\n';    /* abuf left room */
+            end = in.len;
+        }
+        else if ((nl = memrchr(in.buf, '\n', in.len)) == NULL)
+            continue;
+        else
+            end = nl + 1 - in.buf;
+        sel += grep_lines(g, in.buf, end);
+        in.off = end;
+    } while (!in.eof && !oerr);
+    free(in.buf);
+    return (r < 0) ? -1 : sel;
+}
+
+static int filter_grep(int argc, char **argv) {
+    struct grep g = { NULL, 0, 0, 0, NULL };
+    char prefix[MAXLINE], num[32];
+    const char *s;
+    long long sel;
+    int i, fd, fixed = 0, nfiles, status = 1;
+
+    for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (s = argv[i] + 1; *s; s++) {
+            if (*s == 'F')
+                fixed = 1;
+            else if (*s == 'c')
+                g.count = 1;
+            else if (*s == 'v')
+                g.invert = 1;
+            else
+                return -1;
+        }
+    }
+    if (i >= argc || strchr(argv[i], '\n') != NULL ||
+            (!fixed && strpbrk(argv[i], "\\.[]*^$") != NULL))
+        return -1;
+    g.pat = argv[i++];
+    g.k = strlen(g.pat);
+    nfiles = argc - i;
+
+    kernels_init();
+    for (; i < argc || nfiles == 0; i++) {
+        if (nfiles == 0)
+            fd = STDIN_FILENO;
+        else if ((fd = open_arg("grep", argv[i], "%s: %s: %s\n")) < 0) {
+            status = 2;
+            continue;
+        }
+        if (nfiles > 1 && !g.count) {
+            snprintf(prefix, sizeof(prefix), "%s:", argv[i]);
+            g.prefix = prefix;
+        }
+        if ((sel = grep_fd(&g, fd)) < 0) {
+            fprintf(stderr, "grep: %s: %s\n",
+                    nfiles ? argv[i] : "(standard input)", strerror(errno));
+            status = 2;
+        }
+        else if (sel > 0 && status == 1)
+            status = 0;
+        if (g.count && sel >= 0) {
+            if (nfiles > 1) {
+                out(argv[i], strlen(argv[i]));
+                out(":", 1);
+            }
+            out(num, snprintf(num, sizeof(num), "%lld\n", sel));
+        }
+        if (fd != STDIN_FILENO)
+            close(fd);
+        if (nfiles == 0 || oerr)
+            break;
+    }
+    return out_end("grep", status);
+}
+
+/* wc -l [file] */
+static int filter_wc(int argc, char **argv) {
+    char *buf, num[32];
+    long long lines = 0;
+    ssize_t r;
+    int fd = STDIN_FILENO;
+
+    if (argc < 2 || argc > 3 || strcmp(argv[1], "-l") != 0)
+        return -1;
+    if (argc == 3 && (fd = open_arg("wc", argv[2], "%s: %s: %s\n")) < 0)
+        return 1;
+
+    kernels_init();
+    buf = abuf(FBUF);
+    while ((r = read(fd, buf, FBUF)) != 0) {
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            fprintf(stderr, "wc: %s: %s\n", (argc == 3) ? argv[2] : "-",
+                    strerror(errno));
+            return 1;
+        }
+        lines += count_nl(buf, r);
+    }
+    out(num, snprintf(num, sizeof(num), "%lld", lines));
+    if (argc == 3) {
+        out(" ", 1);
+        out(argv[2], strlen(argv[2]));
+    }
+    out("\n", 1);
+    return out_end("wc", 0);
+}
+
+/* lines_arg - N of head or tail [-n N | -nN | -N] [file]; -1 if not that */
+static long long lines_arg(int argc, char **argv, const char **file) {
+    long long n = 10;
+    int i = 1;
+
+    *file = NULL;
+    if (i < argc && strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+        n = count_arg(argv[i + 1]);
+        i += 2;
+    }
+    else if (i < argc && strncmp(argv[i], "-n", 2) == 0)
+        n = count_arg(argv[i++] + 2);
+    else if (i < argc && argv[i][0] == '-' && isdigit((unsigned char)argv[i][1]))
+        n = count_arg(argv[i++] + 1);
+    if (i < argc && strcmp(argv[i], "--") == 0)
+        i++;
+    if (i < argc - 1 || (i < argc && argv[i][0] == '-' && argv[i][1] != '\0'))
+        return -1;
+    if (i < argc)
+        *file = argv[i];
+    return n;
+}
+
+/*
+ * head [-n N] [file]
+ *     Seekable input is left just after the last line output, so that
+ *     the next reader of a shared file starts there.
+ */
+static int filter_head(int argc, char **argv) {
+    const char *file, *p, *end;
+    char *buf;
+    long long left;
+    ssize_t r;
+    size_t c;
+    int fd = STDIN_FILENO;
+
+    if ((left = lines_arg(argc, argv, &file)) < 0)
+        return -1;
+    if (file != NULL && (fd = open_arg("head",
+                    file, "%s: cannot open '%s' for reading: %s\n")) < 0)
+        return 1;
+
+    kernels_init();
+    buf = abuf(FBUF);
+    while (left > 0 && (r = read(fd, buf, FBUF)) != 0) {
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            fprintf(stderr, "head: error reading '%s': %s\n",
+                    file ? file : "standard input", strerror(errno));
+            return 1;
+        }
+        if ((c = count_nl(buf, r)) < (size_t)left) {
+            out(buf, r);
+            left -= c;
+            continue;
+        }
+        for (p = buf, end = buf + r; left > 0; left--)
+            p = (const char *)memchr(p, '\n', end - p) + 1;
+        out(buf, p - buf);
+        lseek(fd, p - end, SEEK_CUR);
+    }
+    return out_end("head", 0);
+}
+
+/* last_lines - offset in p[0, n) where its last `lines` lines start */
+static size_t last_lines(const char *p, size_t n, long long lines) {
+    const char *q;
+    size_t end = n;
+
+    /* a final newline ends the last line rather than starting one */
+    if (end > 0 && p[end - 1] == '\n')
+        end--;
+    for (; lines > 0; lines--) {
+        if ((q = memrchr(p, '\n', end)) == NULL)
+            return 0;
+        end = q - p;
+    }
+    return end + 1;
+}
+
+/* tail_file - tail of a regular file from offset from, read backwards */
+static int tail_file(int fd, off_t from, off_t size, long long lines) {
+    char *buf = abuf(FBUF);
+    const char *q;
+    off_t pos = size, start = from;
+    ssize_t r = 0;
+    size_t n, end;
+
+    while (pos > from) {
+        n = (pos - from > FBUF) ? FBUF : pos - from;
+        if ((r = pread(fd, buf, n, pos - n)) != (ssize_t)n) {
+            r = -1;
+            break;
+        }
+        end = n;
+        /* a final newline ends the last line rather than starting one */
+        if (pos == size && buf[end - 1] == '\n')
+            end--;
+        while (lines > 0 && (q = memrchr(buf, '\n', end)) != NULL) {
+            end = q - buf;
+            lines--;
+        }
+        if (lines == 0) {
+            start = pos - n + end + 1;
+            break;
+        }
+        pos -= n;
+    }
+    for (pos = start; r >= 0 && pos < size && !oerr; pos += r)
+        if ((r = pread(fd, buf, FBUF, pos)) > 0)
+            out(buf, r);
+        else
+            r = -1;
+    free(buf);
+    return (r < 0) ? -1 : 0;
+}
+
+/*
+ * tail [-n N] [file]
+ *     From the end of a regular file; other input is kept in a buffer
+ *     that drops what is before the last N lines whenever it fills.
+ */
+static int filter_tail(int argc, char **argv) {
+    struct input in;
+    struct stat st;
+    const char *file;
+    long long lines;
+    off_t from;
+    size_t keep;
+    int fd = STDIN_FILENO, rc = 0;
+
+    if ((lines = lines_arg(argc, argv, &file)) < 0)
+        return -1;
+    if (file != NULL && (fd = open_arg("tail",
+                    file, "%s: cannot open '%s' for reading: %s\n")) < 0)
+        return 1;
+
+    kernels_init();
+    if (lines == 0)
+        return 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            (from = lseek(fd, 0, SEEK_CUR)) >= 0)
+        rc = tail_file(fd, from, st.st_size, lines);
+    else {
+        in_init(&in, fd);
+        while (rc == 0 && !in.eof) {
+            if (in.len == in.cap) {
+                /* a buffer of whole lines to drop: halve it, or grow */
+                keep = in.len - last_lines(in.buf, in.len, lines);
+                if (keep <= in.cap / 2)
+                    in.off = in.len - keep;
+            }
+            if (in_fill(&in) < 0)
+                rc = -1;
+        }
+        keep = last_lines(in.buf, in.len, lines);
+        if (rc == 0)
+            out(in.buf + keep, in.len - keep);
+        free(in.buf);
+    }
+    if (rc < 0) {
+        fprintf(stderr, "tail: error reading '%s': %s\n",
+                file ? file : "standard input", strerror(errno));
+        return 1;
+    }
+    return out_end("tail", 0);
+}
+
+static const struct {
+    const char *name;
+    int (*fn)(int argc, char **argv);
+} filters[] = {
+    { "grep", filter_grep },
+    { "wc",   filter_wc },
+    { "head", filter_head },
+    { "tail", filter_tail },
+    { NULL, NULL }
+};
+
+/* is path, where a command named name was found, the system's name? */
+static int system_tool(const char *path, const char *name) {
+    static const char *const dirs[] = { "/usr/bin/", "/bin/", NULL };
+    char sys[64];
+    struct stat st, sst;
+    int i;
+
+    if (stat(path, &st) < 0)
+        return 0;
+    for (i = 0; dirs[i] != NULL; i++) {
+        snprintf(sys, sizeof(sys), "%s%s", dirs[i], name);
+        if (stat(sys, &sst) == 0 && st.st_dev == sst.st_dev &&
+                st.st_ino == sst.st_ino)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * filter_run - run argv here if it is a filter in a form done here, in
+ *     a forked stage about to exec path for it; return its status, or
+ *     -1 to exec path after all.
+ */
+int filter_run(const char *path, int argc, char **argv) {
+    int i;
+
+    if (strchr(argv[0], '/') != NULL)
+        return -1;
+    for (i = 0; filters[i].name != NULL; i++)
+        if (strcmp(argv[0], filters[i].name) == 0)
+            return system_tool(path, argv[0]) ? filters[i].fn(argc, argv) : -1;
+    return -1;
+}
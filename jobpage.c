@@ -0,0 +1,89 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "tinyshell.h"
+#include "jobpage.h"
+
+/*
+ * Job status page - see jobpage.h for the layout and how to read it.
+ * The shell is its only writer: forked subshells, which run job
+ * tables of their own, inherit the mapping but leave it alone.  Writes
+ * may come from the SIGCHLD handler as well as from the main line, so
+ * SIGCHLD is blocked while the seqlock is held: a nested writer would
+ * make seq even again in the middle of an update.
+ */
+
+static struct jp_page *page;
+static size_t page_size;
+static char page_name[64];
+static pid_t page_owner;
+
+static void jobpage_close(void) {
+    /* children that call exit() inherit the atexit handler */
+    if (page != NULL && getpid() == page_owner)
+        shm_unlink(page_name);
+}
+
+/* jobpage_open - create /tsh.PID for MAXJOBS slots; -1 on failure */
+int jobpage_open(void) {
+    int fd;
+
+    page_owner = getpid();
+    snprintf(page_name, sizeof(page_name), "/tsh.%d", (int)page_owner);
+    page_size = sizeof(*page) + MAXJOBS * sizeof(struct jp_job);
+    if ((fd = shm_open(page_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+        return -1;
+    if (ftruncate(fd, page_size) < 0 ||
+            (page = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd, 0)) == MAP_FAILED) {
+        page = NULL;
+        close(fd);
+        shm_unlink(page_name);
+        return -1;
+    }
+    close(fd);
+    page->version = JP_VERSION;
+    page->pid = page_owner;
+    page->nslots = MAXJOBS;
+    __atomic_store_n(&page->magic, JP_MAGIC, __ATOMIC_RELEASE);
+    atexit(jobpage_close);
+    return 0;
+}
+
+/*
+ * jobpage_put - publish job, which is in slot of the job table, and
+ *     the table's top; a cleared job frees the slot.
+ */
+void jobpage_put(int slot, const struct job_t *job, int top) {
+    struct jp_job *j;
+    sigset_t set, old;
+
+    /* a forked subshell keeps the mapping, but its jobs are not ours */
+    if (page == NULL || slot < 0 || slot >= MAXJOBS || getpid() != page_owner)
+        return;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, &old);
+
+    __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    j = &page->jobs[slot];
+    j->pid = job->pid;
+    j->jid = job->jid;
+    j->state = job->state;
+    j->nprocs = job->nprocs;
+    j->nlive = job->nlive;
+    j->start_ns = job->start;
+    j->cpu_ns = job->cpu;
+    snprintf(j->cmd, sizeof(j->cmd), "%.*s",
+            (int)strcspn(job->cmdline, "\n"), job->cmdline);
+    page->top = top;
+    __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
@@ -0,0 +1,52 @@
+#ifndef _TSH_JOBPAGE_H
+#define _TSH_JOBPAGE_H
+
+/*
+ * jobpage.h - the job status page that tsh -s publishes
+ *
+ * tsh -s keeps a copy of its job table in the shared memory object
+ * /tsh.PID (/dev/shm/tsh.PID on Linux), updated at every job change,
+ * so a monitor can read it without running jobs or walking /proc.
+ * Readers map it read-only and copy out a snapshot:
+ *
+ *     do {
+ *         s = __atomic_load_n(&pg->seq, __ATOMIC_ACQUIRE);
+ *         ...copy the header and slots [0, top)...
+ *         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *     } while ((s & 1) || s != __atomic_load_n(&pg->seq, __ATOMIC_RELAXED));
+ *
+ * The shell bumps seq to odd before changing anything and to even
+ * after, so a copy made while seq stayed the same even value is
+ * consistent.  A slot with pid 0 is free.  Stale pages of shells that
+ * were killed can be told by kill(pg->pid, 0) failing.
+ */
+
+#include <stdint.h>
+
+#define JP_MAGIC    0x70687374u     /* "tshp" */
+#define JP_VERSION  1
+#define JP_CMDLEN   96
+
+struct jp_job {
+    int32_t pid;            /* process group leader, 0 if free */
+    int32_t jid;
+    int32_t state;          /* 1 FG, 2 BG, 3 ST, as in tinyshell.h */
+    int32_t nprocs;         /* pipeline stages */
+    int32_t nlive;          /* stages not reaped yet */
+    int32_t pad;
+    int64_t start_ns;       /* CLOCK_REALTIME when launched */
+    int64_t cpu_ns;         /* user + system CPU of the stages reaped */
+    char cmd[JP_CMDLEN];    /* command line, truncated, NUL-terminated */
+};
+
+struct jp_page {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;           /* seqlock: odd while the shell writes */
+    int32_t pid;            /* of the shell */
+    uint32_t top;           /* slots [0, top) may be in use */
+    uint32_t nslots;
+    struct jp_job jobs[];
+};
+
+#endif
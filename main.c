@@ -1,25 +1,64 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include "tinyshell.h"
 
 /* from tinyshell.o's data segment */
 extern int verbose;
 extern char prompt[];	/* external array */
-extern struct job_t jobs[MAXJOBS];
+extern struct job_t *jobs;
+
+/*
+ * readline - read one line (at most size-1 bytes) into buf.  Input is
+ *     read with read(2) into our own buffer rather than through stdio,
+ *     so that the shell can keep expiring job deadlines while it waits
+ *     for the user.  Return 0 at end of file.
+ */
+static int readline(char *buf, int size)
+{
+    static char in[MAXLINE];
+    static int pos, len;
+    int n = 0;
+
+    while (n < size - 1) {
+        if (pos == len) {
+            wait_input(STDIN_FILENO);
+            if ((len = read(STDIN_FILENO, in, sizeof(in))) < 0) {
+                len = pos = 0;
+                if (errno == EINTR)
+                    continue;
+                app_error("read error");
+            }
+            pos = 0;
+            if (len == 0)
+                break;
+        }
+        if ((buf[n++] = in[pos++]) == '\n')
+            break;
+    }
+    buf[n] = '\0';
+    return n > 0;
+}
 
 int main(int argc, char **argv)
 {
     char c;
     char cmdline[MAXLINE];
     int emit_prompt = 1;
+    int jobpage = 0;
+
+    /* many scripts in one process: see multi.c */
+    if (argc > 1 && strcmp(argv[1], "--multi") == 0)
+        return multi_main(argc - 1, argv + 1);
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF)
+    while ((c = getopt(argc, argv, "hvps")) != EOF)
     {
         switch (c)
         {
@@ -32,22 +71,25 @@ int main(int argc, char **argv)
             case 'p':
                 emit_prompt = 0;
                 break;
+            case 's':
+                jobpage = 1;
+                break;
             default:
                 usage();
         }
     }
     init();
+    if (jobpage && jobpage_open() < 0)
+        fprintf(stderr, "tsh: job status page: %s\n", strerror(errno));
     /* Execute the shell's read/eval loop */
     while (1)
     {
         if (emit_prompt)
         {
-            printf("%s", prompt);
+            printf("%s", eval_incomplete() ? "> " : prompt);
             fflush(stdout);
         }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin))    /* End of file (ctrl-d) */
+        if (!readline(cmdline, MAXLINE))    /* End of file (ctrl-d) */
         {
             fflush(stdout);
             exit(0);
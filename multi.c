@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include "tinyshell.h"
+#include "tsh.h"
+
+/*
+ * tsh --multi [-j n] [-f manifest] [script ...]
+ *
+ * Runs many scripts at once in this one process.  Each script gets a
+ * session of its own (tsh.h) and runs on a stack of its own.  Where a
+ * shell would sleep - waiting for a job, for $(...) output, for a
+ * deadline - ev_wait calls co_yield instead, which parks the script
+ * until its session's epoll set is ready and runs the others.  One
+ * epoll set here watches all of those sets.  So the cost of a script
+ * is its session and the stack pages it touches, while the builtin
+ * table, compiled arithmetic and the rest are shared.
+ *
+ * Scheduling is cooperative: a script switches only when it would
+ * sleep.  Jobs a script leaves running are killed when it ends.  The
+ * exit status is that of the first script (in order given) that
+ * failed, or 0.
+ */
+
+#define CO_STACK   (1 << 20)    /* bytes, committed only as touched */
+#define MAXEVENTS  64
+
+enum { READY, WAITING, DONE };
+
+struct script {
+    const char *name;
+    char *text;
+    struct tsh_session *s;
+    ucontext_t uc;
+    char *stack;
+    int state;
+    int status;
+    int fd;                 /* the session's epoll set, once added */
+    long long wake;         /* ms: resume by then anyway, or -1 */
+};
+
+static struct script *scripts;
+static int nscripts;
+static struct script *cur;      /* running now */
+static ucontext_t sched;        /* the scheduler's own context */
+static int sched_ep = -1;       /* watches every session's epoll set */
+
+static long long now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* co_yield - ev_wait would sleep on fd: run the other scripts meanwhile */
+static void co_yield(int fd, int timeout) {
+    struct script *sc = cur;
+    struct epoll_event e;
+
+    fflush(stdout);
+    e.events = EPOLLIN | EPOLLONESHOT;
+    e.data.ptr = sc;
+    if (epoll_ctl(sched_ep, (sc->fd == fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                fd, &e) < 0)
+        unix_error("epoll_ctl");
+    sc->fd = fd;
+    sc->wake = (timeout < 0) ? -1 : now_ms() + timeout;
+    sc->state = WAITING;
+    if (swapcontext(&sc->uc, &sched) < 0)
+        unix_error("swapcontext");
+}
+
+/* first function on a script's stack */
+static void co_main(void) {
+    cur->status = session_run(cur->name, cur->text);
+    cur->state = DONE;
+}
+
+static char *read_file(const char *path) {
+    FILE *fp;
+    char *buf;
+    size_t len = 0, cap = 4096, n;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return NULL;
+    if ((buf = malloc(cap)) == NULL)
+        app_error("out of memory");
+    while ((n = fread(buf + len, 1, cap - len - 1, fp)) > 0) {
+        len += n;
+        if (cap - len - 1 == 0 && (buf = realloc(buf, cap *= 2)) == NULL)
+            app_error("out of memory");
+    }
+    fclose(fp);
+    buf[len] = '\0';
+    return buf;
+}
+
+static int start(struct script *sc) {
+    if ((sc->text = read_file(sc->name)) == NULL) {
+        fprintf(stderr, "tsh: %s: %s\n", sc->name, strerror(errno));
+        return -1;
+    }
+    if ((sc->s = tsh_open()) == NULL) {
+        fprintf(stderr, "tsh: %s: cannot open a session: %s\n",
+                sc->name, strerror(errno));
+        return -1;
+    }
+    sc->stack = mmap(NULL, CO_STACK, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (sc->stack == MAP_FAILED)
+        unix_error("mmap");
+    mprotect(sc->stack, getpagesize(), PROT_NONE);     /* guard */
+    if (getcontext(&sc->uc) < 0)
+        unix_error("getcontext");
+    sc->uc.uc_stack.ss_sp = sc->stack;
+    sc->uc.uc_stack.ss_size = CO_STACK;
+    sc->uc.uc_link = &sched;
+    makecontext(&sc->uc, co_main, 0);
+    sc->fd = -1;
+    sc->state = READY;
+    return 0;
+}
+
+static void finish(struct script *sc) {
+    tsh_close(sc->s);
+    munmap(sc->stack, CO_STACK);
+    free(sc->text);
+    sc->s = NULL;
+    sc->stack = NULL;
+    sc->text = NULL;
+}
+
+/* run sc until it sleeps or ends */
+static void resume(struct script *sc) {
+    cur = sc;
+    session_enter(sc->s);
+    if (swapcontext(&sched, &sc->uc) < 0)
+        unix_error("swapcontext");
+    session_leave(sc->s);
+    cur = NULL;
+    if (sc->state == DONE)
+        finish(sc);
+}
+
+/* add the script paths listed in file, one per line, # for comments */
+static int read_manifest(const char *file, int *max) {
+    char *text = read_file(file), *line, *save = NULL;
+
+    if (text == NULL) {
+        fprintf(stderr, "tsh: %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    for (line = strtok_r(text, "\n", &save); line != NULL;
+            line = strtok_r(NULL, "\n", &save)) {
+        line += strspn(line, " \t");
+        if (*line == '#' || *line == '\0')
+            continue;
+        if (nscripts == *max &&
+                (scripts = realloc(scripts, (*max *= 2) * sizeof(*scripts))) == NULL)
+            app_error("out of memory");
+        memset(&scripts[nscripts], 0, sizeof(*scripts));
+        scripts[nscripts++].name = line;   /* text is never freed */
+    }
+    return 0;
+}
+
+static void multi_usage(void) {
+    fprintf(stderr, "Usage: tsh --multi [-j n] [-f manifest] [script ...]\n");
+    exit(2);
+}
+
+int multi_main(int argc, char **argv) {
+    struct epoll_event evs[MAXEVENTS];
+    struct script *sc;
+    long long now, next;
+    int i, n, c, max = 16, jobs = 0, running = 0, started = 0, left, status = 0;
+
+    if ((scripts = malloc(max * sizeof(*scripts))) == NULL)
+        app_error("out of memory");
+    optind = 1;
+    while ((c = getopt(argc, argv, "j:f:")) != -1) {
+        switch (c) {
+            case 'j':
+                if ((jobs = atoi(optarg)) < 1)
+                    multi_usage();
+                break;
+            case 'f':
+                if (read_manifest(optarg, &max) < 0)
+                    return 2;
+                break;
+            default:
+                multi_usage();
+        }
+    }
+    for (; optind < argc; optind++) {
+        if (nscripts == max &&
+                (scripts = realloc(scripts, (max *= 2) * sizeof(*scripts))) == NULL)
+            app_error("out of memory");
+        memset(&scripts[nscripts], 0, sizeof(*scripts));
+        scripts[nscripts++].name = argv[optind];
+    }
+    if (nscripts == 0)
+        multi_usage();
+
+    if ((sched_ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1");
+    ev_yield = co_yield;
+
+    for (left = nscripts; left > 0; ) {
+        /* start scripts while there is room, then run all that can */
+        while (started < nscripts && (jobs == 0 || running < jobs)) {
+            sc = &scripts[started++];
+            if (start(sc) < 0) {
+                sc->state = DONE;
+                sc->status = 127;
+                left--;
+                continue;
+            }
+            running++;
+        }
+        for (i = 0; i < started; i++) {
+            sc = &scripts[i];
+            if (sc->s != NULL && sc->state == READY) {
+                resume(sc);
+                if (sc->state == DONE) {
+                    running--;
+                    left--;
+                }
+            }
+        }
+        if (left == 0 || running == 0)
+            continue;
+
+        /* sleep until a session's set is ready or a timed wait is up */
+        next = -1;
+        for (i = 0; i < started; i++)
+            if (scripts[i].s != NULL && scripts[i].state == WAITING &&
+                    scripts[i].wake >= 0 && (next < 0 || scripts[i].wake < next))
+                next = scripts[i].wake;
+        now = now_ms();
+        n = epoll_wait(sched_ep, evs, MAXEVENTS,
+                (next < 0) ? -1 : (next > now) ? (int)(next - now) : 0);
+        if (n < 0 && errno != EINTR)
+            unix_error("epoll_wait");
+        for (i = 0; i < n; i++)
+            ((struct script *)evs[i].data.ptr)->state = READY;
+        now = now_ms();
+        for (i = 0; i < started; i++)
+            if (scripts[i].state == WAITING && scripts[i].wake >= 0 &&
+                    scripts[i].wake <= now)
+                scripts[i].state = READY;
+    }
+
+    for (i = 0; i < nscripts; i++) {
+        if (scripts[i].status != 0) {
+            status = scripts[i].status;
+            break;
+        }
+    }
+    fflush(stdout);
+    return status;
+}
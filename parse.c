@@ -0,0 +1,1536 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "tinyshell.h"
+
+/*
+ * Arena blocks - the first block is ARENA_MIN bytes and every new block
+ * is twice the size of the previous one.
+ */
+#define ARENA_MIN 4096
+#define ARENA_ALIGN 16
+
+struct arena_blk {
+    struct arena_blk *prev;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+void arena_init(struct arena *a) {
+    a->head = NULL;
+}
+
+void arena_free(struct arena *a) {
+    struct arena_blk *b, *prev;
+
+    for (b = a->head; b != NULL; b = prev) {
+        prev = b->prev;
+        free(b);
+    }
+    a->head = NULL;
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+    struct arena_blk *b = a->head;
+    size_t need;
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (b == NULL || b->size - b->used < size) {
+        need = (b == NULL) ? ARENA_MIN : b->size * 2;
+        while (need < size)
+            need *= 2;
+        if ((b = malloc(sizeof(*b) + need)) == NULL)
+            app_error("out of memory");
+        b->prev = a->head;
+        b->size = need;
+        b->used = 0;
+        a->head = b;
+    }
+    p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t len) {
+    char *p = arena_alloc(a, len + 1);
+
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+char *arena_strdup(struct arena *a, const char *s) {
+    return arena_strndup(a, s, strlen(s));
+}
+
+struct arena_mark arena_mark(struct arena *a) {
+    struct arena_mark m;
+
+    m.blk = a->head;
+    m.used = (a->head != NULL) ? a->head->used : 0;
+    return m;
+}
+
+/* drop everything allocated since the mark was taken */
+void arena_release(struct arena *a, struct arena_mark m) {
+    struct arena_blk *b;
+
+    while (a->head != m.blk) {
+        b = a->head;
+        a->head = b->prev;
+        free(b);
+    }
+    if (a->head != NULL)
+        a->head->used = m.used;
+}
+
+/*
+ * Lexer
+ */
+#define T_EOF       0
+#define T_ERR       1   /* lexical error or unterminated quote */
+#define T_WORD      2
+#define T_NL        3
+#define T_SEMI      4   /* ;  */
+#define T_DSEMI     5   /* ;; */
+#define T_AMP       6   /* &  */
+#define T_AND       7   /* && */
+#define T_PIPE      8   /* |  */
+#define T_OR        9   /* || */
+#define T_LPAREN   10
+#define T_RPAREN   11
+#define T_LESS     12   /* <  */
+#define T_GREAT    13   /* >  */
+#define T_DGREAT   14   /* >> */
+#define T_LESSAND  15   /* <& */
+#define T_GREATAND 16   /* >& */
+#define T_FAN      17   /* |+ */
+
+static const char *tok_names[] = {
+    "end of file", "error", "word", "newline", ";", ";;", "&", "&&",
+    "|", "||", "(", ")", "<", ">", ">>", "<&", ">&", "|+"
+};
+
+struct token {
+    int type;
+    int io_fd;              /* explicit fd of a redirection, or -1 */
+    struct word *word;
+    const char *start, *end;
+};
+
+struct lexer {
+    struct arena *a;
+    const char *p;
+    int incomplete;         /* ran out of input inside a quote */
+    /* scratch space for the word being built */
+    char *buf;
+    size_t len, cap;
+    int buf_quoted;
+    struct wpart *parts;
+    int nparts, maxparts;
+    int flags;
+};
+
+static void lex_putc(struct lexer *lx, char c) {
+    if (lx->len + 1 >= lx->cap) {
+        lx->cap = lx->cap ? lx->cap * 2 : 128;
+        if ((lx->buf = realloc(lx->buf, lx->cap)) == NULL)
+            app_error("out of memory");
+    }
+    lx->buf[lx->len++] = c;
+}
+
+static struct wpart *lex_newpart(struct lexer *lx) {
+    if (lx->nparts == lx->maxparts) {
+        lx->maxparts = lx->maxparts ? lx->maxparts * 2 : 8;
+        lx->parts = realloc(lx->parts, lx->maxparts * sizeof(*lx->parts));
+        if (lx->parts == NULL)
+            app_error("out of memory");
+    }
+    memset(&lx->parts[lx->nparts], 0, sizeof(*lx->parts));
+    return &lx->parts[lx->nparts++];
+}
+
+/* move pending literal text into its own part */
+static void lex_flush(struct lexer *lx) {
+    struct wpart *wp;
+
+    if (lx->len == 0)
+        return;
+    wp = lex_newpart(lx);
+    wp->type = WP_LIT;
+    wp->quoted = lx->buf_quoted;
+    wp->text = arena_strndup(lx->a, lx->buf, lx->len);
+    wp->len = lx->len;
+    lx->len = 0;
+}
+
+/* append a literal character, splitting parts where quoting changes */
+static void lex_lit(struct lexer *lx, char c, int quoted) {
+    if (lx->len > 0 && lx->buf_quoted != quoted)
+        lex_flush(lx);
+    lx->buf_quoted = quoted;
+    lex_putc(lx, c);
+    if (quoted)
+        lx->flags |= W_QUOTED;
+}
+
+static int is_name_start(int c) {
+    return isalpha(c) || c == '_';
+}
+
+static int is_name_char(int c) {
+    return isalnum(c) || c == '_';
+}
+
+static int is_special_param(int c) {
+    return c != '\0' && strchr("?#@*$!-", c) != NULL;
+}
+
+static int lex_arith(struct lexer *lx, int quoted);
+static int lex_cmdsub(struct lexer *lx, int quoted, int backq);
+
+/*
+ * lex_dollar - lex a '$' reference starting at lx->p (just past the '$').
+ * Return 0 on success, -1 on error.
+ */
+static int lex_dollar(struct lexer *lx, int quoted) {
+    const char *p = lx->p;
+    const char *name;
+    struct wpart *wp;
+    int type;
+
+    if (p[0] == '(' && p[1] == '(') {
+        lx->p += 2;
+        return lex_arith(lx, quoted);
+    }
+    if (*p == '(') {
+        lx->p++;
+        return lex_cmdsub(lx, quoted, 0);
+    }
+    if (*p == '{') {
+        name = ++p;
+        if (is_name_start(*p)) {
+            while (is_name_char(*p))
+                p++;
+            type = WP_VAR;
+        }
+        else if (isdigit(*p)) {
+            while (isdigit(*p))
+                p++;
+            type = WP_PARAM;
+        }
+        else if (is_special_param(*p)) {
+            p++;
+            type = WP_PARAM;
+        }
+        else
+            type = -1;
+        if (type < 0 || *p != '}') {
+            if (*p == '\0')
+                lx->incomplete = 1;
+            else
+                fprintf(stderr, "tsh: bad substitution\n");
+            return -1;
+        }
+        lx->p = p + 1;
+    }
+    else if (is_name_start(*p)) {
+        name = p;
+        while (is_name_char(*p))
+            p++;
+        type = WP_VAR;
+        lx->p = p;
+    }
+    else if (isdigit(*p) || is_special_param(*p)) {
+        name = p++;
+        type = WP_PARAM;
+        lx->p = p;
+    }
+    else {
+        /* a lone '$' is literal */
+        lex_lit(lx, '$', quoted);
+        return 0;
+    }
+
+    lex_flush(lx);
+    wp = lex_newpart(lx);
+    wp->type = type;
+    wp->quoted = quoted;
+    wp->text = arena_strndup(lx->a, name, p - name);
+    wp->len = p - name;
+    if (quoted)
+        lx->flags |= W_QUOTED;
+    return 0;
+}
+
+static struct word *lex_finish(struct lexer *lx);
+
+/*
+ * lex_arith - lex the body of $(( )) with lx->p just past the "((".
+ *     The body only undergoes parameter expansion, so it becomes a word
+ *     of its own, lexed from a copy by a nested lexer.
+ */
+static int lex_arith(struct lexer *lx, int quoted) {
+    struct lexer sub;
+    struct wpart *wp;
+    const char *p, *expr;
+    int depth = 0;
+    char c;
+
+    for (p = lx->p; ; p++) {
+        if (*p == '\0') {
+            lx->incomplete = 1;
+            return -1;
+        }
+        if (*p == '(')
+            depth++;
+        else if (*p == ')' && depth > 0)
+            depth--;
+        else if (*p == ')') {
+            if (p[1] != ')') {
+                fprintf(stderr, "tsh: missing `))'\n");
+                return -1;
+            }
+            break;
+        }
+    }
+
+    memset(&sub, 0, sizeof(sub));
+    sub.a = lx->a;
+    sub.p = expr = arena_strndup(lx->a, lx->p, p - lx->p);
+    lx->p = p + 2;
+    while ((c = *sub.p) != '\0') {
+        sub.p++;
+        if (c == '\\' && *sub.p != '\0')
+            lex_lit(&sub, *sub.p++, 1);
+        else if (c == '$') {
+            if (lex_dollar(&sub, 1) < 0) {
+                lx->incomplete |= sub.incomplete;
+                free(sub.buf);
+                free(sub.parts);
+                return -1;
+            }
+        }
+        else
+            lex_lit(&sub, c, 0);
+    }
+
+    lex_flush(lx);
+    wp = lex_newpart(lx);
+    wp->type = WP_ARITH;
+    wp->quoted = quoted;
+    wp->sub = lex_finish(&sub);
+    wp->text = expr;
+    wp->len = strlen(expr);
+    free(sub.buf);
+    free(sub.parts);
+    return 0;
+}
+
+static int is_word_end(int c) {
+    return c == '\0' || strchr(" \t\n;&|<>()", c) != NULL;
+}
+
+/*
+ * lex_word - build a word starting at lx->p.  Return NULL on error.
+ */
+static struct word *lex_word(struct lexer *lx) {
+    char c;
+
+    lx->len = 0;
+    lx->nparts = 0;
+    lx->flags = 0;
+    lx->buf_quoted = 0;
+
+    while (!is_word_end(c = *lx->p)) {
+        lx->p++;
+        if (c == '\\') {
+            if (*lx->p == '\n') {       /* line continuation */
+                lx->p++;
+                continue;
+            }
+            if (*lx->p == '\0') {
+                lx->incomplete = 1;
+                return NULL;
+            }
+            lex_lit(lx, *lx->p++, 1);
+        }
+        else if (c == '\'') {
+            lx->flags |= W_QUOTED;
+            while (*lx->p != '\'') {
+                if (*lx->p == '\0') {
+                    lx->incomplete = 1;
+                    return NULL;
+                }
+                lex_lit(lx, *lx->p++, 1);
+            }
+            lx->p++;
+        }
+        else if (c == '"') {
+            lx->flags |= W_QUOTED;
+            while ((c = *lx->p) != '"') {
+                if (c == '\0') {
+                    lx->incomplete = 1;
+                    return NULL;
+                }
+                lx->p++;
+                if (c == '\\' && *lx->p != '\0' && strchr("$`\"\\\n", *lx->p)) {
+                    if (*lx->p != '\n')
+                        lex_lit(lx, *lx->p, 1);
+                    lx->p++;
+                }
+                else if (c == '$') {
+                    if (lex_dollar(lx, 1) < 0)
+                        return NULL;
+                }
+                else if (c == '`') {
+                    if (lex_cmdsub(lx, 1, 1) < 0)
+                        return NULL;
+                }
+                else
+                    lex_lit(lx, c, 1);
+            }
+            lx->p++;
+        }
+        else if (c == '$') {
+            if (lex_dollar(lx, 0) < 0)
+                return NULL;
+        }
+        else if (c == '`') {
+            if (lex_cmdsub(lx, 0, 1) < 0)
+                return NULL;
+        }
+        else
+            lex_lit(lx, c, 0);
+    }
+    return lex_finish(lx);
+}
+
+/* turn the parts collected so far into a word */
+static struct word *lex_finish(struct lexer *lx) {
+    struct word *w;
+    char *text;
+    int i;
+
+    lex_flush(lx);
+
+    w = arena_alloc(lx->a, sizeof(*w));
+    w->flags = lx->flags;
+    w->nparts = lx->nparts;
+    w->parts = arena_alloc(lx->a, lx->nparts * sizeof(*w->parts));
+    memcpy(w->parts, lx->parts, lx->nparts * sizeof(*w->parts));
+    w->text = NULL;
+
+    for (i = 0; i < w->nparts; i++)
+        if (w->parts[i].type != WP_LIT)
+            break;
+    if (i == w->nparts) {
+        /* no expansions: precompute the final value */
+        w->flags |= W_LITERAL;
+        if (w->nparts == 0)
+            w->text = "";
+        else if (w->nparts == 1)
+            w->text = w->parts[0].text;
+        else {
+            size_t n = 0;
+            for (i = 0; i < w->nparts; i++)
+                n += w->parts[i].len;
+            w->text = text = arena_alloc(lx->a, n + 1);
+            for (i = 0; i < w->nparts; i++) {
+                memcpy(text, w->parts[i].text, w->parts[i].len);
+                text += w->parts[i].len;
+            }
+            *text = '\0';
+        }
+    }
+    return w;
+}
+
+/*
+ * lex - scan the next token
+ */
+static void lex(struct lexer *lx, struct token *t) {
+    const char *p;
+    char c;
+
+    t->io_fd = -1;
+    t->word = NULL;
+
+    for (;;) {
+        while (*lx->p == ' ' || *lx->p == '\t')
+            lx->p++;
+        if (lx->p[0] == '\\' && lx->p[1] == '\n')
+            lx->p += 2;
+        else if (*lx->p == '#') {
+            while (*lx->p && *lx->p != '\n')
+                lx->p++;
+        }
+        else
+            break;
+    }
+
+    t->start = lx->p;
+
+    /* an all-digit word directly followed by a redirection is an fd */
+    for (p = lx->p; isdigit(*p); p++)
+        ;
+    if (p != lx->p && (*p == '<' || *p == '>')) {
+        t->io_fd = atoi(lx->p);
+        lx->p = p;
+    }
+
+    switch (c = *lx->p) {
+        case '\0':
+            t->type = T_EOF;
+            break;
+        case '\n':
+            lx->p++;
+            t->type = T_NL;
+            break;
+        case ';':
+            lx->p++;
+            t->type = T_SEMI;
+            if (*lx->p == ';') {
+                lx->p++;
+                t->type = T_DSEMI;
+            }
+            break;
+        case '&':
+            lx->p++;
+            t->type = T_AMP;
+            if (*lx->p == '&') {
+                lx->p++;
+                t->type = T_AND;
+            }
+            break;
+        case '|':
+            lx->p++;
+            t->type = T_PIPE;
+            if (*lx->p == '|') {
+                lx->p++;
+                t->type = T_OR;
+            }
+            else if (*lx->p == '+') {
+                lx->p++;
+                t->type = T_FAN;
+            }
+            break;
+        case '(':
+            lx->p++;
+            t->type = T_LPAREN;
+            break;
+        case ')':
+            lx->p++;
+            t->type = T_RPAREN;
+            break;
+        case '<':
+            lx->p++;
+            t->type = T_LESS;
+            if (*lx->p == '&') {
+                lx->p++;
+                t->type = T_LESSAND;
+            }
+            break;
+        case '>':
+            lx->p++;
+            t->type = T_GREAT;
+            if (*lx->p == '>') {
+                lx->p++;
+                t->type = T_DGREAT;
+            }
+            else if (*lx->p == '&') {
+                lx->p++;
+                t->type = T_GREATAND;
+            }
+            break;
+        default:
+            t->type = T_WORD;
+            if ((t->word = lex_word(lx)) == NULL)
+                t->type = T_ERR;
+    }
+    t->end = lx->p;
+}
+
+struct alias {
+    struct arena arena;     /* value text, tokens and their words */
+    char *value;
+    struct token *toks;
+    int ntoks;
+    int active;             /* being expanded: do not recurse */
+    struct alias *next;     /* on the dead list */
+};
+
+#define ALIAS_DEPTH 16
+
+/* tokens of an alias being spliced into the input */
+struct tsrc {
+    struct alias *al;
+    int i;
+    const char *start, *end;    /* position of the alias name */
+};
+
+/*
+ * Parser - recursive descent over the token stream, one token of
+ * lookahead.  Every function returns NULL once p->failed is set.
+ */
+struct parser {
+    struct lexer lx;
+    struct token tok;       /* lookahead */
+    int peeked;
+    const char *prev_end;   /* end of the last consumed token */
+    const char *src;
+    int failed;
+    int incomplete;
+    struct tsrc alias[ALIAS_DEPTH];
+    int nalias;
+};
+
+static struct htab aliases;
+static struct alias *dead_aliases;
+
+static struct token *peek(struct parser *p) {
+    struct tsrc *ts;
+
+    if (!p->peeked) {
+        while (p->nalias > 0 &&
+                p->alias[p->nalias - 1].i == p->alias[p->nalias - 1].al->ntoks)
+            p->alias[--p->nalias].al->active = 0;
+        if (p->nalias > 0) {
+            /* spliced tokens report the alias name's position, so
+             * node text never spans two buffers */
+            ts = &p->alias[p->nalias - 1];
+            p->tok = ts->al->toks[ts->i++];
+            p->tok.start = ts->start;
+            p->tok.end = ts->end;
+        }
+        else
+            lex(&p->lx, &p->tok);
+        p->peeked = 1;
+    }
+    return &p->tok;
+}
+
+static void advance(struct parser *p) {
+    peek(p);
+    p->prev_end = p->tok.end;
+    p->peeked = 0;
+}
+
+/* is the lookahead the unquoted reserved word kw? */
+static int is_kw(struct parser *p, const char *kw) {
+    struct token *t = peek(p);
+
+    return t->type == T_WORD && (t->word->flags & W_LITERAL) &&
+        !(t->word->flags & W_QUOTED) && strcmp(t->word->text, kw) == 0;
+}
+
+static void *syntax_error(struct parser *p) {
+    struct token *t = peek(p);
+
+    if (p->failed)
+        return NULL;
+    p->failed = 1;
+    if (t->type == T_EOF || (t->type == T_ERR && p->lx.incomplete)) {
+        p->incomplete = 1;
+        return NULL;
+    }
+    if (t->type == T_ERR)
+        return NULL;    /* lexer already complained */
+    if (t->type == T_WORD)
+        fprintf(stderr, "tsh: syntax error near unexpected token `%.*s'\n",
+                (int)(t->end - t->start), t->start);
+    else
+        fprintf(stderr, "tsh: syntax error near unexpected token `%s'\n",
+                tok_names[t->type]);
+    return NULL;
+}
+
+static int expect_kw(struct parser *p, const char *kw) {
+    if (!is_kw(p, kw)) {
+        syntax_error(p);
+        return 0;
+    }
+    advance(p);
+    return 1;
+}
+
+static void skip_newlines(struct parser *p) {
+    while (peek(p)->type == T_NL)
+        advance(p);
+}
+
+static struct node *new_node(struct parser *p, int type) {
+    struct node *n = arena_alloc(p->lx.a, sizeof(*n));
+
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    return n;
+}
+
+static void set_text(struct parser *p, struct node *n, const char *start) {
+    n->text = arena_strndup(p->lx.a, start, p->prev_end - start);
+}
+
+/*
+ * Growable pointer vectors used while collecting children; the final
+ * array is copied into the arena so the tree stays contiguous.
+ */
+struct pvec {
+    void **v;
+    int n, cap;
+};
+
+static void pvec_push(struct pvec *pv, void *x) {
+    if (pv->n == pv->cap) {
+        pv->cap = pv->cap ? pv->cap * 2 : 8;
+        if ((pv->v = realloc(pv->v, pv->cap * sizeof(void *))) == NULL)
+            app_error("out of memory");
+    }
+    pv->v[pv->n++] = x;
+}
+
+/* the copy is NULL-terminated */
+static void *pvec_finish(struct parser *p, struct pvec *pv) {
+    void **v = arena_alloc(p->lx.a, (pv->n + 1) * sizeof(void *));
+
+    if (pv->n > 0)
+        memcpy(v, pv->v, pv->n * sizeof(void *));
+    v[pv->n] = NULL;
+    free(pv->v);
+    pv->v = NULL;
+    return v;
+}
+
+static struct node *parse_list(struct parser *p);
+static struct node *parse_command(struct parser *p);
+
+/* does the lookahead close the current list? */
+static int at_list_end(struct parser *p) {
+    static const char *closers[] = {
+        "then", "elif", "else", "fi", "do", "done", "esac", "}", NULL
+    };
+    struct token *t = peek(p);
+    int i;
+
+    if (t->type == T_EOF || t->type == T_RPAREN || t->type == T_DSEMI)
+        return 1;
+    for (i = 0; closers[i]; i++)
+        if (is_kw(p, closers[i]))
+            return 1;
+    return 0;
+}
+
+static int is_redir_tok(int type) {
+    return type >= T_LESS && type <= T_GREATAND;
+}
+
+static struct redir *parse_redir(struct parser *p) {
+    struct token *t = peek(p);
+    struct redir *r = arena_alloc(p->lx.a, sizeof(*r));
+
+    switch (t->type) {
+        case T_LESS:     r->type = R_IN;     r->fd = 0; break;
+        case T_GREAT:    r->type = R_OUT;    r->fd = 1; break;
+        case T_DGREAT:   r->type = R_APPEND; r->fd = 1; break;
+        case T_LESSAND:  r->type = R_DUPIN;  r->fd = 0; break;
+        default:         r->type = R_DUPOUT; r->fd = 1; break;
+    }
+    if (t->io_fd >= 0)
+        r->fd = t->io_fd;
+    r->next = NULL;
+    advance(p);
+    if (peek(p)->type != T_WORD)
+        return syntax_error(p);
+    r->target = p->tok.word;
+    advance(p);
+    return r;
+}
+
+/* append redirections following a command to *tail */
+static int parse_redirs(struct parser *p, struct redir **tail) {
+    struct redir *r;
+
+    while (*tail)
+        tail = &(*tail)->next;
+    while (is_redir_tok(peek(p)->type)) {
+        if ((r = parse_redir(p)) == NULL)
+            return -1;
+        *tail = r;
+        tail = &r->next;
+    }
+    return 0;
+}
+
+/* NAME=value with an unquoted, literal NAME */
+static int is_assignment(struct word *w) {
+    const char *s;
+
+    if (w->nparts == 0 || w->parts[0].type != WP_LIT || w->parts[0].quoted)
+        return 0;
+    s = w->parts[0].text;
+    if (!is_name_start(*s))
+        return 0;
+    while (is_name_char(*s))
+        s++;
+    return *s == '=';
+}
+
+static int is_name(struct word *w) {
+    const char *s;
+
+    if (!(w->flags & W_LITERAL) || (w->flags & W_QUOTED) ||
+            !is_name_start(*w->text))
+        return 0;
+    for (s = w->text; is_name_char(*s); s++)
+        ;
+    return *s == '\0';
+}
+
+/* name ( ) linebreak compound-command; the lookahead is '(' */
+static struct node *parse_funcdef(struct parser *p, struct word *name) {
+    struct node *n;
+
+    if (!is_name(name))
+        return syntax_error(p);
+    advance(p);
+    if (peek(p)->type != T_RPAREN)
+        return syntax_error(p);
+    advance(p);
+    skip_newlines(p);
+    n = new_node(p, N_FUNC);
+    n->u.func.name = name->text;
+    if ((n->u.func.body = parse_command(p)) == NULL)
+        return NULL;
+    if (n->u.func.body->type == N_CMD) {
+        fprintf(stderr, "tsh: %s: function body must be a compound command\n",
+                name->text);
+        p->failed = 1;
+        return NULL;
+    }
+    return n;
+}
+
+static struct node *parse_simple(struct parser *p) {
+    struct node *n = new_node(p, N_CMD);
+    struct pvec args = { 0 }, assign = { 0 };
+    struct redir **tail = &n->redirs;
+    struct token *t;
+
+    for (;;) {
+        t = peek(p);
+        if (is_redir_tok(t->type)) {
+            if (parse_redirs(p, tail) < 0)
+                goto fail;
+            while (*tail)
+                tail = &(*tail)->next;
+        }
+        else if (t->type == T_WORD) {
+            if (args.n == 0 && is_assignment(t->word))
+                pvec_push(&assign, t->word);
+            else
+                pvec_push(&args, t->word);
+            advance(p);
+        }
+        else if (t->type == T_LPAREN && args.n == 1 && assign.n == 0 &&
+                n->redirs == NULL) {
+            struct word *name = args.v[0];
+
+            free(args.v);
+            return parse_funcdef(p, name);
+        }
+        else
+            break;
+    }
+    if (args.n == 0 && assign.n == 0 && n->redirs == NULL) {
+        syntax_error(p);
+        goto fail;
+    }
+    n->u.cmd.argc = args.n;
+    n->u.cmd.argv = pvec_finish(p, &args);
+    n->u.cmd.nassign = assign.n;
+    n->u.cmd.assign = pvec_finish(p, &assign);
+    return n;
+
+fail:
+    free(args.v);
+    free(assign.v);
+    return NULL;
+}
+
+/* a list that must contain at least one command */
+static struct node *parse_body(struct parser *p) {
+    struct node *n = parse_list(p);
+
+    if (n == NULL && !p->failed)
+        syntax_error(p);
+    return n;
+}
+
+/* after 'if' or 'elif' */
+static struct node *parse_if_rest(struct parser *p) {
+    struct node *n = new_node(p, N_IF);
+
+    if ((n->u.cond.cond = parse_body(p)) == NULL || !expect_kw(p, "then"))
+        return NULL;
+    if ((n->u.cond.body = parse_body(p)) == NULL)
+        return NULL;
+    if (is_kw(p, "elif")) {
+        advance(p);
+        if ((n->u.cond.orelse = parse_if_rest(p)) == NULL)
+            return NULL;
+    }
+    else if (is_kw(p, "else")) {
+        advance(p);
+        if ((n->u.cond.orelse = parse_body(p)) == NULL)
+            return NULL;
+    }
+    return n;
+}
+
+static struct node *parse_if(struct parser *p) {
+    struct node *n;
+
+    advance(p);
+    if ((n = parse_if_rest(p)) == NULL || !expect_kw(p, "fi"))
+        return NULL;
+    return n;
+}
+
+static struct node *parse_while(struct parser *p, int type) {
+    struct node *n = new_node(p, type);
+
+    advance(p);
+    if ((n->u.cond.cond = parse_body(p)) == NULL || !expect_kw(p, "do"))
+        return NULL;
+    if ((n->u.cond.body = parse_body(p)) == NULL || !expect_kw(p, "done"))
+        return NULL;
+    return n;
+}
+
+static struct node *parse_for(struct parser *p) {
+    struct node *n = new_node(p, N_FOR);
+    struct pvec words = { 0 };
+    struct token *t;
+
+    advance(p);
+    t = peek(p);
+    if (t->type != T_WORD || !is_name(t->word))
+        return syntax_error(p);
+    n->u.loop.var = t->word->text;
+    advance(p);
+
+    skip_newlines(p);
+    n->u.loop.nwords = -1;          /* no 'in': iterate over "$@" */
+    if (is_kw(p, "in")) {
+        advance(p);
+        while (peek(p)->type == T_WORD) {
+            pvec_push(&words, p->tok.word);
+            advance(p);
+        }
+        n->u.loop.nwords = words.n;
+        n->u.loop.words = pvec_finish(p, &words);
+        t = peek(p);
+        if (t->type != T_SEMI && t->type != T_NL)
+            return syntax_error(p);
+        advance(p);
+    }
+    else if (peek(p)->type == T_SEMI)
+        advance(p);
+    skip_newlines(p);
+
+    if (!expect_kw(p, "do"))
+        return NULL;
+    if ((n->u.loop.body = parse_body(p)) == NULL || !expect_kw(p, "done"))
+        return NULL;
+    return n;
+}
+
+static struct node *parse_case(struct parser *p) {
+    struct node *n = new_node(p, N_CASE);
+    struct pvec items = { 0 }, pats;
+    struct case_item *ci;
+    int i;
+
+    advance(p);
+    if (peek(p)->type != T_WORD)
+        return syntax_error(p);
+    n->u.cas.subject = p->tok.word;
+    advance(p);
+    skip_newlines(p);
+    if (!expect_kw(p, "in"))
+        return NULL;
+    skip_newlines(p);
+
+    while (!is_kw(p, "esac")) {
+        ci = arena_alloc(p->lx.a, sizeof(*ci));
+        pvec_push(&items, ci);
+        memset(&pats, 0, sizeof(pats));
+
+        if (peek(p)->type == T_LPAREN)
+            advance(p);
+        for (;;) {
+            if (peek(p)->type != T_WORD)
+                goto fail;
+            pvec_push(&pats, p->tok.word);
+            advance(p);
+            if (peek(p)->type != T_PIPE)
+                break;
+            advance(p);
+        }
+        if (peek(p)->type != T_RPAREN)
+            goto fail;
+        advance(p);
+        ci->npats = pats.n;
+        ci->pats = pvec_finish(p, &pats);
+
+        ci->body = parse_list(p);
+        if (p->failed)
+            goto fail_items;
+        if (peek(p)->type == T_DSEMI) {
+            advance(p);
+            skip_newlines(p);
+        }
+        else if (!is_kw(p, "esac")) {
+            syntax_error(p);
+            goto fail_items;
+        }
+    }
+    advance(p);
+
+    n->u.cas.nitems = items.n;
+    n->u.cas.items = arena_alloc(p->lx.a, items.n * sizeof(struct case_item) + 1);
+    for (i = 0; i < items.n; i++)
+        n->u.cas.items[i] = *(struct case_item *)items.v[i];
+    free(items.v);
+    return n;
+
+fail:
+    free(pats.v);
+    syntax_error(p);
+fail_items:
+    free(items.v);
+    return NULL;
+}
+
+static struct node *parse_brace(struct parser *p) {
+    struct node *n = new_node(p, N_BRACE);
+
+    advance(p);
+    if ((n->u.bin.left = parse_body(p)) == NULL || !expect_kw(p, "}"))
+        return NULL;
+    return n;
+}
+
+/*
+ * expand_alias - if the lookahead names an alias, consume it and
+ *     splice in the alias's tokens.  Return 1 if it did.
+ */
+static int expand_alias(struct parser *p) {
+    struct token *t = peek(p);
+    struct htab_ent *e;
+    struct alias *al;
+    struct tsrc *ts;
+
+    if (t->type != T_WORD || !(t->word->flags & W_LITERAL) ||
+            (t->word->flags & W_QUOTED))
+        return 0;
+    if ((e = htab_find(&aliases, t->word->text)) == NULL)
+        return 0;
+    al = e->val;
+    if (al->active || p->nalias == ALIAS_DEPTH)
+        return 0;
+
+    ts = &p->alias[p->nalias++];
+    ts->al = al;
+    ts->i = 0;
+    ts->start = t->start;
+    ts->end = t->end;
+    al->active = 1;
+    advance(p);
+    return 1;
+}
+
+static struct node *parse_command(struct parser *p) {
+    struct node *n;
+    struct token *t;
+
+    while (expand_alias(p))
+        ;
+    t = peek(p);
+    if (t->type == T_WORD && is_kw(p, "if"))
+        n = parse_if(p);
+    else if (t->type == T_WORD && is_kw(p, "while"))
+        n = parse_while(p, N_WHILE);
+    else if (t->type == T_WORD && is_kw(p, "until"))
+        n = parse_while(p, N_UNTIL);
+    else if (t->type == T_WORD && is_kw(p, "for"))
+        n = parse_for(p);
+    else if (t->type == T_WORD && is_kw(p, "case"))
+        n = parse_case(p);
+    else if (t->type == T_WORD && is_kw(p, "{"))
+        n = parse_brace(p);
+    else
+        return parse_simple(p);
+
+    /* redirections apply to the whole compound command */
+    if (n != NULL && parse_redirs(p, &n->redirs) < 0)
+        return NULL;
+    return n;
+}
+
+/*
+ * parse_pipeline - [!] cmd [| cmd]... [|+ cmd [| cmd]...]...
+ *     '|' binds tighter than '|+': in a |+ b | c |+ d, the output of a
+ *     is copied to both b | c and d.
+ */
+static struct node *parse_pipeline(struct parser *p) {
+    const char *start = peek(p)->start;
+    const char *cstart = start;
+    struct pvec cmds = { 0 }, fans = { 0 };
+    struct node *n, *c;
+    int bang = 0, fan, i, k;
+
+    if (is_kw(p, "!")) {
+        bang = 1;
+        advance(p);
+        cstart = peek(p)->start;
+    }
+    if ((c = parse_command(p)) == NULL)
+        return NULL;
+    if (peek(p)->type == T_PIPE || peek(p)->type == T_FAN) {
+        pvec_push(&cmds, c);
+        while (peek(p)->type == T_PIPE || peek(p)->type == T_FAN) {
+            fan = (p->tok.type == T_FAN);
+            advance(p);
+            skip_newlines(p);
+            if ((c = parse_command(p)) == NULL) {
+                free(cmds.v);
+                free(fans.v);
+                return NULL;
+            }
+            if (fan)
+                pvec_push(&fans, c);
+            pvec_push(&cmds, c);
+        }
+        n = new_node(p, N_PIPE);
+        n->u.pipe.n = cmds.n;
+        n->u.pipe.nfan = fans.n;
+        if (fans.n > 0) {
+            n->u.pipe.fan = arena_alloc(p->lx.a, fans.n * sizeof(int));
+            for (i = 0, k = 0; i < cmds.n; i++)
+                if (k < fans.n && cmds.v[i] == fans.v[k])
+                    n->u.pipe.fan[k++] = i;
+        }
+        free(fans.v);
+        n->u.pipe.cmds = pvec_finish(p, &cmds);
+        c = n;
+    }
+    set_text(p, c, cstart);
+    if (bang) {
+        n = new_node(p, N_NOT);
+        n->u.bin.left = c;
+        set_text(p, n, start);
+        c = n;
+    }
+    return c;
+}
+
+static struct node *parse_and_or(struct parser *p) {
+    const char *start = peek(p)->start;
+    struct node *n, *r, *left;
+    int type;
+
+    if ((left = parse_pipeline(p)) == NULL)
+        return NULL;
+    while (peek(p)->type == T_AND || peek(p)->type == T_OR) {
+        type = (p->tok.type == T_AND) ? N_AND : N_OR;
+        advance(p);
+        skip_newlines(p);
+        if ((r = parse_pipeline(p)) == NULL)
+            return NULL;
+        n = new_node(p, type);
+        n->u.bin.left = left;
+        n->u.bin.right = r;
+        set_text(p, n, start);
+        left = n;
+    }
+    return left;
+}
+
+/*
+ * parse_list - and-or lists separated by ';', '&' or newlines, up to
+ * the first token that closes the enclosing construct.  An empty list
+ * yields NULL without setting p->failed.
+ */
+static struct node *parse_list(struct parser *p) {
+    struct node *head = NULL, **tail = &head, *n, *seq;
+    int type;
+
+    skip_newlines(p);
+    while (!at_list_end(p)) {
+        if ((n = parse_and_or(p)) == NULL)
+            return NULL;
+        type = peek(p)->type;
+        if (type == T_AMP || type == T_SEMI || type == T_NL) {
+            n->bg = (type == T_AMP);
+            advance(p);
+        }
+        else if (!at_list_end(p))
+            return syntax_error(p);
+
+        /* chain as right-leaning N_SEQ nodes */
+        if (*tail == NULL)
+            *tail = n;
+        else {
+            seq = new_node(p, N_SEQ);
+            seq->u.bin.left = *tail;
+            seq->u.bin.right = n;
+            *tail = seq;
+            tail = &seq->u.bin.right;
+        }
+        skip_newlines(p);
+    }
+    return head;
+}
+
+/*
+ * parse_text - parse a list that must be followed by token type last.
+ */
+static struct node *parse_text(struct parser *p, struct arena *a,
+        const char *text, int last) {
+    struct node *n;
+
+    memset(p, 0, sizeof(*p));
+    p->lx.a = a;
+    p->lx.p = text;
+    p->src = text;
+    p->prev_end = text;
+
+    n = parse_list(p);
+    if (!p->failed && peek(p)->type != last)
+        syntax_error(p);
+    if (p->failed && !p->incomplete && p->lx.incomplete)
+        p->incomplete = 1;
+
+    free(p->lx.buf);
+    free(p->lx.parts);
+    while (p->nalias > 0)
+        p->alias[--p->nalias].al->active = 0;
+    return n;
+}
+
+/*
+ * lex_cmdsub - lex $( ... ) or `...` (lx->p just past the opening
+ *     token) into a WP_CMDSUB part.  The command is parsed here by a
+ *     nested parser, so expansion never has to scan it again.
+ */
+static int lex_cmdsub(struct lexer *lx, int quoted, int backq) {
+    struct parser p;
+    struct wpart *wp;
+    struct node *n;
+    const char *s, *end;
+    char *text;
+    size_t len = 0;
+
+    if (backq) {
+        /* undo the \` \\ and \$ escapes, then parse the copy */
+        for (end = lx->p; *end != '`'; end++) {
+            if (*end == '\0') {
+                lx->incomplete = 1;
+                return -1;
+            }
+            if (*end == '\\' && end[1] != '\0')
+                end++;
+        }
+        text = arena_alloc(lx->a, end - lx->p + 1);
+        for (s = lx->p; s < end; s++) {
+            if (*s == '\\' && strchr("`\\$", s[1]) != NULL)
+                s++;
+            text[len++] = *s;
+        }
+        text[len] = '\0';
+        n = parse_text(&p, lx->a, text, T_EOF);
+        lx->p = end + 1;
+    }
+    else {
+        n = parse_text(&p, lx->a, lx->p, T_RPAREN);
+        lx->p = p.lx.p;     /* just past the ')' */
+    }
+    if (p.failed) {
+        lx->incomplete |= p.incomplete;
+        return -1;
+    }
+
+    lex_flush(lx);
+    wp = lex_newpart(lx);
+    wp->type = WP_CMDSUB;
+    wp->quoted = quoted;
+    wp->text = "";
+    wp->cmd = n;
+    if (quoted)
+        lx->flags |= W_QUOTED;
+    return 0;
+}
+
+/*
+ * parse - parse text into a tree allocated from arena a.
+ *
+ * Return P_OK with *tree set, P_EMPTY for a blank line, P_INCOMPLETE
+ * if the text ends inside a construct (the caller should read more
+ * input and try again), or P_ERROR after reporting a syntax error.
+ */
+int parse(struct arena *a, const char *text, struct node **tree) {
+    struct parser p;
+    struct node *n;
+
+    n = parse_text(&p, a, text, T_EOF);
+    *tree = n;
+    if (p.incomplete)
+        return P_INCOMPLETE;
+    if (p.failed)
+        return P_ERROR;
+    return (n == NULL) ? P_EMPTY : P_OK;
+}
+
+/*
+ * tree_copy - deep-copy tree n into arena a, so that it outlives the
+ *     arena of the line it was parsed from (function definitions).
+ */
+static struct word *word_copy(struct arena *a, const struct word *w) {
+    struct word *c;
+    int i;
+
+    if (w == NULL)
+        return NULL;
+    c = arena_alloc(a, sizeof(*c));
+    *c = *w;
+    c->parts = arena_alloc(a, w->nparts * sizeof(*c->parts));
+    for (i = 0; i < w->nparts; i++) {
+        c->parts[i] = w->parts[i];
+        c->parts[i].text = arena_strndup(a, w->parts[i].text, w->parts[i].len);
+        c->parts[i].sub = word_copy(a, w->parts[i].sub);
+        c->parts[i].cmd = tree_copy(a, w->parts[i].cmd);
+    }
+    if (w->text != NULL)
+        c->text = (w->nparts == 1) ? c->parts[0].text : arena_strdup(a, w->text);
+    return c;
+}
+
+static struct word **words_copy(struct arena *a, struct word **w, int n) {
+    struct word **c = arena_alloc(a, (n + 1) * sizeof(*c));
+    int i;
+
+    for (i = 0; i < n; i++)
+        c[i] = word_copy(a, w[i]);
+    c[n] = NULL;
+    return c;
+}
+
+struct node *tree_copy(struct arena *a, const struct node *n) {
+    struct redir *r, **tail;
+    struct node *c;
+    int i;
+
+    if (n == NULL)
+        return NULL;
+    c = arena_alloc(a, sizeof(*c));
+    *c = *n;
+    if (n->text != NULL)
+        c->text = arena_strdup(a, n->text);
+    c->redirs = NULL;
+    tail = &c->redirs;
+    for (r = n->redirs; r != NULL; r = r->next) {
+        *tail = arena_alloc(a, sizeof(**tail));
+        **tail = *r;
+        (*tail)->target = word_copy(a, r->target);
+        tail = &(*tail)->next;
+    }
+
+    switch (n->type) {
+        case N_CMD:
+            c->u.cmd.argv = words_copy(a, n->u.cmd.argv, n->u.cmd.argc);
+            c->u.cmd.assign = words_copy(a, n->u.cmd.assign, n->u.cmd.nassign);
+            break;
+        case N_PIPE:
+            c->u.pipe.cmds = arena_alloc(a, (n->u.pipe.n + 1) * sizeof(struct node *));
+            for (i = 0; i < n->u.pipe.n; i++)
+                c->u.pipe.cmds[i] = tree_copy(a, n->u.pipe.cmds[i]);
+            c->u.pipe.cmds[i] = NULL;
+            if (n->u.pipe.nfan > 0) {
+                c->u.pipe.fan = arena_alloc(a, n->u.pipe.nfan * sizeof(int));
+                memcpy(c->u.pipe.fan, n->u.pipe.fan, n->u.pipe.nfan * sizeof(int));
+            }
+            break;
+        case N_AND:
+        case N_OR:
+        case N_SEQ:
+        case N_NOT:
+        case N_BRACE:
+            c->u.bin.left = tree_copy(a, n->u.bin.left);
+            c->u.bin.right = tree_copy(a, n->u.bin.right);
+            break;
+        case N_IF:
+        case N_WHILE:
+        case N_UNTIL:
+            c->u.cond.cond = tree_copy(a, n->u.cond.cond);
+            c->u.cond.body = tree_copy(a, n->u.cond.body);
+            c->u.cond.orelse = tree_copy(a, n->u.cond.orelse);
+            break;
+        case N_FOR:
+            c->u.loop.var = arena_strdup(a, n->u.loop.var);
+            if (n->u.loop.nwords >= 0)
+                c->u.loop.words = words_copy(a, n->u.loop.words, n->u.loop.nwords);
+            c->u.loop.body = tree_copy(a, n->u.loop.body);
+            break;
+        case N_CASE:
+            c->u.cas.subject = word_copy(a, n->u.cas.subject);
+            c->u.cas.items = arena_alloc(a, (n->u.cas.nitems + 1) * sizeof(struct case_item));
+            for (i = 0; i < n->u.cas.nitems; i++) {
+                c->u.cas.items[i].npats = n->u.cas.items[i].npats;
+                c->u.cas.items[i].pats = words_copy(a, n->u.cas.items[i].pats,
+                        n->u.cas.items[i].npats);
+                c->u.cas.items[i].body = tree_copy(a, n->u.cas.items[i].body);
+            }
+            break;
+        case N_FUNC:
+            c->u.func.name = arena_strdup(a, n->u.func.name);
+            c->u.func.body = tree_copy(a, n->u.func.body);
+            break;
+    }
+    return c;
+}
+
+/*
+ * alias_define - lex value once and store its tokens under name.
+ *     Return 0 on success, -1 if value does not lex.
+ */
+int alias_define(const char *name, const char *value) {
+    struct alias *al = calloc(1, sizeof(*al));
+    struct lexer lx;
+    struct htab_ent *e;
+    struct token t;
+    int cap = 8;
+
+    if (al == NULL)
+        app_error("out of memory");
+    arena_init(&al->arena);
+    al->value = arena_strdup(&al->arena, value);
+
+    memset(&lx, 0, sizeof(lx));
+    lx.a = &al->arena;
+    lx.p = al->value;
+    al->toks = malloc(cap * sizeof(*al->toks));
+    for (;;) {
+        lex(&lx, &t);
+        if (t.type == T_EOF)
+            break;
+        if (t.type == T_ERR) {
+            fprintf(stderr, "alias: %s: bad alias value\n", name);
+            free(lx.buf);
+            free(lx.parts);
+            free(al->toks);
+            arena_free(&al->arena);
+            free(al);
+            return -1;
+        }
+        if (al->ntoks == cap) {
+            cap *= 2;
+            al->toks = realloc(al->toks, cap * sizeof(*al->toks));
+        }
+        al->toks[al->ntoks++] = t;
+    }
+    free(lx.buf);
+    free(lx.parts);
+
+    e = htab_insert(&aliases, name);
+    if (e->val != NULL) {
+        ((struct alias *)e->val)->next = dead_aliases;
+        dead_aliases = e->val;
+    }
+    e->val = al;
+    return 0;
+}
+
+/*
+ * A replaced or removed alias may still be referenced by the tree of
+ * the line being executed, so it is only freed by alias_gc() before
+ * the next line is parsed.
+ */
+int alias_remove(const char *name) {
+    struct alias *al = htab_remove(&aliases, name);
+
+    if (al == NULL)
+        return -1;
+    al->next = dead_aliases;
+    dead_aliases = al;
+    return 0;
+}
+
+void alias_gc(void) {
+    struct alias *al;
+
+    while ((al = dead_aliases) != NULL) {
+        dead_aliases = al->next;
+        free(al->toks);
+        arena_free(&al->arena);
+        free(al);
+    }
+}
+
+static void alias_kill(void *p) {
+    struct alias *al = p;
+
+    al->next = dead_aliases;
+    dead_aliases = al;
+}
+
+/* alias_swap - exchange the alias table and dead list with a session's */
+void alias_swap(struct htab *t, struct alias **dead) {
+    struct htab tmp = aliases;
+    struct alias *al = dead_aliases;
+
+    aliases = *t;
+    *t = tmp;
+    dead_aliases = *dead;
+    *dead = al;
+}
+
+/* alias_clear - remove every alias */
+void alias_clear(void) {
+    htab_clear(&aliases, alias_kill);
+    alias_gc();
+}
+
+static void alias_print_one(const char *name, struct alias *al) {
+    const char *s;
+
+    printf("alias %s='", name);
+    for (s = al->value; *s; s++) {
+        if (*s == '\'')
+            fputs("'\\''", stdout);
+        else
+            putchar(*s);
+    }
+    printf("'\n");
+}
+
+/* print alias name, or all aliases if name is NULL */
+int alias_print(const char *name) {
+    struct htab_ent *e;
+    unsigned i;
+
+    if (name != NULL) {
+        if ((e = htab_find(&aliases, name)) == NULL)
+            return -1;
+        alias_print_one(name, e->val);
+        return 0;
+    }
+    for (i = 0; i < aliases.nbuckets; i++)
+        for (e = aliases.buckets[i]; e != NULL; e = e->next)
+            alias_print_one(e->key, e->val);
+    return 0;
+}
@@ -0,0 +1,163 @@
+#ifndef _TSH_PARSE
+#define _TSH_PARSE
+
+#include <stddef.h>
+
+/*
+ * Arena - bump allocator backing the AST and the expansion scratch space.
+ *
+ * Memory comes from a chain of blocks that double in size, so a parsed
+ * command line ends up laid out contiguously in one or two blocks.
+ * Nothing is freed individually: arena_release() rolls the arena back
+ * to a mark and arena_free() drops everything.
+ */
+struct arena_blk;
+
+struct arena {
+    struct arena_blk *head;     /* current block (newest first) */
+};
+
+struct arena_mark {
+    struct arena_blk *blk;
+    size_t used;
+};
+
+void  arena_init(struct arena *a);
+void  arena_free(struct arena *a);
+void *arena_alloc(struct arena *a, size_t size);
+char *arena_strndup(struct arena *a, const char *s, size_t len);
+char *arena_strdup(struct arena *a, const char *s);
+struct arena_mark arena_mark(struct arena *a);
+void  arena_release(struct arena *a, struct arena_mark m);
+
+/*
+ * Words are split into parts by the lexer, so expansion never has to
+ * re-scan the source text: literal runs are kept verbatim and every
+ * '$' reference becomes its own part.
+ */
+#define WP_LIT     0   /* literal text */
+#define WP_VAR     1   /* $name or ${name} */
+#define WP_PARAM   2   /* $?, $#, $@, $*, $$, $!, $0-$9 */
+#define WP_ARITH   3   /* $(( expr )) */
+#define WP_CMDSUB  4   /* $(cmd) or `cmd` */
+
+struct wpart {
+    int type;
+    int quoted;             /* inside double quotes: no field splitting */
+    const char *text;       /* literal text or parameter name */
+    size_t len;
+    struct word *sub;       /* WP_ARITH: the expression, itself expanded */
+    struct node *cmd;       /* WP_CMDSUB: the command, parsed in advance */
+};
+
+#define W_LITERAL  0x1      /* no expansions: text holds the final value */
+#define W_QUOTED   0x2      /* some part of the word was quoted */
+
+struct word {
+    int flags;
+    int nparts;
+    struct wpart *parts;
+    const char *text;       /* joined literal value if W_LITERAL */
+};
+
+/* Redirection types */
+#define R_IN      0   /* [n]<word  */
+#define R_OUT     1   /* [n]>word  */
+#define R_APPEND  2   /* [n]>>word */
+#define R_DUPIN   3   /* [n]<&m    */
+#define R_DUPOUT  4   /* [n]>&m    */
+
+struct redir {
+    int type;
+    int fd;
+    struct word *target;
+    struct redir *next;
+};
+
+/* AST node types */
+#define N_CMD     0   /* simple command */
+#define N_PIPE    1   /* cmd | cmd | ..., or a fan-out: prod |+ cons |+ ... */
+#define N_AND     2   /* left && right */
+#define N_OR      3   /* left || right */
+#define N_SEQ     4   /* left ; right  (left may be async) */
+#define N_NOT     5   /* ! pipeline */
+#define N_IF      6
+#define N_WHILE   7
+#define N_UNTIL   8
+#define N_FOR     9
+#define N_CASE   10
+#define N_BRACE  11   /* { list; } */
+#define N_FUNC   12   /* name() compound-command */
+
+struct case_item {
+    int npats;
+    struct word **pats;
+    struct node *body;      /* may be NULL */
+};
+
+struct node {
+    int type;
+    int bg;                 /* terminated by '&' */
+    const char *text;       /* source text, used as the job's cmdline */
+    struct redir *redirs;
+    union {
+        struct {
+            int argc;
+            struct word **argv;
+            int nassign;
+            struct word **assign;
+        } cmd;
+        struct {
+            int n;
+            struct node **cmds;
+            int nfan;       /* consumers of a fan-out, 0 for a pipeline */
+            int *fan;       /* index in cmds of each consumer's first stage */
+        } pipe;
+        struct {
+            struct node *left, *right;
+        } bin;
+        struct {
+            struct node *cond, *body, *orelse;
+        } cond;
+        struct {
+            const char *var;
+            int nwords;
+            struct word **words;
+            struct node *body;
+        } loop;
+        struct {
+            struct word *subject;
+            int nitems;
+            struct case_item *items;
+        } cas;
+        struct {
+            const char *name;
+            struct node *body;
+        } func;
+    } u;
+};
+
+/* parse() results */
+#define P_OK          0
+#define P_EMPTY       1   /* blank line or comment */
+#define P_INCOMPLETE  2   /* input ended inside a construct */
+#define P_ERROR       3   /* syntax error (already reported) */
+
+int parse(struct arena *a, const char *text, struct node **tree);
+struct node *tree_copy(struct arena *a, const struct node *n);
+
+/*
+ * Aliases are lexed once when they are defined; the parser splices the
+ * stored tokens in place of the alias name at command position.
+ */
+int alias_define(const char *name, const char *value);
+int alias_remove(const char *name);
+int alias_print(const char *name);
+void alias_gc(void);
+
+struct htab;
+struct alias;
+void alias_swap(struct htab *t, struct alias **dead);
+void alias_clear(void);
+
+#endif
@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "tinyshell.h"
+
+/*
+ * PATH index - the names in each PATH directory, kept in a file that
+ * tsh maps read-only at startup.  Finding a command then costs a stat
+ * of each directory searched (is it unchanged since it was indexed?)
+ * and a binary search, instead of a readdir pass over each directory.
+ *
+ * The file is $TSH_PATHIDX, or $XDG_CACHE_HOME/tsh-pathidx, or
+ * ~/.cache/tsh-pathidx; TSH_PATHIDX= turns the index off.  It holds
+ *
+ *     struct pi_header
+ *     struct pi_dir[ndirs]      directory, its mtime, where its names are
+ *     uint32_t[]                each directory's name offsets, sorted
+ *     char[]                    NUL-terminated strings
+ *
+ * with offsets from the start of the file.  When a directory is
+ * missing from it or has changed, the lookup rescans all of PATH,
+ * writes a new file and renames it into place, so readers never see a
+ * partial one.  That happens in the child about to exec; the shell's
+ * own mapping is refreshed by pathidx_open when the file changes.
+ *
+ * Only absolute directories are indexed.  A relative one such as . or
+ * bin names another directory after cd, which its mtime cannot tell,
+ * so it is always probed.
+ */
+
+#define PI_MAGIC   "tshpidx1"
+#define PI_MAXDIRS 64
+#define PI_RACY    (-2)     /* mtime too recent to trust: always stale */
+
+struct pi_header {
+    char magic[8];
+    uint32_t ndirs;
+    uint32_t size;          /* of the whole file */
+};
+
+struct pi_dir {
+    int64_t sec, nsec;      /* mtime when indexed; -1 if it did not exist */
+    uint32_t path;          /* offset of the directory name */
+    uint32_t names;         /* offset of its name offsets */
+    uint32_t nnames;
+    uint32_t pad;
+};
+
+static const char *pi_base;     /* the index, or NULL */
+static size_t pi_size;
+static int pi_mapped;           /* pi_base is a mapping, not malloc'd */
+static struct stat pi_st;       /* of the file mapped */
+
+/* where the index lives, or NULL if it is turned off */
+static const char *pi_file(char *buf, size_t size) {
+    const char *s;
+
+    if ((s = getenv("TSH_PATHIDX")) != NULL)
+        return (*s != '\0') ? s : NULL;
+    if ((s = getenv("XDG_CACHE_HOME")) != NULL && *s == '/')
+        snprintf(buf, size, "%s/tsh-pathidx", s);
+    else if ((s = getenv("HOME")) != NULL && *s == '/')
+        snprintf(buf, size, "%s/.cache/tsh-pathidx", s);
+    else
+        return NULL;
+    return buf;
+}
+
+/* is the image at base sane enough to search without bounds trouble? */
+static int pi_valid(const char *base, size_t size) {
+    const struct pi_header *h = (const void *)base;
+    const struct pi_dir *d = (const void *)(h + 1);
+    uint32_t i;
+
+    if (size < sizeof(*h) || memcmp(h->magic, PI_MAGIC, 8) != 0 ||
+            h->size != size || h->ndirs > PI_MAXDIRS ||
+            sizeof(*h) + h->ndirs * sizeof(*d) > size || base[size - 1] != '\0')
+        return 0;
+    for (i = 0; i < h->ndirs; i++)
+        if (d[i].path >= size || d[i].names % 4 != 0 ||
+                d[i].names + (uint64_t)d[i].nnames * 4 > size)
+            return 0;
+    return 1;
+}
+
+static void pi_drop(void) {
+    if (pi_base != NULL && pi_mapped)
+        munmap((void *)pi_base, pi_size);
+    else
+        free((void *)pi_base);
+    pi_base = NULL;
+    pi_mapped = 0;
+}
+
+/*
+ * pathidx_open - map the index, or map it again if it has been
+ *     replaced since.  Cheap to call when nothing changed.
+ */
+void pathidx_open(void) {
+    char buf[MAXLINE];
+    const char *file = pi_file(buf, sizeof(buf));
+    struct stat st;
+    void *p;
+    int fd;
+
+    if (file == NULL || stat(file, &st) < 0) {
+        pi_drop();
+        return;
+    }
+    if (pi_base != NULL && pi_mapped && st.st_ino == pi_st.st_ino &&
+            st.st_dev == pi_st.st_dev)
+        return;
+    if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0)
+        return;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+            (p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+        if (pi_valid(p, st.st_size)) {
+            pi_drop();
+            pi_base = p;
+            pi_size = st.st_size;
+            pi_mapped = 1;
+            pi_st = st;
+        }
+        else
+            munmap(p, st.st_size);
+    }
+    close(fd);
+}
+
+/* the index entry for directory dir, or NULL */
+static const struct pi_dir *pi_dir(const char *dir) {
+    const struct pi_header *h = (const void *)pi_base;
+    const struct pi_dir *d;
+    uint32_t i;
+
+    if (pi_base == NULL)
+        return NULL;
+    d = (const void *)(h + 1);
+    for (i = 0; i < h->ndirs; i++)
+        if (strcmp(pi_base + d[i].path, dir) == 0)
+            return &d[i];
+    return NULL;
+}
+
+/* 1 if d still describes its directory */
+static int pi_fresh(const struct pi_dir *d, const char *dir) {
+    struct stat st;
+
+    if (stat(dir, &st) < 0)
+        return d->sec == -1;
+    return d->sec == st.st_mtim.tv_sec && d->nsec == st.st_mtim.tv_nsec;
+}
+
+static int pi_has(const struct pi_dir *d, const char *fn) {
+    const uint32_t *names = (const void *)(pi_base + d->names);
+    uint32_t lo = 0, hi = d->nnames, mid;
+    int c;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (names[mid] >= pi_size)
+            return 0;
+        if ((c = strcmp(pi_base + names[mid], fn)) == 0)
+            return 1;
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return 0;
+}
+
+/* growable byte buffer for building an index */
+struct pi_buf {
+    char *s;
+    size_t len, cap;
+};
+
+static size_t pi_put(struct pi_buf *b, const void *p, size_t n) {
+    size_t at = b->len;
+
+    while (b->len + n > b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 16384;
+        if ((b->s = realloc(b->s, b->cap)) == NULL)
+            app_error("out of memory");
+    }
+    memcpy(b->s + b->len, p, n);
+    b->len += n;
+    return at;
+}
+
+static const char *pi_sortbase;
+
+static int pi_cmp(const void *a, const void *b) {
+    return strcmp(pi_sortbase + *(const uint32_t *)a,
+            pi_sortbase + *(const uint32_t *)b);
+}
+
+/* write the image atomically to the index file; failure only costs speed */
+static void pi_write(const char *image, size_t size) {
+    char buf[MAXLINE], tmp[MAXLINE + 16], *slash;
+    const char *file = pi_file(buf, sizeof(buf));
+    ssize_t n;
+    int fd;
+
+    if (file == NULL)
+        return;
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file);
+    if ((fd = mkstemp(tmp)) < 0) {
+        /* the first time, ~/.cache may not exist yet */
+        if (errno != ENOENT || (slash = strrchr(tmp, '/')) == NULL)
+            return;
+        *slash = '\0';
+        if (mkdir(tmp, 0700) < 0)
+            return;
+        snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file);
+        if ((fd = mkstemp(tmp)) < 0)
+            return;
+    }
+    n = write(fd, image, size);
+    if (close(fd) < 0 || n != (ssize_t)size || rename(tmp, file) < 0)
+        unlink(tmp);
+}
+
+/*
+ * pi_build - index every directory in path (a PATH value) and make
+ *     that the index we search.
+ */
+static void pi_build(const char *path) {
+    struct pi_buf names = { 0 }, strs = { 0 }, out = { 0 };
+    struct pi_dir dirs[PI_MAXDIRS];
+    struct pi_header h;
+    struct dirent *de;
+    struct stat st;
+    struct timespec now;
+    char dir[MAX_VAR_LEN];
+    size_t len, base, k;
+    uint32_t off, *v;
+    int ndirs = 0, i;
+    DIR *dp;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    pi_put(&strs, "", 1);       /* no string at offset 0 */
+    while (*path != '\0' && ndirs < PI_MAXDIRS) {
+        path += strspn(path, " ");
+        len = strcspn(path, ":");
+        if (len < sizeof(dir) && *path == '/') {
+            memcpy(dir, path, len);
+            dir[len] = '\0';
+            memset(&dirs[ndirs], 0, sizeof(dirs[ndirs]));
+            dirs[ndirs].path = pi_put(&strs, dir, len + 1);
+            dirs[ndirs].names = names.len;
+            if (stat(dir, &st) < 0)
+                dirs[ndirs].sec = dirs[ndirs].nsec = -1;
+            else if (st.st_mtim.tv_sec >= now.tv_sec - 1)
+                /* may change again within the same mtime tick */
+                dirs[ndirs].sec = dirs[ndirs].nsec = PI_RACY;
+            else {
+                dirs[ndirs].sec = st.st_mtim.tv_sec;
+                dirs[ndirs].nsec = st.st_mtim.tv_nsec;
+            }
+            if ((dp = opendir(dir)) != NULL) {
+                while ((de = readdir(dp)) != NULL) {
+                    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                        continue;
+                    off = pi_put(&strs, de->d_name, strlen(de->d_name) + 1);
+                    pi_put(&names, &off, sizeof(off));
+                    dirs[ndirs].nnames++;
+                }
+                closedir(dp);
+            }
+            ndirs++;
+        }
+        path += len;
+        if (*path == ':')
+            path++;
+    }
+
+    /* lay out: header, directories, name offsets, then the strings */
+    base = sizeof(h) + ndirs * sizeof(struct pi_dir) + names.len;
+    pi_sortbase = strs.s;
+    for (i = 0; i < ndirs; i++) {
+        v = (uint32_t *)(names.s + dirs[i].names);
+        qsort(v, dirs[i].nnames, sizeof(*v), pi_cmp);
+        for (k = 0; k < dirs[i].nnames; k++)
+            v[k] += base;
+        dirs[i].path += base;
+        dirs[i].names += sizeof(h) + ndirs * sizeof(struct pi_dir);
+    }
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PI_MAGIC, 8);
+    h.ndirs = ndirs;
+    h.size = base + strs.len;
+    pi_put(&out, &h, sizeof(h));
+    pi_put(&out, dirs, ndirs * sizeof(struct pi_dir));
+    if (names.len > 0)
+        pi_put(&out, names.s, names.len);
+    pi_put(&out, strs.s, strs.len);
+    free(names.s);
+    free(strs.s);
+
+    pi_write(out.s, out.len);
+    pi_drop();
+    pi_base = out.s;
+    pi_size = out.len;
+}
+
+/* does dir/fn exist?  The lookup without an index */
+static int pi_probe(const char *dir, const char *fn) {
+    char path[MAXLINE];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, fn);
+    return access(path, F_OK) == 0;
+}
+
+/*
+ * pathidx_lookup - find the directory in path (a PATH value) holding
+ *     fn and copy it into buf, which has room for MAX_VAR_LEN bytes.
+ *     Return buf, or NULL if no directory has it.
+ */
+char *pathidx_lookup(const char *path, const char *fn, char *buf) {
+    char file[MAXLINE];
+    const struct pi_dir *d;
+    const char *p;
+    size_t len;
+    int off = (pi_file(file, sizeof(file)) == NULL), built = 0, n;
+
+again:
+    for (p = path, n = 0; *p != '\0'; n++) {
+        p += strspn(p, " ");
+        len = strcspn(p, ":");
+        if (len < MAX_VAR_LEN) {
+            memcpy(buf, p, len);
+            buf[len] = '\0';
+            d = (off || n >= PI_MAXDIRS || *buf != '/') ? NULL : pi_dir(buf);
+            if (!off && n < PI_MAXDIRS && *buf == '/' && !built &&
+                    (d == NULL || !pi_fresh(d, buf))) {
+                /* just scanned, the new index is right even if racy */
+                pi_build(path);
+                built = 1;
+                goto again;
+            }
+            if (d != NULL ? pi_has(d, fn) : pi_probe(buf, fn))
+                return buf;
+        }
+        p += len;
+        if (*p == ':')
+            p++;
+    }
+    return NULL;
+}
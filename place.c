@@ -0,0 +1,320 @@
+#define _GNU_SOURCE     /* sched_setaffinity */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include "tinyshell.h"
+
+/*
+ * Job placement - the CPUs and memory nodes a job may use, its nice
+ * value and its I/O priority.  run applies them in the child between
+ * fork and exec, so there is no taskset, nice or ionice process;
+ * renice and repin change them for a job that is already running.
+ */
+
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_WHO_PGRP     2
+#define IOPRIO_CLASS_SHIFT  13
+#define MPOL_BIND           2
+
+static const char *ioclasses[] = { "none", "rt", "be", "idle" };
+
+#define MASK_BITS (8 * sizeof(unsigned long))
+
+static void mask_set(struct cpumask *m, int i) {
+    m->bits[i / MASK_BITS] |= 1UL << (i % MASK_BITS);
+}
+
+static int mask_isset(const struct cpumask *m, int i) {
+    return (m->bits[i / MASK_BITS] >> (i % MASK_BITS)) & 1;
+}
+
+/* a list like 0-7,12,14-15 (or "all"); -1 if malformed */
+static int parse_list(const char *s, struct cpumask *m) {
+    long lo, hi;
+    char *end;
+
+    memset(m, 0, sizeof(*m));
+    if (strcmp(s, "all") == 0) {
+        for (lo = 0; lo < MAXCPUS; lo++)
+            mask_set(m, lo);
+        return 0;
+    }
+    for (;;) {
+        if (!isdigit((unsigned char)*s))
+            return -1;
+        lo = hi = strtol(s, &end, 10);
+        if (*end == '-') {
+            s = end + 1;
+            if (!isdigit((unsigned char)*s))
+                return -1;
+            hi = strtol(s, &end, 10);
+        }
+        if (lo > hi || hi >= MAXCPUS)
+            return -1;
+        for (; lo <= hi; lo++)
+            mask_set(m, lo);
+        if (*end == '\0')
+            return 0;
+        if (*end != ',')
+            return -1;
+        s = end + 1;
+    }
+}
+
+/* the inverse of parse_list */
+static void format_list(const struct cpumask *m, char *buf, size_t size) {
+    size_t len = 0;
+    int i, j;
+
+    buf[0] = '\0';
+    for (i = 0; i < MAXCPUS && len < size; i = j) {
+        if (!mask_isset(m, i)) {
+            j = i + 1;
+            continue;
+        }
+        for (j = i + 1; j < MAXCPUS && mask_isset(m, j); j++)
+            ;
+        if (j - 1 == i)
+            len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", i);
+        else
+            len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "",
+                    i, j - 1);
+    }
+}
+
+/* rt[:level], be[:level], idle or none, as an ioprio_set value */
+static int parse_ioprio(const char *s) {
+    size_t n = strcspn(s, ":");
+    int class, level = 4;
+    char *end;
+
+    for (class = 0; class < 4; class++)
+        if (strlen(ioclasses[class]) == n && strncmp(s, ioclasses[class], n) == 0)
+            break;
+    if (class == 4)
+        return -1;
+    if (s[n] == ':') {
+        level = strtol(s + n + 1, &end, 10);
+        if (end == s + n + 1 || *end != '\0' || level < 0 || level > 7)
+            return -1;
+    }
+    if (class == 0 || class == 3)
+        level = 0;
+    return (class << IOPRIO_CLASS_SHIFT) | level;
+}
+
+static int ioprio_set_(int which, int who, int prio) {
+#ifdef SYS_ioprio_set
+    return syscall(SYS_ioprio_set, which, who, prio);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int ioprio_get_(int which, int who) {
+#ifdef SYS_ioprio_get
+    return syscall(SYS_ioprio_get, which, who);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+ * place_option - parse --cpus, --mems, --nice or --ioprio (opt) with its
+ *     value arg into pl.  Return 0, -1 for a bad value (reported as an
+ *     error of cmd), or 1 if opt is not a placement option.
+ */
+int place_option(struct placement *pl, const char *cmd, const char *opt,
+        const char *arg) {
+    char *end;
+    long n;
+
+    if (strcmp(opt, "--cpus") == 0) {
+        if (arg == NULL || parse_list(arg, &pl->cpus) < 0)
+            goto bad;
+        pl->set |= PL_CPUS;
+    }
+    else if (strcmp(opt, "--mems") == 0) {
+        if (arg == NULL || parse_list(arg, &pl->mems) < 0)
+            goto bad;
+        pl->set |= PL_MEMS;
+    }
+    else if (strcmp(opt, "--nice") == 0) {
+        if (arg == NULL)
+            goto bad;
+        n = strtol(arg, &end, 10);
+        if (end == arg || *end != '\0' || n < -20 || n > 19)
+            goto bad;
+        pl->nice = n;
+        pl->set |= PL_NICE;
+    }
+    else if (strcmp(opt, "--ioprio") == 0) {
+        if (arg == NULL || (pl->ioprio = parse_ioprio(arg)) < 0)
+            goto bad;
+        pl->set |= PL_IOPRIO;
+    }
+    else
+        return 1;
+    return 0;
+
+bad:
+    fprintf(stderr, "%s: %s: bad value: %s\n", cmd, opt, arg ? arg : "(none)");
+    return -1;
+}
+
+/* place_self - apply pl to this process; in a child, before exec */
+int place_self(const struct placement *pl) {
+    if ((pl->set & PL_CPUS) &&
+            sched_setaffinity(0, sizeof(pl->cpus), (const cpu_set_t *)&pl->cpus) < 0) {
+        fprintf(stderr, "run: --cpus: %s\n", strerror(errno));
+        return -1;
+    }
+    if ((pl->set & PL_MEMS) && syscall(SYS_set_mempolicy, MPOL_BIND,
+                pl->mems.bits, MAXCPUS + 1) < 0) {
+        fprintf(stderr, "run: --mems: %s\n", strerror(errno));
+        return -1;
+    }
+    if ((pl->set & PL_NICE) && setpriority(PRIO_PROCESS, 0, pl->nice) < 0) {
+        fprintf(stderr, "run: --nice: %s\n", strerror(errno));
+        return -1;
+    }
+    if ((pl->set & PL_IOPRIO) &&
+            ioprio_set_(IOPRIO_WHO_PROCESS, 0, pl->ioprio) < 0) {
+        fprintf(stderr, "run: --ioprio: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* the process group of pid, from /proc/pid/stat; -1 if gone */
+static pid_t proc_pgrp(const char *pid) {
+    char path[64], buf[512], *p;
+    int fd, pgrp;
+    ssize_t n;
+
+    snprintf(path, sizeof(path), "/proc/%s/stat", pid);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    /* comm may hold anything: the fields we want follow its last ')' */
+    if ((p = strrchr(buf, ')')) == NULL || sscanf(p + 2, "%*c %*d %d", &pgrp) != 1)
+        return -1;
+    return pgrp;
+}
+
+/* pin every thread of process pid (a /proc entry name) */
+static int repin_proc(const char *pid, const struct cpumask *m) {
+    char path[64];
+    struct dirent *de;
+    DIR *d;
+    int rc = 0;
+
+    snprintf(path, sizeof(path), "/proc/%s/task", pid);
+    if ((d = opendir(path)) == NULL)
+        return -1;
+    while ((de = readdir(d)) != NULL)
+        if (isdigit((unsigned char)de->d_name[0]) && sched_setaffinity(
+                    atoi(de->d_name), sizeof(*m), (const cpu_set_t *)m) < 0)
+            rc = -1;
+    closedir(d);
+    return rc;
+}
+
+/*
+ * repin_pgrp - there is no group-wide sched_setaffinity, so find the
+ *     group's processes in /proc; that also catches their children.
+ */
+static int repin_pgrp(pid_t pgid, const struct cpumask *m) {
+    struct dirent *de;
+    DIR *d;
+    int found = 0, rc = 0;
+
+    if ((d = opendir("/proc")) == NULL)
+        return -1;
+    while ((de = readdir(d)) != NULL) {
+        if (!isdigit((unsigned char)de->d_name[0]) ||
+                proc_pgrp(de->d_name) != pgid)
+            continue;
+        found = 1;
+        if (repin_proc(de->d_name, m) < 0)
+            rc = -1;
+    }
+    closedir(d);
+    if (!found)
+        errno = ESRCH;
+    return found ? rc : -1;
+}
+
+/*
+ * place_job - apply pl (but not --mems, which only a process can set
+ *     for itself) to a running job: to process group pgid, or, if pgid
+ *     is 0, to the n processes in pids.  Return -1 if anything failed.
+ */
+int place_job(pid_t pgid, const pid_t *pids, int n, const struct placement *pl) {
+    char name[16];
+    int k, rc = 0;
+
+    if (pl->set & PL_NICE) {
+        if (pgid > 0 && setpriority(PRIO_PGRP, pgid, pl->nice) < 0)
+            rc = -1;
+        for (k = 0; pgid == 0 && k < n; k++)
+            if (pids[k] != 0 && setpriority(PRIO_PROCESS, pids[k], pl->nice) < 0)
+                rc = -1;
+    }
+    if (pl->set & PL_IOPRIO) {
+        if (pgid > 0 && ioprio_set_(IOPRIO_WHO_PGRP, pgid, pl->ioprio) < 0)
+            rc = -1;
+        for (k = 0; pgid == 0 && k < n; k++)
+            if (pids[k] != 0 &&
+                    ioprio_set_(IOPRIO_WHO_PROCESS, pids[k], pl->ioprio) < 0)
+                rc = -1;
+    }
+    if (pl->set & PL_CPUS) {
+        if (pgid > 0 && repin_pgrp(pgid, &pl->cpus) < 0)
+            rc = -1;
+        for (k = 0; pgid == 0 && k < n; k++) {
+            snprintf(name, sizeof(name), "%d", (int)pids[k]);
+            if (pids[k] != 0 && repin_proc(name, &pl->cpus) < 0)
+                rc = -1;
+        }
+    }
+    return rc;
+}
+
+/* place_show - "cpus=0-7 nice=10 io=idle" for process pid, as it is now */
+void place_show(pid_t pid, char *buf, size_t size) {
+    struct cpumask m;
+    char cpus[256] = "?";
+    int nice, prio;
+
+    memset(&m, 0, sizeof(m));
+    if (sched_getaffinity(pid, sizeof(m), (cpu_set_t *)&m) == 0)
+        format_list(&m, cpus, sizeof(cpus));
+    errno = 0;
+    nice = getpriority(PRIO_PROCESS, pid);
+    if (errno != 0)
+        nice = 0;
+    prio = ioprio_get_(IOPRIO_WHO_PROCESS, pid);
+    if (prio < 0)
+        snprintf(buf, size, "cpus=%s nice=%d io=?", cpus, nice);
+    else if ((prio >> IOPRIO_CLASS_SHIFT) == 1 || (prio >> IOPRIO_CLASS_SHIFT) == 2)
+        snprintf(buf, size, "cpus=%s nice=%d io=%s:%d", cpus, nice,
+                ioclasses[prio >> IOPRIO_CLASS_SHIFT], prio & 7);
+    else
+        snprintf(buf, size, "cpus=%s nice=%d io=%s", cpus, nice,
+                ioclasses[(prio >> IOPRIO_CLASS_SHIFT) & 3]);
+}
@@ -0,0 +1,83 @@
+#ifndef _TSH_PROBES
+#define _TSH_PROBES
+
+/*
+ * probes.h - USDT (SystemTap-style) static probes, provider "tsh"
+ *
+ * Built with -DTSH_USDT=ON, each PROBEn() is a single nop plus an ELF
+ * note naming the probe and where its arguments are, which bpftrace,
+ * perf and SystemTap read to attach; unattached, the nop is all it
+ * costs.  Otherwise the macros are empty.  Every probe passes
+ *
+ *     arg0  pid       process concerned (the shell for eval)
+ *     arg1  jid       job id, 0 where there is no job yet
+ *     arg2  cmd       command line or name (a C string)
+ *     arg3            per probe: status, state or stage
+ *
+ * The probes are
+ *
+ *     eval_start, eval_done(status)       around each line
+ *     fork_start(stage), fork_done(stage) around each fork of launch
+ *     exec_fail(errno)                    in a child whose exec failed
+ *     job_add(state), job_delete(status)  job table entries
+ *     job_state(state)                    FG, BG or ST from fg/bg/kill
+ *                                         and from reaping
+ *
+ * The scripts in tools/ use them.  <sys/sdt.h> is used when it exists;
+ * on x86-64 and arm64 the notes are emitted here without it, with
+ * every argument widened to a signed 64-bit value.
+ */
+
+#if defined(TSH_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE3(name, a, b, c)       STAP_PROBE3(tsh, name, a, b, c)
+#define PROBE4(name, a, b, c, d)    STAP_PROBE4(tsh, name, a, b, c, d)
+#elif defined(__x86_64__) || defined(__aarch64__)
+#define TSH_OWN_SDT
+#endif
+#endif
+
+#ifdef TSH_OWN_SDT
+/* the note layout is the one <sys/sdt.h> emits (version 3) */
+#define SDT_NOTE(name, args)                                            \
+    "990: nop\n"                                                        \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                       \
+    ".balign 4\n"                                                       \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                  \
+    "991: .asciz \"stapsdt\"\n"                                         \
+    "992: .balign 4\n"                                                  \
+    "993: .8byte 990b\n"                                                \
+    ".8byte _.stapsdt.base\n"                                           \
+    ".8byte 0\n"                                                        \
+    ".asciz \"tsh\"\n"                                                  \
+    ".asciz \"" #name "\"\n"                                            \
+    ".asciz \"" args "\"\n"                                             \
+    "994: .balign 4\n"                                                  \
+    ".popsection\n"                                                     \
+    ".ifndef _.stapsdt.base\n"                                          \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n"                                            \
+    ".hidden _.stapsdt.base\n"                                          \
+    "_.stapsdt.base: .space 1\n"                                        \
+    ".size _.stapsdt.base, 1\n"                                         \
+    ".popsection\n"                                                     \
+    ".endif\n"
+
+#define PROBE3(name, a, b, c)                                           \
+    __asm__ __volatile__ (SDT_NOTE(name, "-8@%[a0] -8@%[a1] -8@%[a2]")  \
+        :: [a0] "nor" ((long)(a)), [a1] "nor" ((long)(b)),              \
+           [a2] "nor" ((long)(c)))
+#define PROBE4(name, a, b, c, d)                                        \
+    __asm__ __volatile__ (SDT_NOTE(name,                                \
+            "-8@%[a0] -8@%[a1] -8@%[a2] -8@%[a3]")                      \
+        :: [a0] "nor" ((long)(a)), [a1] "nor" ((long)(b)),              \
+           [a2] "nor" ((long)(c)), [a3] "nor" ((long)(d)))
+#endif
+
+#ifndef PROBE3
+#define PROBE3(name, a, b, c)       ((void)0)
+#define PROBE4(name, a, b, c, d)    ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * embed - check the tsh.h session API
+ *
+ * Runs lines in two sessions side by side and compares their status
+ * and captured output with what a shell would print.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "../tsh.h"
+
+static int failed;
+
+/* run line in s; its stdout (unless NULL), stderr and status must match */
+static void check(struct tsh_session *s, const char *line, const char *out,
+        const char *err, int status) {
+    struct tsh_result r;
+
+    if (tsh_eval(s, line, &r) < 0) {
+        fprintf(stderr, "embed: %s: tsh_eval: %s\n", line, r.errmsg);
+        failed = 1;
+        return;
+    }
+    if ((out != NULL && strcmp(r.out, out) != 0) || strcmp(r.err, err) != 0 ||
+            r.status != status) {
+        fprintf(stderr, "embed: %s\n  expected [%s] [%s] %d\n"
+                "  got      [%s] [%s] %d\n",
+                line, out ? out : "*", err, status, r.out, r.err, r.status);
+        failed = 1;
+    }
+    tsh_result_free(&r);
+}
+
+/* open_fds - a bit for each of fds 3 to 63 that is open */
+static unsigned long long open_fds(void) {
+    unsigned long long mask = 0;
+    int fd;
+
+    for (fd = 3; fd < 64; fd++)
+        if (fcntl(fd, F_GETFD) >= 0)
+            mask |= 1ULL << fd;
+    return mask;
+}
+
+/* run line, which exits, in a session of its own: host fds must not move */
+static void check_fds(const char *line) {
+    struct tsh_session *s;
+    struct tsh_result r;
+    struct stat st0, st;
+    unsigned long long fds = open_fds();
+
+    fstat(STDIN_FILENO, &st0);
+    if ((s = tsh_open()) == NULL) {
+        perror("embed: tsh_open");
+        failed = 1;
+        return;
+    }
+    if (tsh_eval(s, line, &r) < 0 || !r.exited) {
+        fprintf(stderr, "embed: %s: did not exit\n", line);
+        failed = 1;
+    }
+    tsh_result_free(&r);
+    tsh_close(s);
+    if (fstat(STDIN_FILENO, &st) < 0 || st.st_dev != st0.st_dev ||
+            st.st_ino != st0.st_ino || open_fds() != fds) {
+        fprintf(stderr, "embed: %s: left the host's fds changed\n", line);
+        failed = 1;
+    }
+}
+
+int main(void) {
+    struct tsh_session *a, *b;
+    struct tsh_result r;
+    char cwd[4096], tmp[] = "/tmp/embed.XXXXXX", line[64];
+    size_t heap;
+    int i;
+
+    if ((a = tsh_open()) == NULL || (b = tsh_open()) == NULL) {
+        perror("embed: tsh_open");
+        return 2;
+    }
+
+    /* state is per session */
+    check(a, "x=one; f() { echo a:$1; }; alias hi='echo hi-a'\n", "", "", 0);
+    check(b, "x=two; export E=b\n", "", "", 0);
+    check(a, "echo $x; f 1; hi\n", "one\na:1\nhi-a\n", "", 0);
+    check(b, "echo $x; f 1\n", "two\n", "f: Command not found\n", 127);
+    check(a, "/usr/bin/env | /bin/grep -c '^E='\n", "0\n", "", 1);
+    check(b, "/usr/bin/env | /bin/grep '^E='\n", "E=b\n", "", 0);
+    if (getenv("E") != NULL) {
+        fprintf(stderr, "embed: export leaked into the host\n");
+        failed = 1;
+    }
+
+    /* so is the working directory */
+    check(a, "cd /; pwd\n", "/\n", "", 0);
+    if (getcwd(cwd, sizeof(cwd)) == NULL || strcmp(cwd, "/") == 0) {
+        fprintf(stderr, "embed: cd leaked into the host\n");
+        failed = 1;
+    }
+    strcat(cwd, "\n");
+    check(a, "cd -\n", cwd, "", 0);
+
+    /* status, stderr and lines that are not complete */
+    check(a, "/bin/sh -c 'echo oops >&2; exit 3'\n", "", "oops\n", 3);
+    check(a, "echo $?\n", "3\n", "", 0);
+    check(a, "if true; then echo x\n", "",
+            "tsh: syntax error: unexpected end of input\n", 2);
+
+    /* jobs: output written after the line is returned with a later one */
+    check(a, "/bin/sh -c 'sleep 0.2; echo late' &\n", NULL, "", 0);
+    check(b, "jobs\n", "", "", 0);
+    check(a, "wait; echo waited\n", "late\nwaited\n", "", 0);
+
+    /* exports in turn: each session keeps its own environ, not leaked */
+    heap = mallinfo2().uordblks;
+    for (i = 0; i < 2000; i++) {
+        check(a, "export E=a\n", "", "", 0);
+        check(b, "export E=b\n", "", "", 0);
+    }
+    if (mallinfo2().uordblks > heap + 64 * 1024) {
+        fprintf(stderr, "embed: export leaked %zu bytes\n",
+                mallinfo2().uordblks - heap);
+        failed = 1;
+    }
+    check(a, "echo $E\n", "a\n", "", 0);
+    check(b, "/usr/bin/env | /bin/grep '^E='\n", "E=b\n", "", 0);
+    if (getenv("E") != NULL) {
+        fprintf(stderr, "embed: export leaked into the host\n");
+        failed = 1;
+    }
+
+    /* exit ends the line, not the host */
+    if (tsh_eval(b, "echo bye; exit 4; echo never\n", &r) < 0 ||
+            !r.exited || r.status != 4 || strcmp(r.out, "bye\n") != 0) {
+        fprintf(stderr, "embed: exit: got [%s] %d exited %d\n",
+                r.out, r.status, r.exited);
+        failed = 1;
+    }
+    tsh_result_free(&r);
+
+    /* and puts back the redirections it made in the shell */
+    if ((i = mkstemp(tmp)) < 0) {
+        perror("embed: mkstemp");
+        return 2;
+    }
+    close(i);
+    snprintf(line, sizeof(line), "exit 0 <%s\n", tmp);
+    check_fds(line);
+    snprintf(line, sizeof(line), "exit 0 5>%s\n", tmp);
+    check_fds(line);
+    unlink(tmp);
+
+    tsh_close(a);
+    tsh_close(b);
+    return failed;
+}
@@ -0,0 +1,5 @@
+# runs alongside two.sh: the sleeps interleave their output
+cd /
+echo one $(pwd) $x
+/bin/sleep 0.4
+echo one end
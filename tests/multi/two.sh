@@ -0,0 +1,3 @@
+x=two
+/bin/sleep 0.2
+echo two $(pwd) $x
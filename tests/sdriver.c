@@ -0,0 +1,329 @@
+/*
+ * sdriver - trace-driven test and benchmark driver for tsh -p
+ *
+ * Usage: sdriver -s ./tsh -t trace [-e expected] [-n reps] [-r rate] [-g]
+ *
+ * Each line of the trace is sent to the shell on its stdin.  After a
+ * command the driver also calls a marker function, which echoes a
+ * marker and returns $? unchanged, and waits for the marker to come
+ * back.  So every command has finished (or stopped) before the next
+ * one starts, which makes the transcript deterministic and gives a
+ * latency sample per command.  Directives:
+ *
+ *     # ...            comment, not sent
+ *     SLEEP ms         pause
+ *     TSTP / INT       send ctrl-z / ctrl-c to the shell
+ *     NOWAIT cmd       send cmd without waiting for it (a job that a
+ *                      later TSTP or INT will stop, or the first lines
+ *                      of a multi-line construct)
+ *
+ * The transcript has markers removed and every "(digits)" replaced by
+ * "(PID)".  With -e it must match the expected file (once per rep);
+ * -g prints it so that an expected file can be made.  -n runs the
+ * trace reps times in one shell, and -r fails the run if fewer than
+ * rate commands per second were completed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAXLINE   1024
+#define TIMEOUT_MS 10000    /* per command, before declaring a hang */
+#define MARKER    "__sdriver_sync__"
+
+struct buf {
+    char *s;
+    size_t len, cap;
+};
+
+static pid_t tsh;
+static int to_tsh, from_tsh;
+static struct buf out;              /* raw output not yet consumed */
+static struct buf transcript;       /* normalized, markers removed */
+static double *lat;                 /* latency samples in ms */
+static int nlat, maxlat;
+
+static void die(const char *msg) {
+    fprintf(stderr, "sdriver: %s\n", msg);
+    if (tsh > 0)
+        kill(tsh, SIGKILL);
+    exit(2);
+}
+
+static void buf_put(struct buf *b, const char *s, size_t n) {
+    if (b->len + n + 1 > b->cap) {
+        while (b->len + n + 1 > b->cap)
+            b->cap = b->cap ? b->cap * 2 : 4096;
+        if ((b->s = realloc(b->s, b->cap)) == NULL)
+            die("out of memory");
+    }
+    memcpy(b->s + b->len, s, n);
+    b->len += n;
+    b->s[b->len] = '\0';
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* append line to the transcript with "(digits)" turned into "(PID)" */
+static void emit_line(const char *s, size_t n) {
+    size_t i, j;
+
+    for (i = 0; i < n; i++) {
+        if (s[i] == '(' && i + 1 < n && isdigit((unsigned char)s[i + 1])) {
+            for (j = i + 1; j < n && isdigit((unsigned char)s[j]); j++)
+                ;
+            if (j < n && s[j] == ')') {
+                buf_put(&transcript, "(PID)", 5);
+                i = j;
+                continue;
+            }
+        }
+        buf_put(&transcript, &s[i], 1);
+    }
+}
+
+/*
+ * collect - read shell output for up to ms milliseconds (-1: until
+ *     EOF), moving complete lines to the transcript.  Return 1 as soon
+ *     as a marker line has been seen, 0 otherwise.
+ */
+static int collect(int ms) {
+    struct pollfd pfd = { from_tsh, POLLIN, 0 };
+    double end = now_ms() + ms;
+    char chunk[4096], *nl;
+    size_t n;
+    ssize_t r;
+    int found = 0, left;
+
+    for (;;) {
+        while ((nl = memchr(out.s, '\n', out.len)) != NULL) {
+            n = nl - out.s + 1;
+            if (n == strlen(MARKER) + 1 && memcmp(out.s, MARKER, n - 1) == 0)
+                found = 1;
+            else
+                emit_line(out.s, n);
+            memmove(out.s, out.s + n, out.len - n);
+            out.len -= n;
+        }
+        if (found)
+            return 1;
+        left = (ms < 0) ? -1 : (int)(end - now_ms());
+        if (ms >= 0 && left <= 0)
+            return 0;
+        if (poll(&pfd, 1, left) < 0 && errno != EINTR)
+            die("poll");
+        if (!(pfd.revents & (POLLIN|POLLHUP)))
+            continue;
+        if ((r = read(from_tsh, chunk, sizeof(chunk))) <= 0) {
+            if (out.len > 0)        /* unterminated last line */
+                emit_line(out.s, out.len);
+            out.len = 0;
+            return 0;
+        }
+        buf_put(&out, chunk, r);
+    }
+}
+
+static void send_str(const char *s) {
+    size_t n = strlen(s);
+    ssize_t w;
+
+    while (n > 0) {
+        if ((w = write(to_tsh, s, n)) < 0)
+            die("write to tsh");
+        s += w;
+        n -= w;
+    }
+}
+
+/* run one command and wait for the shell to finish it */
+static void run_command(const char *line) {
+    double t0 = now_ms();
+
+    send_str(line);
+    send_str(MARKER " $?\n");
+    if (!collect(TIMEOUT_MS)) {
+        fprintf(stderr, "sdriver: no response to: %s", line);
+        die("shell hung or died");
+    }
+    if (nlat == maxlat) {
+        maxlat = maxlat ? maxlat * 2 : 1024;
+        if ((lat = realloc(lat, maxlat * sizeof(*lat))) == NULL)
+            die("out of memory");
+    }
+    lat[nlat++] = now_ms() - t0;
+}
+
+static void run_trace(FILE *fp) {
+    char line[MAXLINE];
+
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (strncmp(line, "SLEEP ", 6) == 0) {
+            collect(atoi(line + 6));
+        }
+        else if (strcmp(line, "TSTP\n") == 0) {
+            kill(tsh, SIGTSTP);
+        }
+        else if (strcmp(line, "INT\n") == 0) {
+            kill(tsh, SIGINT);
+        }
+        else if (strncmp(line, "NOWAIT ", 7) == 0) {
+            send_str(line + 7);
+        }
+        else
+            run_command(line);
+    }
+}
+
+static void start_shell(const char *path) {
+    int in[2], outp[2];
+
+    if (pipe(in) < 0 || pipe(outp) < 0)
+        die("pipe");
+    if ((tsh = fork()) < 0)
+        die("fork");
+    if (tsh == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(outp[1], STDOUT_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(outp[0]);
+        close(outp[1]);
+        /* our own process group, as a terminal would give us */
+        setpgid(0, 0);
+        execl(path, path, "-p", (char *)NULL);
+        fprintf(stderr, "sdriver: %s: %s\n", path, strerror(errno));
+        _exit(127);
+    }
+    close(in[0]);
+    close(outp[1]);
+    to_tsh = in[1];
+    from_tsh = outp[0];
+
+    /* the marker is a function so that it passes $? through */
+    send_str(MARKER "() { echo " MARKER "; return $1; }\n");
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile(double p) {
+    int i = (int)(p / 100.0 * (nlat - 1) + 0.5);
+
+    return lat[i];
+}
+
+/* compare the transcript with reps copies of file; report a difference */
+static int check(const char *file, int reps) {
+    char line[MAXLINE];
+    const char *t = transcript.s ? transcript.s : "", *nl;
+    FILE *fp;
+    int lineno;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        fprintf(stderr, "sdriver: %s: %s\n", file, strerror(errno));
+        return 0;
+    }
+    for (; reps > 0; reps--) {
+        rewind(fp);
+        for (lineno = 1; fgets(line, sizeof(line), fp) != NULL; lineno++) {
+            nl = strchr(t, '\n');
+            if (nl == NULL || (size_t)(nl - t + 1) != strlen(line) ||
+                    memcmp(t, line, nl - t + 1) != 0) {
+                fprintf(stderr, "sdriver: %s:%d: expected: %s", file, lineno, line);
+                fprintf(stderr, "sdriver: %s:%d: got:      %.*s\n", file, lineno,
+                        nl ? (int)(nl - t) : (int)strlen(t), t);
+                fclose(fp);
+                return 0;
+            }
+            t = nl + 1;
+        }
+    }
+    fclose(fp);
+    if (*t != '\0') {
+        fprintf(stderr, "sdriver: %s: unexpected output: %.*s\n",
+                file, (int)strcspn(t, "\n"), t);
+        return 0;
+    }
+    return 1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: sdriver -s tsh -t trace [-e expected] [-n reps] "
+            "[-r rate] [-g]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    char *shell = NULL, *trace = NULL, *expected = NULL;
+    int c, i, reps = 1, gen = 0, status, ok = 1;
+    double min_rate = 0, t0, secs;
+    FILE *fp;
+
+    while ((c = getopt(argc, argv, "s:t:e:n:r:g")) != -1) {
+        switch (c) {
+            case 's': shell = optarg; break;
+            case 't': trace = optarg; break;
+            case 'e': expected = optarg; break;
+            case 'n': reps = atoi(optarg); break;
+            case 'r': min_rate = atof(optarg); break;
+            case 'g': gen = 1; break;
+            default: usage();
+        }
+    }
+    if (shell == NULL || trace == NULL || reps < 1)
+        usage();
+    if ((fp = fopen(trace, "r")) == NULL) {
+        fprintf(stderr, "sdriver: %s: %s\n", trace, strerror(errno));
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    start_shell(shell);
+    t0 = now_ms();
+    for (i = 0; i < reps; i++)
+        run_trace(fp);
+    secs = (now_ms() - t0) / 1e3;
+    close(to_tsh);
+    collect(-1);
+    waitpid(tsh, &status, 0);
+    fclose(fp);
+
+    if (gen)
+        fputs(transcript.s ? transcript.s : "", stdout);
+    if (expected != NULL && !check(expected, reps))
+        ok = 0;
+
+    if (nlat > 0) {
+        qsort(lat, nlat, sizeof(*lat), cmp_double);
+        fprintf(stderr, "%s: %d commands in %.3fs: %.0f cmds/s, latency ms "
+                "p50 %.3f p90 %.3f p99 %.3f max %.3f\n", trace, nlat, secs,
+                nlat / secs, percentile(50), percentile(90), percentile(99),
+                lat[nlat - 1]);
+        if (min_rate > 0 && nlat / secs < min_rate) {
+            fprintf(stderr, "sdriver: %.0f cmds/s is below the %.0f floor\n",
+                    nlat / secs, min_rate);
+            ok = 0;
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -1,182 +1,1314 @@
+#define _GNU_SOURCE     /* fopencookie */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
 #include <signal.h>
+#include <setjmp.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <dirent.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include "tinyshell.h"
+#include "tsh.h"
+#include "probes.h"
 
 char prompt[] = "tsh> ";
 int verbose = 0;
 int nextjid = 1;
-char sbuf[MAXLINE];
 
-struct job_t jobs[MAXJOBS];
+static struct job_t jobs0[MAXJOBS];
+struct job_t *jobs = jobs0;         /* the current session's job table */
 
-static int parseline(const char *cmdline, char **argv);
-static int builtin_cmd(char **argv);
-static void do_bgfg(char **argv);
+int last_status = 0;
+pid_t last_bgpid = 0;
+pid_t shell_pid;
+
+static int subshell = 0;            /* forked to run a compound command */
+static int jobs_top;                /* one past the highest slot in use */
+static struct rlimit nofile;        /* RLIMIT_NOFILE to hand to children */
+static volatile sig_atomic_t intr;  /* ctrl-c: unwind loops and lists */
+static char *pending;               /* input that ended inside a construct */
+static int subst_status = -1;       /* status of the last $(...), if any */
+
+/*
+ * The job graph - commands given to `after` wait as nodes @1, @2, ...
+ * for other jobs and earlier nodes to finish.  See after_run.
+ */
+#define A_WAIT 0    /* for its prerequisites, or for a free slot */
+#define A_RUN  1    /* started as a background job */
+#define A_DONE 2
+#define A_SKIP 3    /* not run: with -s, a prerequisite failed */
+
+struct after_dep {
+    pid_t pid;              /* leader of the job waited for */
+    int node;               /* or the node's index, -1 for a job */
+    int status;             /* its exit status once done, else -1 */
+};
+
+struct after_node {
+    int state;
+    int ok;                 /* -s: run only if every prerequisite succeeded */
+    int ndeps;
+    struct after_dep *deps; /* with argv and text: one block, freed when done */
+    char **argv;
+    char *text;
+    pid_t pid;              /* leader, once started */
+    int status;
+};
+
+struct job_graph {
+    struct after_node *v;
+    int n, cap;
+    int first;              /* the nodes before it are all done */
+    int nwait;              /* nodes in A_WAIT */
+    int limit;              /* nodes that may run at once, 0 for #CPUs */
+    volatile sig_atomic_t dirty;    /* a job was deleted since after_run */
+};
+
+static struct job_graph graph;
+
+/*
+ * Job state messages are made in reap_proc, which the SIGCHLD handler
+ * calls at any point - also in the middle of an fflush(stdout), which
+ * would drop anything printed then.  So they are queued here and only
+ * printed with SIGCHLD blocked.
+ */
+static char notes[4096];
+static size_t nnotes;
+
+/*
+ * Inside tsh_eval, an error that would end the tsh program ends only
+ * the line: unix_error and app_error jump back to tsh_eval instead.
+ */
+static sigjmp_buf *eval_jmp;
+static char eval_err[256];
+static struct tsh_session *session;     /* in tsh_eval for this one */
+
+/*
+ * What a jump back to tsh_eval leaves behind in the line it abandons:
+ * the line's tree and text, and the redirections in effect in the
+ * shell, innermost first.  The frames and expansion results are in the
+ * scratch arena.  See eval_unwind.
+ */
+struct redir_frame {
+    struct saved_fd *save;
+    int nsaved;
+    struct redir_frame *prev;
+};
+
+static struct redir_frame *redir_stack;
+static struct arena line_ast;
+static char *line_text;             /* malloc'd text of the line, or NULL */
+
+/* pending break/continue/return, unwound by the executor */
+static int breaking;                /* loop levels left to break out of */
+static int continuing;              /* loop levels to continue */
+static int returning;               /* leaving the current function */
+static int loopdepth;
+static int funcdepth;
+
+#define UNWINDING() (intr || breaking || continuing || returning)
+#define MAXFUNCDEPTH 1000
+
+typedef int builtin_fn(int argc, char **argv);
+
+/* how launch sets up a job beyond running it, from a job prefix */
+struct jobopts {
+    long long timeout;      /* ns until tsig is sent, 0 for none */
+    long long grace;        /* then SIGKILL this much later, 0 for never */
+    int tsig;
+    struct placement place; /* applied in each child before exec */
+    int quiet;              /* no "[jid] (pid)" line when in background */
+    int capture;            /* keep the output for `output` (capture.c) */
+};
+
+#define TIMEOUT_GRACE 5000000000LL  /* default grace before SIGKILL */
+
+/*
+ * Shell functions - the body is copied out of the line's arena into
+ * its own, and stays parsed until the function is redefined.
+ */
+struct func {
+    struct arena arena;
+    struct node *body;
+    int refs;               /* 1 for the table + calls in progress */
+};
+
+static struct htab funcs;
+
+/* descriptor saved while a redirection is in effect in the shell */
+struct saved_fd {
+    int fd;
+    int copy;   /* -1 if fd was closed */
+};
+
+static builtin_fn *getbuiltin(const char *name);
+static int do_bgfg(int argc, char **argv);
 static void waitfg(pid_t pid);
 static void clearjob(struct job_t *job);
+static void initjobs(struct job_t *jobs);
 static int maxjid(struct job_t *jobs);
-static int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
+static int addjob(struct job_t *jobs, pid_t *pids, int *pidfds, int nprocs, int state, char *cmdline);
 static int deletejob(struct job_t *jobs, pid_t pid);
 static pid_t fgpid(struct job_t *jobs);
 static struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
+static struct job_t *getjobproc(struct job_t *jobs, pid_t pid, int *stage);
 static struct job_t *getjobjid(struct job_t *jobs, int jid);
 static int pid2jid(pid_t pid);
-static void listjobs(struct job_t *jobs);
-static void unix_error(char *msg);
+static void listjobs(struct job_t *jobs, int placement);
+static void reap_proc(struct job_t *job, int stage, int status,
+        const struct rusage *ru);
+static void publish(struct job_t *job);
+static void flush_notes(void);
+static int job_signal(struct job_t *job, int sig);
+static int done_status(pid_t pid);
+static int done_named(const char *arg);
+static struct capture *done_capture(const char *arg);
+static void cap_event(unsigned slot);
+static void after_run(void);
+static void dl_insert(struct job_t *job);
+static void dl_remove(struct job_t *job);
+static void dl_expire(void);
+static void dl_close(void);
+static int wait_jobs(struct job_t **set, const pid_t *leaders, int n,
+        int any, int fg);
 static void sigchld_handler(int sig);
 static void sigint_handler(int sig);
 static void sigtstp_handler(int sig);
 static void sigquit_handler(int sig);
 static handler_t *Signal(int signum, handler_t *handler);
-static int search_dir(const char* path, const char* fn);
-static char* search_path_variable(const char* fn);
-static char* search_env_variable(const char* var_name, const char* fn);
+static char* search_env_variable(const char* var_name, const char* fn,
+        char *buf);
+static int exec_node(struct node *n);
+static int launch(struct node **cmds, int n, int bg, const char *text,
+        char **argv, const struct jobopts *o);
+static int launch_pipe(struct node *n, int bg);
+static int launch_fan(struct node **cmds, int n, const int *fan, int nfan,
+        int bg, const char *text, char **argv, const struct jobopts *o);
+static int run_prefixed(struct node *n, char **argv, int bg);
+static struct func *getfunc(const char *name);
+static int exec_tree(struct node *n);
+static void shell_exit(int status);
+
+/* env_var has room for MAX_VAR_LEN bytes; it gets the directory found */
+static char* search_env_variable(const char* var_name, const char* fn,
+        char *env_var) {
+    char* s = getenv(var_name);
+
+    if(s == NULL) return NULL;
+    return pathidx_lookup(s, fn, env_var);
+}
 
 /*
- * parseline - Parse the command line and build the argv array.
- *
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.
- */
-static int parseline(const char *cmdline, char **argv) {
-    static char array[MAXLINE]; /* at data segment */
-    char *buf = array;
-    char *delim;
-    int argc;
-    int bg;
+ * pidfds - a descriptor per child that becomes readable when it exits.
+ * They let a waiter sleep on exactly the jobs it cares about, and
+ * signals sent through them can never hit a recycled pid.  Every use
+ * falls back to plain pids where the kernel lacks them.
+ */
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1U << 2)
+#endif
+
+static int pidfd_open_(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int pidfd_signal_(int fd, int sig, unsigned flags) {
+#ifdef SYS_pidfd_send_signal
+    return syscall(SYS_pidfd_send_signal, fd, sig, NULL, flags);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int builtin_quit(int argc, char **argv) {
+    shell_exit(EXIT_SUCCESS);
+    return 0;
+}
 
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';   /* final '\n' to ' ' */
-    while (*buf && (*buf == ' '))
-        buf++;
+static int builtin_exit(int argc, char **argv) {
+    shell_exit(argc > 1 ? atoi(argv[1]) : last_status);
+    return 0;
+}
 
-    argc = 0;
-    if (*buf == '\'') {
-        buf++;
-        delim = strchr(buf, '\'');
+/* jobs [-l] - with -l, also where each job runs and at what priority */
+static int builtin_jobs(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "-l") != 0) {
+        fprintf(stderr, "jobs: usage: jobs [-l]\n");
+        return 2;
     }
-    else {
-        delim = strchr(buf, ' ');
+    listjobs(jobs, argc > 1);
+    return 0;
+}
+
+/* signal stage k of job, through its pidfd while it has one */
+static int proc_signal(struct job_t *job, int k, int sig) {
+    if (job->pidfds[k] >= 0 && pidfd_signal_(job->pidfds[k], sig, 0) == 0)
+        return 0;
+    return kill(job->pids[k], sig);
+}
+
+/*
+ * job_signal - send sig to every process of job.  The leader's pidfd
+ *     reaches the whole process group; a subshell's jobs share our
+ *     group, so there each stage is signalled on its own.
+ */
+static int job_signal(struct job_t *job, int sig) {
+    int k, rc = 0;
+
+    if (!subshell) {
+        if (job->pids[0] != 0 && job->pidfds[0] >= 0 &&
+                pidfd_signal_(job->pidfds[0], sig, PIDFD_SIGNAL_PROCESS_GROUP) == 0)
+            return 0;
+        return kill(-job->pid, sig);
     }
+    for (k = 0; k < job->nprocs; k++)
+        if (job->pids[k] != 0 && proc_signal(job, k, sig) < 0)
+            rc = -1;
+    return rc;
+}
+
+static const struct {
+    const char *name;
+    int sig;
+} signames[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT },
+    { "KILL", SIGKILL }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+    { "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+    { "CHLD", SIGCHLD }, { "CONT", SIGCONT }, { "STOP", SIGSTOP },
+    { "TSTP", SIGTSTP }, { "TTIN", SIGTTIN }, { "TTOU", SIGTTOU },
+    { "WINCH", SIGWINCH }, { NULL, 0 }
+};
+
+/* signal number of "TERM", "SIGTERM" or "15", or -1 */
+static int signum(const char *s) {
+    int i;
+
+    if (isdigit((unsigned char)*s))
+        return (atoi(s) < NSIG) ? atoi(s) : -1;
+    if (strncmp(s, "SIG", 3) == 0)
+        s += 3;
+    for (i = 0; signames[i].name != NULL; i++)
+        if (strcmp(signames[i].name, s) == 0)
+            return signames[i].sig;
+    return -1;
+}
+
+/* find the job named by %jid, or the job that process pid belongs to */
+static struct job_t *argjob(const char *arg, int *stage) {
+    *stage = -1;
+    if (arg[0] == '%')
+        return getjobjid(jobs, atoi(arg + 1));
+    return getjobproc(jobs, atoi(arg), stage);
+}
+
+/* kill [-s sig | -sig] %jid|pid ... */
+static int builtin_kill(int argc, char **argv) {
+    struct job_t *job;
+    int i = 1, sig = SIGTERM, stage, rc, status = 0;
 
-    while (delim) {
-        argv[argc++] = buf;
-        *delim = '\0';
-        buf = delim + 1;
-        while (*buf && (*buf == ' '))
-            buf++;
+    if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+        sig = signum(argv[2]);
+        i = 3;
+    }
+    else if (argc > 1 && argv[1][0] == '-') {
+        sig = signum(argv[1] + 1);
+        i = 2;
+    }
+    if (sig < 0 || i >= argc) {
+        fprintf(stderr, "kill: usage: kill [-s sig | -sig] %%jid|pid ...\n");
+        return 2;
+    }
 
-        if (*buf == '\'') {
-            buf++;
-            delim = strchr(buf, '\'');
+    for (; i < argc; i++) {
+        if (argv[i][0] != '%' && !isdigit((unsigned char)argv[i][0])) {
+            fprintf(stderr, "kill: %s: argument must be a PID or %%jobid\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        if ((job = argjob(argv[i], &stage)) == NULL) {
+            if (argv[i][0] == '%') {
+                fprintf(stderr, "kill: %s: No such job\n", argv[i]);
+                status = 1;
+                continue;
+            }
+            rc = kill(atoi(argv[i]), sig);
         }
+        else if (stage >= 0)
+            rc = proc_signal(job, stage, sig);
         else {
-            delim = strchr(buf, ' ');
+            rc = job_signal(job, sig);
+            /* a stopped job would only see TERM or HUP once continued */
+            if (rc == 0 && job->state == ST && (sig == SIGTERM || sig == SIGHUP))
+                job_signal(job, SIGCONT);
+        }
+        if (rc < 0) {
+            fprintf(stderr, "kill: %s: %s\n", argv[i], strerror(errno));
+            status = 1;
+        }
+        else if (job != NULL && sig == SIGCONT && job->state == ST) {
+            job->state = BG;
+            PROBE4(job_state, job->pid, job->jid, job->cmdline, BG);
+            publish(job);
+        }
+    }
+    return status;
+}
+
+/*
+ * wait_all - wait for every background job, and for those the job graph
+ *     starts meanwhile, until none is left
+ */
+static int wait_all(void) {
+    struct job_t **set;
+    pid_t *leaders;
+    int i, n, status = 0;
+
+    set = malloc(MAXJOBS * sizeof(*set));
+    leaders = malloc(MAXJOBS * sizeof(*leaders));
+    if (set == NULL || leaders == NULL)
+        app_error("out of memory");
+    do {
+        after_run();
+        for (i = 0, n = 0; i < jobs_top; i++) {
+            if (jobs[i].pid != 0 && jobs[i].state == BG) {
+                set[n] = &jobs[i];
+                leaders[n++] = jobs[i].pid;
+            }
+        }
+        if (n > 0 && wait_jobs(set, leaders, n, 0, 0) < 0) {
+            status = 128 + SIGINT;
+            break;
+        }
+    } while (n > 0);
+    free(set);
+    free(leaders);
+    return status;
+}
+
+/*
+ * wait [-n] [%jid|pid ...] - wait for the given background jobs, or
+ *     all of them (wait_all); with -n, for the first one to finish.
+ *     The status is that of the last job named (of the finished one,
+ *     with -n).
+ */
+static int builtin_wait(int argc, char **argv) {
+    struct job_t **set, *job;
+    pid_t *leaders, last = 0;
+    int i, n = 0, any = 0, stage, fin, status = 0;
+
+    if (argc > 1 && strcmp(argv[1], "-n") == 0) {
+        any = 1;
+        argc--;
+        argv++;
+    }
+    if (argc == 1 && !any)
+        return wait_all();
+    set = malloc((argc > 1 ? argc : jobs_top + 1) * sizeof(*set));
+    leaders = malloc((argc > 1 ? argc : jobs_top + 1) * sizeof(*leaders));
+    if (set == NULL || leaders == NULL)
+        app_error("out of memory");
+
+    if (argc == 1) {
+        for (i = 0; i < jobs_top; i++) {
+            if (jobs[i].pid != 0 && jobs[i].state == BG) {
+                set[n] = &jobs[i];
+                leaders[n++] = jobs[i].pid;
+            }
         }
     }
-    argv[argc] = NULL;
+    for (i = 1; i < argc; i++) {
+        last = 0;
+        if ((job = argjob(argv[i], &stage)) != NULL) {
+            set[n] = job;
+            leaders[n++] = last = job->pid;
+        }
+        else if (argv[i][0] != '%' && done_status(atoi(argv[i])) >= 0)
+            last = atoi(argv[i]);
+        else
+            fprintf(stderr, "wait: %s: no such job\n", argv[i]);
+    }
+    if (argc > 1 && last == 0)
+        status = 127;
+
+    if (n == 0) {
+        if (any)
+            status = 127;
+        else if (last != 0)
+            status = done_status(last);
+    }
+    else if ((fin = wait_jobs(set, leaders, n, any, 0)) < 0)
+        status = 128 + SIGINT;
+    else if (any)
+        status = done_status(leaders[fin]);
+    else if (last != 0)
+        status = done_status(last);
+    free(set);
+    free(leaders);
+    return status;
+}
 
-    if (argc == 0)  /* ignore blank line */
+/* break [n] / continue [n] */
+static int builtin_loopctl(int argc, char **argv) {
+    int n = (argc > 1) ? atoi(argv[1]) : 1;
+
+    if (n < 1) {
+        fprintf(stderr, "%s: %s: loop count out of range\n", argv[0], argv[1]);
         return 1;
+    }
+    if (loopdepth == 0)
+        return 0;
+    if (n > loopdepth)
+        n = loopdepth;
+    if (argv[0][0] == 'b')
+        breaking = n;
+    else
+        continuing = n;
+    return 0;
+}
 
-    /* should the job run in the background? */
-    if ((bg = (*argv[argc-1] == '&')) != 0) {
-        argv[--argc] = NULL;
+/* return [n] */
+static int builtin_return(int argc, char **argv) {
+    if (funcdepth == 0) {
+        fprintf(stderr, "return: can only `return' from a function\n");
+        return 1;
     }
-    return bg;
+    returning = 1;
+    return (argc > 1) ? atoi(argv[1]) : last_status;
 }
 
-static int search_dir(const char* path, const char* fn) {
-    struct dirent *p_dirent;
-    DIR* dir = opendir(path);
-    size_t size = strlen(fn);
-    if(dir == NULL) {
-        return -1;  /* Can't open it */
+/* a duration like 10, 1.5, 2m or 1h, in ns; -1 if malformed */
+static long long parse_duration(const char *s) {
+    char *end;
+    double d;
+
+    errno = 0;
+    d = strtod(s, &end);
+    if (end == s || errno != 0 || d < 0 || (*end != '\0' && end[1] != '\0'))
+        return -1;
+    switch (*end) {
+        case '\0':
+        case 's': break;
+        case 'm': d *= 60; break;
+        case 'h': d *= 3600; break;
+        case 'd': d *= 86400; break;
+        default: return -1;
     }
-    while((p_dirent = readdir(dir)) != NULL) {
-        if(memcmp(p_dirent->d_name, fn, size) == 0 &&
-            p_dirent->d_name[size] == '.') {
-            return 1;   /* Found */
+    return (long long)(d * 1e9);
+}
+
+/*
+ * opt_timeout - timeout [-s sig] [-k grace] duration cmd [arg ...]
+ *     Run cmd as a job that is sent sig (TERM) once duration passes
+ *     and SIGKILL grace (5s) after that.  The job's status is 124 if it
+ *     timed out, as with timeout(1), but no timeout process is involved:
+ *     the deadline lives in the shell's own deadline heap.
+ */
+static int opt_timeout(char **argv, int *ip, struct jobopts *o) {
+    int i, have = 0;
+
+    for (i = *ip + 1; argv[i] != NULL; i++) {
+        if (strcmp(argv[i], "-s") == 0 && argv[i + 1] != NULL) {
+            if ((o->tsig = signum(argv[++i])) < 0)
+                break;
+        }
+        else if (strcmp(argv[i], "-k") == 0 && argv[i + 1] != NULL) {
+            if ((o->grace = parse_duration(argv[++i])) < 0)
+                break;
         }
+        else if (!have) {
+            if ((o->timeout = parse_duration(argv[i])) < 0)
+                break;
+            have = 1;
+        }
+        else
+            break;
     }
-    closedir(dir);
-    return 0;   /* Not found */
+    if (!have || argv[i] == NULL || o->tsig < 0 || o->grace < 0 || o->timeout < 0) {
+        fprintf(stderr, "timeout: usage: timeout [-s sig] [-k grace] duration cmd ...\n");
+        return -1;
+    }
+    *ip = i;
+    return 0;
 }
 
-static char* search_env_variable(const char* var_name, const char* fn) {
-    static char env_var[MAX_VAR_LEN];
-    char* s = getenv(var_name);
-    char* p = s;
-    char* t = env_var;
-
-    while(*p && *p == ' ') p++;
+/*
+ * opt_run - run [--cpus list] [--mems list] [--nice n] [--ioprio class[:level]]
+ *     cmd [arg ...]
+ *     Run cmd on the given CPUs (like 0-7,12), allocating from the given
+ *     NUMA nodes, at nice value n (absolute, not added) and I/O class rt,
+ *     be, idle or none.  The child sets these on itself before exec, so
+ *     they hold for the whole job and whatever it forks.
+ */
+static int opt_run(char **argv, int *ip, struct jobopts *o) {
+    char opt[32], *eq;
+    int i, rc;
 
-    while(*p != '\0') {
-        while(*p && *p != ':') {
-            *t++ = *p++;
+    for (i = *ip + 1; argv[i] != NULL && strncmp(argv[i], "--", 2) == 0; i++) {
+        if (argv[i][2] == '\0') {
+            i++;
+            break;
         }
-        *t = '\0';
-        if(search_dir(env_var, fn) > 0) {
-            return env_var;
+        if ((eq = strchr(argv[i], '=')) != NULL) {
+            snprintf(opt, sizeof(opt), "%.*s", (int)(eq - argv[i]), argv[i]);
+            rc = place_option(&o->place, "run", opt, eq + 1);
         }
-        p++;
-        while(*p && *p == ' ') p++;
-        t = env_var;
+        else if ((rc = place_option(&o->place, "run", argv[i], argv[i + 1])) == 0)
+            i++;
+        if (rc < 0)
+            return -1;
+        if (rc > 0)
+            break;
+    }
+    if (argv[i] == NULL || strncmp(argv[i], "--", 2) == 0) {
+        fprintf(stderr, "run: usage: run [--cpus list] [--mems list] [--nice n] "
+                "[--ioprio class[:level]] cmd ...\n");
+        return -1;
+    }
+    *ip = i;
+    return 0;
+}
+
+/*
+ * opt_capture - capture cmd [arg ...]
+ *     Keep the job's stdout and stderr instead of passing them on, to
+ *     read with `output` while it runs or once it is done.
+ */
+static int opt_capture(char **argv, int *ip, struct jobopts *o) {
+    if (argv[*ip + 1] == NULL) {
+        fprintf(stderr, "capture: usage: capture cmd ...\n");
+        return -1;
     }
+    o->capture = 1;
+    (*ip)++;
+    return 0;
+}
+
+/* the job prefixes; each may follow another, as in run ... timeout ... cmd */
+static const struct prefix {
+    const char *name;
+    int (*opts)(char **argv, int *ip, struct jobopts *o);
+} prefixes[] = {
+    { "timeout", opt_timeout },
+    { "run",     opt_run },
+    { "capture", opt_capture },
+    { NULL, NULL }
+};
+
+static const struct prefix *getprefix(const char *name) {
+    int i;
+
+    for (i = 0; prefixes[i].name != NULL; i++)
+        if (strcmp(prefixes[i].name, name) == 0)
+            return getfunc(name) == NULL ? &prefixes[i] : NULL;
     return NULL;
 }
 
-static char* search_path_variable(const char* fn) {
-    static char path_var[MAX_VAR_LEN];
-    char* s = getenv("PATH");
-    char* p = s;
-    char* t = path_var;
+/* run_prefixed - launch argv, which starts with job prefixes, as one job */
+static int run_prefixed(struct node *n, char **argv, int bg) {
+    const struct prefix *p;
+    struct jobopts o;
+    char text[MAXLINE], **a;
+    int i = 0, len = 0;
+
+    memset(&o, 0, sizeof(o));
+    o.grace = TIMEOUT_GRACE;
+    o.tsig = SIGTERM;
+    while (argv[i] != NULL && (p = getprefix(argv[i])) != NULL)
+        if (p->opts(argv, &i, &o) < 0)
+            return 125;
+
+    if (n->text == NULL) {
+        text[0] = '\0';
+        for (a = argv; *a != NULL && len < MAXLINE; a++)
+            len += snprintf(text + len, MAXLINE - len, "%s%s", len ? " " : "", *a);
+        n->text = text;
+    }
+    return launch(&n, 1, bg, n->text, argv + i, &o);
+}
+
+static int builtin_prefix(int argc, char **argv) {
+    struct node bare;
+
+    /* our redirections are already in place */
+    memset(&bare, 0, sizeof(bare));
+    bare.type = N_CMD;
+    return run_prefixed(&bare, argv, 0);
+}
+
+/* the running job named by %jid or a pid, or NULL (reported) */
+static struct job_t *place_target(const char *cmd, const char *arg) {
+    struct job_t *job;
+    int stage;
+
+    if ((arg[0] != '%' && !isdigit((unsigned char)arg[0])) ||
+            (job = argjob(arg, &stage)) == NULL) {
+        fprintf(stderr, "%s: %s: No such job\n", cmd, arg);
+        return NULL;
+    }
+    return job;
+}
 
-    while(*p && *p == ' ') p++;
+/*
+ * renice / repin - change a running job's priority or CPUs.
+ *     renice [--nice] n | --ioprio class[:level] %jid|pid ...
+ *     repin [--cpus] list %jid|pid ...
+ *     The change applies to the job's whole process group, including
+ *     what its processes have forked; in a subshell, whose jobs share
+ *     our group, to each stage instead.
+ */
+static int builtin_place(int argc, char **argv) {
+    struct placement pl;
+    struct job_t *job;
+    const char *deflt = (argv[0][2] == 'n') ? "--nice" : "--cpus";
+    int i = 1, rc = 0, status = 0;
+
+    /* the first argument is the value, unless options are given */
+    memset(&pl, 0, sizeof(pl));
+    if (argc > 1 && strncmp(argv[1], "--", 2) != 0)
+        rc = place_option(&pl, argv[0], deflt, argv[i++]);
+    for (; rc == 0 && i < argc && strncmp(argv[i], "--", 2) == 0; i += 2)
+        rc = place_option(&pl, argv[0], argv[i], argv[i + 1]);
+    if (rc < 0)
+        return 2;
+    if (rc > 0 || pl.set == 0 || (pl.set & PL_MEMS) || i >= argc) {
+        if (deflt[2] == 'n')
+            fprintf(stderr, "renice: usage: renice [--nice] n | "
+                    "--ioprio class[:level] %%jid|pid ...\n");
+        else
+            fprintf(stderr, "repin: usage: repin [--cpus] list %%jid|pid ...\n");
+        return 2;
+    }
 
-    while(*p != '\0') {
-        while(*p && *p != ':') {
-            *t++ = *p++;
+    for (; i < argc; i++) {
+        if ((job = place_target(argv[0], argv[i])) == NULL) {
+            status = 1;
+            continue;
         }
-        *t = '\0';
-        if(search_dir(path_var, fn) > 0) {
-            return path_var;
+        if (!subshell)
+            rc = place_job(job->pid, NULL, 0, &pl);
+        else
+            rc = place_job(0, job->pids, job->nprocs, &pl);
+        if (rc < 0) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i], strerror(errno));
+            status = 1;
         }
-        p++;
-        while(*p && *p == ' ') p++;
-        t = path_var;
     }
-    return NULL;
+    return status;
+}
+
+/*
+ * Batching.  execve fails with E2BIG once the arguments and the
+ * environment together pass ARG_MAX, and any single string passes
+ * MAX_ARG_STRLEN (32 pages on Linux).  Each argument costs its bytes,
+ * its NUL and its pointer, as the kernel counts them.
+ */
+#define BATCH_SLACK  2048           /* as xargs leaves, for the loader */
+#define BATCH_STRLEN (32 * 4096)
+
+static long arg_cost(const char *s) {
+    return strlen(s) + 1 + sizeof(char *);
+}
+
+/* batch_items - the lines of stdin, in one malloc'd block; n gets how many */
+static char **batch_items(int *n) {
+    struct strvec sv = { 0 };
+    char *buf = NULL, *p, *nl, **v = NULL;
+    size_t len = 0, cap = 0;
+    ssize_t r;
+    int i;
+
+    for (;;) {
+        if (len + 4096 + 1 > cap) {
+            cap = cap ? cap * 2 : 65536;
+            if ((buf = realloc(buf, cap)) == NULL)
+                app_error("out of memory");
+        }
+        if ((r = read(0, buf + len, cap - len - 1)) < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        len += r;
+    }
+    buf[len] = '\0';
+    for (p = buf; *p; p = nl + 1) {
+        if ((nl = strchr(p, '\n')) == NULL)
+            nl = p + strlen(p) - 1;
+        else
+            *nl = '\0';
+        if (*p != '\0')
+            strvec_push(&sv, p);
+    }
+    /* the vector, then the strings it points to */
+    if (sv.n > 0) {
+        if ((v = malloc((sv.n + 1) * sizeof(char *) + len + 1)) == NULL)
+            app_error("out of memory");
+        p = memcpy(v + sv.n + 1, buf, len + 1);
+        for (i = 0; i < sv.n; i++)
+            v[i] = p + (sv.v[i] - buf);
+        v[i] = NULL;
+    }
+    *n = sv.n;
+    free(sv.v);
+    free(buf);
+    return v;
 }
 
-static int builtin_cmd(char **argv) {
-    if (strcmp(argv[0], "quit") == 0) {
-        exit(EXIT_SUCCESS);
+/*
+ * batch [-P n] [-n max] cmd [arg ...] [-- item ...]
+ *     Run cmd with its args and as many items as execve takes, as
+ *     often as it takes to pass them all, like xargs.  Without --, the
+ *     items are the lines of stdin.  Each batch is sized to ARG_MAX
+ *     less the environment and the fixed args; -n caps it at max
+ *     items.  Batches run one at a time in the foreground, or with -P
+ *     up to n at once in the background.  Return 0, or 123 if any
+ *     batch failed, as xargs does.
+ */
+static int builtin_batch(int argc, char **argv) {
+    struct strvec av = { 0 };
+    struct jobopts o;
+    struct node bare, *np = &bare;
+    struct job_t **set;
+    pid_t *leaders;
+    char **items, **from_stdin = NULL, **e, text[MAXLINE];
+    long budget, fixed = sizeof(char *), cost;
+    int i, j, k, nfixed, nitems, par = 1, max = 0, run = 0, fin, rc, status = 0;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-' && argv[i][1] != '-'; i += 2) {
+        if (strcmp(argv[i], "-P") == 0 && (par = atoi(argv[i + 1])) > 0)
+            continue;
+        if (strcmp(argv[i], "-n") == 0 && (max = atoi(argv[i + 1])) > 0)
+            continue;
+        i = argc;
+    }
+    for (j = i; j < argc && strcmp(argv[j], "--") != 0; j++)
+        ;
+    if (i >= argc || j == i) {
+        fprintf(stderr, "batch: usage: batch [-P n] [-n max] cmd [arg ...] "
+                "[-- item ...]\n");
+        return 2;
+    }
+    nfixed = j - i;
+    if (j < argc) {
+        items = argv + j + 1;
+        nitems = argc - j - 1;
     }
-    else if (strcmp(argv[0], "jobs") == 0) {
-        listjobs(jobs);
+    else
+        items = from_stdin = batch_items(&nitems);
+
+    if ((budget = sysconf(_SC_ARG_MAX)) <= 0)
+        budget = 128 * 1024;
+    for (e = environ; *e != NULL; e++)
+        budget -= arg_cost(*e);
+    for (k = i; k < j; k++)
+        fixed += arg_cost(argv[k]);
+    budget -= fixed + BATCH_SLACK;
+    if (budget <= 0) {
+        fprintf(stderr, "batch: environment and arguments leave no room\n");
+        free(from_stdin);
         return 1;
     }
-    else if (strcmp(argv[0], "bg") == 0 || strcmp(argv[0], "fg") == 0) {
-        do_bgfg(argv);
+
+    memset(&bare, 0, sizeof(bare));
+    bare.type = N_CMD;
+    memset(&o, 0, sizeof(o));
+    o.quiet = 1;
+    text[0] = '\0';
+    for (k = i, rc = 0; k < j && rc < MAXLINE; k++)
+        rc += snprintf(text + rc, MAXLINE - rc, "%s%s", rc ? " " : "", argv[k]);
+    if ((set = malloc(par * sizeof(*set))) == NULL ||
+            (leaders = malloc(par * sizeof(*leaders))) == NULL)
+        app_error("out of memory");
+
+    for (k = 0; k < nitems && !intr; ) {
+        av.n = 0;
+        for (j = i; j < i + nfixed; j++)
+            strvec_push(&av, argv[j]);
+        for (cost = 0; k < nitems && (max == 0 || av.n - nfixed < max); k++) {
+            if (strlen(items[k]) >= BATCH_STRLEN || arg_cost(items[k]) > budget) {
+                if (av.n > nfixed)
+                    break;
+                fprintf(stderr, "batch: argument too long: %.32s...\n", items[k]);
+                status = 123;
+                continue;
+            }
+            if (cost + arg_cost(items[k]) > budget)
+                break;
+            cost += arg_cost(items[k]);
+            strvec_push(&av, items[k]);
+        }
+        if (av.n == nfixed)
+            continue;
+
+        if (par == 1) {
+            if (launch(&np, 1, 0, text, av.v, &o) != 0)
+                status = 123;
+            continue;
+        }
+        /* a slot for one more: wait for any batch to finish */
+        if (run == par) {
+            if ((fin = wait_jobs(set, leaders, run, 1, 0)) < 0)
+                break;
+            if (done_status(leaders[fin]) != 0)
+                status = 123;
+            set[fin] = set[--run];
+            leaders[fin] = leaders[run];
+        }
+        launch(&np, 1, 1, text, av.v, &o);
+        if ((set[run] = getjobpid(jobs, last_bgpid)) != NULL)
+            leaders[run++] = last_bgpid;
+        else if (done_status(last_bgpid) != 0)
+            status = 123;
+    }
+
+    if (run > 0 && !intr && wait_jobs(set, leaders, run, 0, 0) >= 0) {
+        for (j = 0; j < run; j++)
+            if (done_status(leaders[j]) != 0)
+                status = 123;
+    }
+    else if (run > 0) {
+        /* ctrl-c reaches only the foreground, so pass it on */
+        for (j = 0; j < run; j++)
+            if (set[j]->pid == leaders[j])
+                job_signal(set[j], SIGINT);
+    }
+    if (intr)
+        status = 128 + SIGINT;
+    free(set);
+    free(leaders);
+    free(av.v);
+    free(from_stdin);
+    return status;
+}
+
+/*
+ * output [-f] [-n lines] %jid|pid
+ *     Write what a job started with capture has output: all that is
+ *     kept, or its last lines.  Finished jobs' output stays until 256
+ *     more jobs are done.  With -f, go on as more comes until the job
+ *     is done or ctrl-c.
+ */
+static int builtin_output(int argc, char **argv) {
+    struct capture *cap;
+    struct job_t *job;
+    struct ev evs[8];
+    sigset_t set, old, mask;
+    long long off;
+    int i, k, nev, stage, follow = 0, lines = -1, status = 0;
+
+    for (i = 1; i < argc - 1 && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-f") == 0)
+            follow = 1;
+        else if (strcmp(argv[i], "-n") == 0 && isdigit((unsigned char)argv[i + 1][0]))
+            lines = atoi(argv[++i]);
+        else
+            break;
+    }
+    if (i != argc - 1 || (argv[i][0] != '%' && !isdigit((unsigned char)argv[i][0]))) {
+        fprintf(stderr, "output: usage: output [-f] [-n lines] %%jid|pid\n");
+        return 2;
+    }
+
+    /* the SIGCHLD handler may move the capture to the done jobs */
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, &old);
+    mask = old;
+    sigdelset(&mask, SIGCHLD);
+    if ((job = argjob(argv[i], &stage)) != NULL)
+        cap = job->cap;
+    else
+        cap = done_capture(argv[i]);
+    if (cap == NULL) {
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        fprintf(stderr, "output: %s: no captured output\n", argv[i]);
         return 1;
     }
+
+    off = (lines >= 0) ? cap_tail(cap, lines) : 0;
+    if (off < cap->lo)
+        fprintf(stderr, "output: %s: first %lld bytes dropped\n", argv[i], cap->lo);
+    fflush(stdout);
+    for (;;) {
+        if ((off = cap_copy(cap, off, STDOUT_FILENO)) < 0) {
+            perror("output");
+            status = 1;
+            break;
+        }
+        if (!follow || cap->fd < 0 || intr)
+            break;
+        nev = ev_wait(evs, 8, -1, &mask);
+        for (k = 0; k < nev; k++) {
+            if (evs[k].kind == EV_TIMER)
+                dl_expire();
+            else if (evs[k].kind == EV_CAPTURE)
+                cap_event(evs[k].id);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return intr ? 128 + SIGINT : status;
+}
+
+/* after_end - node a is done with, in state; its block goes */
+static void after_end(struct after_node *a, int state) {
+    a->state = state;
+    free(a->deps);
+    a->deps = NULL;
+    a->argv = NULL;
+    a->text = NULL;
+}
+
+/* after_start - launch node a as a background job */
+static void after_start(struct after_node *a) {
+    struct node bare;
+    pid_t bgpid = last_bgpid;
+    int rc;
+
+    memset(&bare, 0, sizeof(bare));
+    bare.type = N_CMD;
+    bare.text = a->text;
+    last_bgpid = 0;
+    rc = run_prefixed(&bare, a->argv, 1);
+    a->pid = last_bgpid;
+    last_bgpid = bgpid;     /* $! is the user's, not changed under them */
+    if (a->pid != 0)
+        a->state = A_RUN;
     else {
+        a->status = (rc != 0) ? rc : 1;
+        after_end(a, A_DONE);
+    }
+}
+
+/*
+ * after_run - bring the graph up to date with the jobs that are gone,
+ *     skip the nodes that can no longer run, and start those whose
+ *     prerequisites are all done, as many as the limit lets run.
+ *
+ *     Launching is not for the SIGCHLD handler, so its deletejob only
+ *     sets graph.dirty, and whichever loop the shell sleeps in
+ *     (wait_input, wait_jobs) calls this when woken.  A node waits only
+ *     for earlier ones, so one pass in order settles a chain.
+ */
+static void after_run(void) {
+    struct after_node *a, *b;
+    struct after_dep *d;
+    sigset_t set, old;
+    long limit;
+    int i, k, pending, failed, running, progress;
+
+    graph.dirty = 0;
+    /* forked children have the graph too, but it is not theirs to run */
+    if (graph.first == graph.n || getpid() != shell_pid)
+        return;
+    if ((limit = graph.limit) <= 0 && (limit = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+        limit = 1;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, &old);
+    do {
+        progress = 0;
+        running = 0;
+        for (i = graph.first; i < graph.n; i++) {
+            a = &graph.v[i];
+            if (a->state != A_RUN)
+                continue;
+            if (getjobpid(jobs, a->pid) != NULL) {
+                running++;
+                continue;
+            }
+            /* a record pushed out of done_jobs: all we know is it exited */
+            if ((a->status = done_status(a->pid)) < 0)
+                a->status = 0;
+            after_end(a, A_DONE);
+            progress = 1;
+        }
+        for (i = graph.first; i < graph.n; i++) {
+            a = &graph.v[i];
+            if (a->state != A_WAIT)
+                continue;
+            for (k = 0, pending = 0, failed = 0; k < a->ndeps; k++) {
+                d = &a->deps[k];
+                if (d->status < 0 && d->node >= 0) {
+                    b = &graph.v[d->node];
+                    if (b->state == A_DONE || b->state == A_SKIP)
+                        d->status = b->status;
+                }
+                else if (d->status < 0 && getjobpid(jobs, d->pid) == NULL) {
+                    if ((d->status = done_status(d->pid)) < 0)
+                        d->status = 0;
+                }
+                if (d->status < 0)
+                    pending++;
+                else if (d->status != 0)
+                    failed++;
+            }
+            if (pending > 0)
+                continue;
+            if (a->ok && failed > 0) {
+                printf("@%d skipped: %s\n", i + 1, a->text);
+                a->status = 127;    /* as a command that could not run */
+                after_end(a, A_SKIP);
+                progress = 1;
+                continue;
+            }
+            if (running >= limit)
+                continue;
+            after_start(a);
+            sigprocmask(SIG_BLOCK, &set, NULL);     /* launch let it in */
+            if (a->state == A_RUN)
+                running++;
+            progress = 1;
+        }
+    } while (progress);
+
+    while (graph.first < graph.n && graph.v[graph.first].state >= A_DONE)
+        graph.first++;
+    for (i = graph.first, graph.nwait = 0; i < graph.n; i++)
+        if (graph.v[i].state == A_WAIT)
+            graph.nwait++;
+    fflush(stdout);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * after [-s] %jid|pid|@node ... -- cmd [arg ...]
+ *     Start cmd as a background job once all the jobs and nodes named
+ *     have exited; with -s, only if they all succeeded, or else skip
+ *     it.  The new node is printed as @N for later afters to name, so
+ *     a graph is built up one edge list at a time.  Independent nodes
+ *     run at once, up to the limit set with graph -j.
+ */
+static int builtin_after(int argc, char **argv) {
+    struct after_node *a, *v;
+    struct after_dep *d;
+    struct job_t *job;
+    sigset_t set, old;
+    size_t size;
+    char *p;
+    int i, j, k, stage, node, ok, status = 0;
+
+    i = (argc > 1 && strcmp(argv[1], "-s") == 0) ? 2 : 1;
+    ok = (i == 2);
+    for (j = i; j < argc && strcmp(argv[j], "--") != 0; j++)
+        ;
+    if (j == i || j + 1 >= argc) {
+        fprintf(stderr, "after: usage: after [-s] %%jid|pid|@node ... -- cmd [arg ...]\n");
+        return 2;
+    }
+    if (graph.n == graph.cap) {
+        graph.cap = graph.cap ? 2 * graph.cap : 16;
+        if ((v = realloc(graph.v, graph.cap * sizeof(*v))) == NULL)
+            app_error("out of memory");
+        graph.v = v;
+    }
+
+    /* deps, argv and text in one block */
+    size = (j - i) * sizeof(*d) + (argc - j) * sizeof(char *);
+    for (k = j + 1; k < argc; k++)
+        size += 2 * (strlen(argv[k]) + 1);
+    a = &graph.v[graph.n];
+    memset(a, 0, sizeof(*a));
+    if ((a->deps = malloc(size)) == NULL)
+        app_error("out of memory");
+    a->argv = (char **)(a->deps + (j - i));
+    p = (char *)(a->argv + (argc - j));
+    for (k = j + 1; k < argc; k++) {
+        a->argv[k - j - 1] = strcpy(p, argv[k]);
+        p += strlen(p) + 1;
+    }
+    a->argv[argc - j - 1] = NULL;
+    a->text = p;
+    for (k = j + 1; k < argc; k++)
+        p += sprintf(p, "%s%s", (k > j + 1) ? " " : "", argv[k]);
+    if (p - a->text >= MAXLINE)
+        a->text[MAXLINE - 1] = '\0';
+    a->ok = ok;
+    a->state = A_WAIT;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, &old);
+    for (k = i; k < j; k++) {
+        d = &a->deps[a->ndeps];
+        d->pid = 0;
+        d->node = -1;
+        d->status = -1;
+        if (argv[k][0] == '@') {
+            node = atoi(argv[k] + 1);
+            if (node < 1 || node > graph.n) {
+                fprintf(stderr, "after: %s: no such node\n", argv[k]);
+                status = 1;
+                break;
+            }
+            d->node = node - 1;
+        }
+        else if (argv[k][0] != '%' && !isdigit((unsigned char)argv[k][0])) {
+            fprintf(stderr, "after: %s: argument must be a PID, %%jobid or @node\n",
+                    argv[k]);
+            status = 1;
+            break;
+        }
+        else if ((job = argjob(argv[k], &stage)) != NULL)
+            d->pid = job->pid;
+        else if ((d->status = done_named(argv[k])) < 0) {
+            fprintf(stderr, "after: %s: no such job\n", argv[k]);
+            status = 1;
+            break;
+        }
+        a->ndeps++;
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    if (status != 0) {
+        free(a->deps);
+        return status;
+    }
+
+    graph.n++;
+    graph.nwait++;
+    printf("@%d %s\n", graph.n, a->text);
+    after_run();
+    return 0;
+}
+
+/*
+ * graph [-j n] - list the nodes of after that are waiting or running,
+ *     each with the jobs and nodes it still waits for; -j sets how many
+ *     may run at once (0: one per CPU, the default).
+ */
+static int builtin_graph(int argc, char **argv) {
+    struct after_node *a;
+    struct after_dep *d;
+    struct job_t *job;
+    sigset_t set, old;
+    int i, k, n;
+
+    if (argc == 3 && strcmp(argv[1], "-j") == 0 && isdigit((unsigned char)argv[2][0])) {
+        graph.limit = atoi(argv[2]);
+        after_run();
         return 0;
     }
+    if (argc != 1) {
+        fprintf(stderr, "graph: usage: graph [-j n]\n");
+        return 2;
+    }
+
+    after_run();
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, &old);
+    for (i = graph.first; i < graph.n; i++) {
+        a = &graph.v[i];
+        if (a->state == A_RUN && (job = getjobpid(jobs, a->pid)) != NULL)
+            printf("@%d running as %%%d: %s\n", i + 1, job->jid, a->text);
+        if (a->state != A_WAIT)
+            continue;
+        printf("@%d", i + 1);
+        for (k = 0, n = 0; k < a->ndeps; k++) {
+            d = &a->deps[k];
+            if (d->status >= 0)
+                continue;
+            printf(n++ ? " " : " after ");
+            if (d->node >= 0)
+                printf("@%d", d->node + 1);
+            else if ((job = getjobpid(jobs, d->pid)) != NULL)
+                printf("%%%d", job->jid);
+            else
+                printf("%d", d->pid);
+        }
+        /* held back by the limit */
+        if (n == 0)
+            printf(" ready");
+        printf("%s: %s\n", a->ok ? " if ok" : "", a->text);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
+
+/*
+ * Pure builtins only write to stdout and leave the shell untouched, so
+ * $(...) may run them in-process instead of in a subshell.
+ */
+static const struct builtin {
+    const char *name;
+    builtin_fn *fn;
+    int pure;
+} builtins[] = {
+    { "quit",     builtin_quit,    0 },
+    { "exit",     builtin_exit,    0 },
+    { "jobs",     builtin_jobs,    0 },
+    { "wait",     builtin_wait,    0 },
+    { "kill",     builtin_kill,    0 },
+    { "timeout",  builtin_prefix,  0 },
+    { "run",      builtin_prefix,  0 },
+    { "capture",  builtin_prefix,  0 },
+    { "output",   builtin_output,  0 },
+    { "renice",   builtin_place, 0 },
+    { "repin",    builtin_place, 0 },
+    { "batch",    builtin_batch,   0 },
+    { "after",    builtin_after,   0 },
+    { "graph",    builtin_graph,   0 },
+    { "bg",       do_bgfg,         0 },
+    { "fg",       do_bgfg,         0 },
+    { "echo",     builtin_echo,    1 },
+    { "test",     builtin_test,    1 },
+    { "[",        builtin_test,    1 },
+    { "true",     builtin_true,    1 },
+    { ":",        builtin_true,    1 },
+    { "false",    builtin_false,   1 },
+    { "pwd",      builtin_pwd,     1 },
+    { "cd",       builtin_cd,      0 },
+    { "export",   builtin_export,  0 },
+    { "unset",    builtin_unset,   0 },
+    { "alias",    builtin_alias,   0 },
+    { "unalias",  builtin_unalias, 0 },
+    { "let",      builtin_let,     0 },
+    { "break",    builtin_loopctl, 0 },
+    { "continue", builtin_loopctl, 0 },
+    { "return",   builtin_return,  0 },
+    { NULL,       NULL,            0 }
+};
+
+static const struct builtin *findbuiltin(const char *name) {
+    const struct builtin *b;
+
+    for (b = builtins; b->name != NULL; b++)
+        if (strcmp(b->name, name) == 0)
+            return b;
+    return NULL;
+}
+
+/*
+ * getbuiltin - return the function implementing builtin name, or NULL
+ *     if name is not a builtin and must be run as a program.
+ */
+static builtin_fn *getbuiltin(const char *name) {
+    const struct builtin *b = findbuiltin(name);
+
+    return (b != NULL) ? b->fn : NULL;
 }
 
 /* fg/bg ([pid]|[%jid]) */
-static void do_bgfg(char **argv) {
+static int do_bgfg(int argc, char **argv) {
     int  error_code;
     int  id;
     int is_jid;
@@ -217,14 +1349,19 @@ static void do_bgfg(char **argv) {
 
         /* resume if needed */
         if (job->state == ST) {
-            if(kill(-(job->pid), SIGCONT) == -1)
+            if (job_signal(job, SIGCONT) == -1)
                 unix_error("kill");
         }
         job->state = (bg ? BG : FG);
+        PROBE4(job_state, job->pid, job->jid, job->cmdline, job->state);
+        publish(job);
 
-        if (bg)
+        if (bg) {
             printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
-        return;
+            return 0;
+        }
+        waitfg(job->pid);
+        return last_status;
     } while (0);
 
     switch (error_code) {
@@ -241,54 +1378,448 @@ static void do_bgfg(char **argv) {
             fprintf(stderr, "%s command requires PID or %%jobid argument\n", argv[0]);
             break;
     }
+    return 1;
 }
 
 /*
- * waitfg - Block until process pid is no longer the foreground process
+ * recently deleted jobs, so that `wait pid` still finds the status and
+ * `output` the output
  */
-static void waitfg(pid_t pid) {
-    /* "wait" but not reap - using busy loops */
-    while (fgpid(jobs) == pid)
-        sleep(0);
+#define MAXDONE 256
+
+struct done_job {
+    pid_t leader, last;
+    int jid;
+    int status;
+    struct capture *cap;    /* spilled to its memfd, or NULL */
+};
+
+static struct done_job done0[MAXDONE];
+static struct done_job *done_jobs = done0;
+static unsigned ndone;
+
+static int job_exit_status(struct job_t *job) {
+    if (job->timedout == 1)
+        return 124;     /* as timeout(1) */
+    if (WIFEXITED(job->status))
+        return WEXITSTATUS(job->status);
+    return 128 + WTERMSIG(job->status);
 }
 
-static void clearjob(struct job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
-}
+static int done_status(pid_t pid) {
+    unsigned i;
 
-static void initjobs(struct job_t *jobs) {
-    int i;
+    for (i = ndone; i > 0 && ndone - i < MAXDONE; i--)
+        if (done_jobs[(i - 1) % MAXDONE].leader == pid ||
+                done_jobs[(i - 1) % MAXDONE].last == pid)
+            return done_jobs[(i - 1) % MAXDONE].status;
+    return -1;
+}
 
-    for (i = 0; i < MAXJOBS; i++)
-        clearjob(&jobs[i]);
+/* done_named - the status of the latest deleted job named by %jid or pid, or -1 */
+static int done_named(const char *arg) {
+    struct done_job *d;
+    unsigned i;
+    int jid = (arg[0] == '%') ? atoi(arg + 1) : 0;
+    pid_t pid = (arg[0] == '%') ? 0 : atoi(arg);
+
+    for (i = ndone; i > 0 && ndone - i < MAXDONE; i--) {
+        d = &done_jobs[(i - 1) % MAXDONE];
+        if (jid != 0 ? d->jid == jid : (d->leader == pid || d->last == pid))
+            return d->status;
+    }
+    return -1;
 }
 
-static int maxjid(struct job_t *jobs) {
-    int i, max=0;
+/*
+ * done_capture - the output kept of the latest deleted job named by %jid
+ *     or pid that had any; jids are reused soon, so others are skipped.
+ */
+static struct capture *done_capture(const char *arg) {
+    struct done_job *d;
+    unsigned i;
+    int jid = (arg[0] == '%') ? atoi(arg + 1) : 0;
+    pid_t pid = (arg[0] == '%') ? 0 : atoi(arg);
+
+    for (i = ndone; i > 0 && ndone - i < MAXDONE; i--) {
+        d = &done_jobs[(i - 1) % MAXDONE];
+        if (d->cap != NULL &&
+                (jid != 0 ? d->jid == jid : (d->leader == pid || d->last == pid)))
+            return d->cap;
+    }
+    return NULL;
+}
 
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid > max)
-            max = jobs[i].jid;
-    return max;
+/* cap_event - drain the captured output of the job in slot */
+static void cap_event(unsigned slot) {
+    sigset_t set, old;
+
+    /* deletejob, in the SIGCHLD handler, takes the capture away */
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, &old);
+    if (slot < MAXJOBS && jobs[slot].cap != NULL)
+        cap_drain(jobs[slot].cap);
+    sigprocmask(SIG_SETMASK, &old, NULL);
 }
 
-static int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) {
-    int i;
+/*
+ * wait_jobs - sleep until all n jobs in set are done (if any, until one
+ *     is), or until ctrl-c.  leaders[] holds their leaders' pids, since
+ *     a finished job's slot is cleared.  With fg, a job that stops is
+ *     done as well.
+ *
+ *     Only the jobs' own pidfds wake us; SIGCHLD is let in only when
+ *     stops must be seen or some process has no pidfd.  Return the index
+ *     of a finished job, or -1 if interrupted.
+ */
+static int wait_jobs(struct job_t **set, const pid_t *leaders, int n,
+        int any, int fg) {
+    struct ev evs[64];
+    struct job_t *job;
+    struct rusage ru;
+    sigset_t set_chld, old, mask;
+    int i, k, nev, ndone, fin, status, sigchld = fg, nofd = 0;
+
+    sigemptyset(&set_chld);
+    sigaddset(&set_chld, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &set_chld, &old) == -1)
+        unix_error("sigprocmask");
+
+    for (i = 0; i < n; i++) {
+        for (k = 0; set[i]->pid == leaders[i] && k < set[i]->nprocs; k++) {
+            if (set[i]->pids[k] == 0)
+                continue;
+            if (set[i]->pidfds[k] < 0 || ev_add(set[i]->pidfds[k], EV_PIDFD,
+                        (set[i] - jobs) * MAXPIPES + k) < 0)
+                sigchld = nofd = 1;
+        }
+    }
+    /* other jobs' ends may start nodes of the graph meanwhile */
+    if (graph.nwait > 0)
+        sigchld = 1;
+    mask = old;
+    if (sigchld)
+        sigdelset(&mask, SIGCHLD);
+    else
+        sigaddset(&mask, SIGCHLD);
+
+    for (;;) {
+        if (graph.dirty)
+            after_run();
+        fin = -1;
+        for (i = 0, ndone = 0; i < n; i++) {
+            if (set[i]->pid != leaders[i] || (fg && set[i]->state != FG)) {
+                ndone++;
+                if (fin < 0)
+                    fin = i;
+            }
+        }
+        if (ndone == n || (any && ndone > 0))
+            break;
+        if (intr) {
+            fin = -1;
+            break;
+        }
+        /* a session has no SIGCHLD handler: poll what has no pidfd */
+        nev = ev_wait(evs, 64, (session && nofd) ? 10 : -1, &mask);
+        for (i = 0; session && nofd && i < n; i++)
+            for (k = 0; set[i]->pid == leaders[i] && k < set[i]->nprocs; k++)
+                if (set[i]->pids[k] != 0 && wait4(set[i]->pids[k],
+                            &status, WNOHANG|WUNTRACED, &ru) > 0)
+                    reap_proc(set[i], k, status, &ru);
+        for (i = 0; i < nev; i++) {
+            if (evs[i].kind == EV_TIMER)
+                dl_expire();
+            if (evs[i].kind == EV_CAPTURE)
+                cap_event(evs[i].id);
+            if (evs[i].kind != EV_PIDFD)
+                continue;
+            job = &jobs[evs[i].id / MAXPIPES];
+            k = evs[i].id % MAXPIPES;
+            if (job->pids[k] != 0 &&
+                    wait4(job->pids[k], &status, WNOHANG|WUNTRACED, &ru) > 0)
+                reap_proc(job, k, status, &ru);
+        }
+    }
 
-    if (pid < 1)
+    flush_notes();
+    /* reaped stages closed their pidfds, which took them out of the set */
+    for (i = 0; i < n; i++)
+        for (k = 0; set[i]->pid == leaders[i] && k < set[i]->nprocs; k++)
+            if (set[i]->pids[k] != 0 && set[i]->pidfds[k] >= 0)
+                ev_del(set[i]->pidfds[k]);
+    if (sigprocmask(SIG_SETMASK, &old, NULL) == -1)
+        unix_error("sigprocmask");
+    return fin;
+}
+
+/*
+ * Deadlines - every job with a timeout sits in one min-heap ordered by
+ * deadline, and a single timerfd is armed for the earliest of them.
+ * The heap is touched by the SIGCHLD handler (deletejob), so everything
+ * else runs with SIGCHLD blocked.
+ */
+static int dl_heap0[MAXJOBS];
+static int *dl_heap = dl_heap0;     /* job slots */
+static int dl_n;
+static int dl_fd = -1;
+
+static long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long realtime_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void dl_set(int i, int slot) {
+    dl_heap[i] = slot;
+    jobs[slot].heappos = i;
+}
+
+static void dl_up(int i) {
+    int slot = dl_heap[i];
+
+    while (i > 0 && jobs[dl_heap[(i - 1) / 2]].deadline > jobs[slot].deadline) {
+        dl_set(i, dl_heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    dl_set(i, slot);
+}
+
+static void dl_down(int i) {
+    int slot = dl_heap[i], c;
+
+    while ((c = 2 * i + 1) < dl_n) {
+        if (c + 1 < dl_n && jobs[dl_heap[c + 1]].deadline < jobs[dl_heap[c]].deadline)
+            c++;
+        if (jobs[dl_heap[c]].deadline >= jobs[slot].deadline)
+            break;
+        dl_set(i, dl_heap[c]);
+        i = c;
+    }
+    dl_set(i, slot);
+}
+
+/* arm the timerfd for the earliest deadline, or disarm it */
+static void dl_arm(void) {
+    struct itimerspec its;
+    long long t;
+
+    memset(&its, 0, sizeof(its));
+    if (dl_n > 0) {
+        t = jobs[dl_heap[0]].deadline;
+        its.it_value.tv_sec = t / 1000000000LL;
+        its.it_value.tv_nsec = t % 1000000000LL;
+    }
+    if (timerfd_settime(dl_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        unix_error("timerfd_settime");
+}
+
+/* job->deadline is set: start watching it */
+static void dl_insert(struct job_t *job) {
+    if (dl_fd < 0) {
+        if ((dl_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK)) < 0)
+            unix_error("timerfd_create");
+        if (ev_add(dl_fd, EV_TIMER, 0) < 0)
+            unix_error("epoll_ctl");
+    }
+    dl_set(dl_n, job - jobs);
+    dl_up(dl_n++);
+    if (job->heappos == 0)
+        dl_arm();
+}
+
+static void dl_remove(struct job_t *job) {
+    int i = job->heappos, slot;
+
+    job->heappos = -1;
+    if (--dl_n > i) {
+        slot = dl_heap[dl_n];
+        dl_set(i, slot);
+        dl_down(i);
+        dl_up(jobs[slot].heappos);
+    }
+    if (i == 0)
+        dl_arm();
+}
+
+/*
+ * dl_expire - act on every deadline that has passed: send the job its
+ *     timeout signal, then SIGKILL once the grace period is over too.
+ */
+static void dl_expire(void) {
+    struct job_t *job;
+    sigset_t set, old;
+    uint64_t ticks;
+    long long now;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, &old);
+    if (read(dl_fd, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN)
+        unix_error("timerfd read");
+
+    now = now_ns();
+    while (dl_n > 0 && jobs[dl_heap[0]].deadline <= now) {
+        job = &jobs[dl_heap[0]];
+        if (job->timedout == 0) {
+            job_signal(job, job->tsig);
+            if (job->state == ST)
+                job_signal(job, SIGCONT);
+            job->timedout = 1;
+            if (job->grace > 0) {
+                job->deadline = now + job->grace;
+                dl_down(0);
+                continue;
+            }
+        }
+        else {
+            job_signal(job, SIGKILL);
+            job->timedout = 2;
+        }
+        dl_remove(job);
+    }
+    dl_arm();
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/* a child starts with no deadlines of its own */
+static void dl_close(void) {
+    if (dl_fd >= 0)
+        close(dl_fd);
+    dl_fd = -1;
+    dl_n = 0;
+}
+
+/*
+ * wait_input - block until fd has input, expiring deadlines, draining
+ *     captured output and starting nodes of the job graph meanwhile.
+ *     Without any of those or other sessions to run (or for a regular
+ *     file) return at once and let the caller block in read().
+ */
+void wait_input(int fd) {
+    struct ev evs[8];
+    sigset_t set, old, mask;
+    int i, nev, ready = 0;
+
+    if ((dl_n == 0 && ev_yield == NULL && cap_live == 0 && graph.nwait == 0) ||
+            ev_add(fd, EV_INPUT, fd) < 0)
+        return;
+    /* SIGCHLD only while asleep, so that graph.dirty is never missed */
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, &old);
+    mask = old;
+    sigdelset(&mask, SIGCHLD);
+    while (!ready) {
+        if (graph.dirty)
+            after_run();
+        nev = ev_wait(evs, 8, -1, &mask);
+        for (i = 0; i < nev; i++) {
+            if (evs[i].kind == EV_TIMER)
+                dl_expire();
+            else if (evs[i].kind == EV_CAPTURE)
+                cap_event(evs[i].id);
+            else if (evs[i].kind == EV_INPUT)
+                ready = 1;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    ev_del(fd);
+}
+
+/*
+ * waitfg - Block until process pid is no longer the foreground process
+ */
+static void waitfg(pid_t pid) {
+    struct job_t *job = getjobpid(jobs, pid);
+
+    if (job != NULL)
+        wait_jobs(&job, &pid, 1, 0, 1);
+}
+
+static void clearjob(struct job_t *job) {
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    job->nprocs = 0;
+    job->nlive = 0;
+    job->status = 0;
+    job->deadline = 0;
+    job->timedout = 0;
+    job->heappos = -1;
+    job->start = 0;
+    job->cpu = 0;
+    job->cap = NULL;
+    job->cmdline[0] = '\0';
+}
+
+static void closefds(struct job_t *job) {
+    int k;
+
+    for (k = 0; k < job->nprocs; k++)
+        if (job->pids[k] != 0 && job->pidfds[k] >= 0)
+            close(job->pidfds[k]);
+}
+
+static void initjobs(struct job_t *jobs) {
+    int i;
+
+    for (i = 0; i < jobs_top; i++) {
+        closefds(&jobs[i]);
+        cap_free(jobs[i].cap);
+        clearjob(&jobs[i]);
+    }
+    jobs_top = 0;
+}
+
+static int maxjid(struct job_t *jobs) {
+    int i, max=0;
+
+    for (i = 0; i < jobs_top; i++)
+        if (jobs[i].jid > max)
+            max = jobs[i].jid;
+    return max;
+}
+
+/* pids[0] leads the job's process group */
+static int addjob(struct job_t *jobs, pid_t *pids, int *pidfds, int nprocs, int state, char *cmdline) {
+    int i;
+
+    if (pids[0] < 1)
         return 0;
 
     for (i = 0; i < MAXJOBS; i++) {
         if (jobs[i].pid == 0) {
-            jobs[i].pid = pid;
+            jobs[i].pid = pids[0];
+            memcpy(jobs[i].pids, pids, nprocs * sizeof(pid_t));
+            memcpy(jobs[i].pidfds, pidfds, nprocs * sizeof(int));
+            jobs[i].nprocs = nprocs;
+            jobs[i].nlive = nprocs;
+            jobs[i].status = 0;
+            jobs[i].deadline = 0;
+            jobs[i].timedout = 0;
+            jobs[i].heappos = -1;
+            jobs[i].start = realtime_ns();
+            jobs[i].cpu = 0;
+            jobs[i].cap = NULL;
             jobs[i].state = state;
             jobs[i].jid = nextjid++;
             if (nextjid > MAXJOBS)
                 nextjid = 1;
-            strcpy(jobs[i].cmdline, cmdline);
+            snprintf(jobs[i].cmdline, MAXLINE, "%s", cmdline);
+            if (i >= jobs_top)
+                jobs_top = i + 1;
+            PROBE4(job_add, jobs[i].pid, jobs[i].jid, jobs[i].cmdline, state);
+            publish(&jobs[i]);
             if(verbose){
                 printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
             }
@@ -305,9 +1836,27 @@ static int deletejob(struct job_t *jobs, pid_t pid) {
     if (pid < 1)
         return 0;
 
-    for (i = 0; i < MAXJOBS; i++) {
+    for (i = 0; i < jobs_top; i++) {
         if (jobs[i].pid == pid) {
+            done_jobs[ndone % MAXDONE].leader = pid;
+            done_jobs[ndone % MAXDONE].last = jobs[i].pids[jobs[i].nprocs - 1];
+            done_jobs[ndone % MAXDONE].jid = jobs[i].jid;
+            done_jobs[ndone % MAXDONE].status = job_exit_status(&jobs[i]);
+            /* the buffer goes now; what it spilled, with the record */
+            cap_free(done_jobs[ndone % MAXDONE].cap);
+            if ((done_jobs[ndone % MAXDONE].cap = jobs[i].cap) != NULL)
+                cap_close(jobs[i].cap);
+            PROBE4(job_delete, pid, jobs[i].jid, jobs[i].cmdline,
+                    done_jobs[ndone % MAXDONE].status);
+            ndone++;
+            graph.dirty = 1;
+            closefds(&jobs[i]);
+            if (jobs[i].heappos >= 0)
+                dl_remove(&jobs[i]);
             clearjob(&jobs[i]);
+            while (jobs_top > 0 && jobs[jobs_top - 1].pid == 0)
+                jobs_top--;
+            publish(&jobs[i]);
             nextjid = maxjid(jobs)+1;
             return 1;
         }
@@ -318,7 +1867,7 @@ static int deletejob(struct job_t *jobs, pid_t pid) {
 static pid_t fgpid(struct job_t *jobs) {
     int i;
 
-    for (i = 0; i < MAXJOBS; i++)
+    for (i = 0; i < jobs_top; i++)
         if (jobs[i].state == FG)
             return jobs[i].pid;
     return 0;
@@ -329,18 +1878,33 @@ static struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
 
     if (pid < 1)
         return NULL;
-    for (i = 0; i < MAXJOBS; i++)
+    for (i = 0; i < jobs_top; i++)
         if (jobs[i].pid == pid)
             return &jobs[i];
     return NULL;
 }
 
+/* find the job that pid is a pipeline stage of */
+static struct job_t *getjobproc(struct job_t *jobs, pid_t pid, int *stage) {
+    int i, k;
+
+    if (pid < 1)
+        return NULL;
+    for (i = 0; i < jobs_top; i++)
+        for (k = 0; k < jobs[i].nprocs; k++)
+            if (jobs[i].pids[k] == pid) {
+                *stage = k;
+                return &jobs[i];
+            }
+    return NULL;
+}
+
 static struct job_t *getjobjid(struct job_t *jobs, int jid) {
     int i;
 
     if (jid < 1)
         return NULL;
-    for (i = 0; i < MAXJOBS; i++)
+    for (i = 0; i < jobs_top; i++)
         if (jobs[i].jid == jid)
             return &jobs[i];
     return NULL;
@@ -351,17 +1915,18 @@ static int pid2jid(pid_t pid) {
 
     if (pid < 1)
         return 0;
-    for (i = 0; i < MAXJOBS; i++)
+    for (i = 0; i < jobs_top; i++)
         if (jobs[i].pid == pid) {
             return jobs[i].jid;
         }
     return 0;
 }
 
-static void listjobs(struct job_t *jobs) {
+static void listjobs(struct job_t *jobs, int placement) {
+    char place[512];
     int i;
 
-    for (i = 0; i < MAXJOBS; i++) {
+    for (i = 0; i < jobs_top; i++) {
         if (jobs[i].pid != 0) {
             printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
             switch (jobs[i].state) {
@@ -378,6 +1943,10 @@ static void listjobs(struct job_t *jobs) {
                     printf("listjobs: Internal error: job[%d].state=%d ",
                             i, jobs[i].state);
             }
+            if (placement) {
+                place_show(jobs[i].pid, place, sizeof(place));
+                printf("%s ", place);
+            }
             printf("%s", jobs[i].cmdline);
         }
     }
@@ -386,7 +1955,11 @@ static void listjobs(struct job_t *jobs) {
 /*
  * unix_error - unix-style error routine
  */
-static void unix_error(char *msg) {
+void unix_error(char *msg) {
+    if (eval_jmp != NULL) {
+        snprintf(eval_err, sizeof(eval_err), "%s: %s", msg, strerror(errno));
+        siglongjmp(*eval_jmp, 1);
+    }
     fprintf(stdout, "%s: %s\n", msg, strerror(errno));
     exit(1);
 }
@@ -401,31 +1974,94 @@ static void unix_error(char *msg) {
 static void sigchld_handler(int sig) {
     pid_t pid;
     int   status;
+    int   stage;
     struct job_t *job;
+    struct rusage ru;
 
     /* more than one children can be defunct / stopped */
-    while ((pid = waitpid(-1, &status, WNOHANG|WUNTRACED)) > 0) {
-        job = getjobpid(jobs, pid);
+    while ((pid = wait4(-1, &status, WNOHANG|WUNTRACED, &ru)) > 0)
+        if ((job = getjobproc(jobs, pid, &stage)) != NULL)
+            reap_proc(job, stage, status, &ru);
+
+    /* exited while loop by error */
+    if (pid == -1 && errno != ECHILD)
+        unix_error("waitpid");
+}
+
+/* note - queue a job message; see notes */
+static void note(const char *fmt, ...) {
+    va_list ap;
+    int n;
 
-        /* job stopped or terminated */
-        if (WIFSTOPPED(status)) {
-            /* stopped - message it and change status to ST */
-            printf("Job [%d] (%d) stopped by signal 20\n", job->jid, job->pid);
+    va_start(ap, fmt);
+    n = vsnprintf(notes + nnotes, sizeof(notes) - nnotes, fmt, ap);
+    va_end(ap);
+    if (n > 0 && (size_t)n < sizeof(notes) - nnotes)
+        nnotes += n;
+}
+
+/* flush_notes - print queued job messages; SIGCHLD must be blocked */
+static void flush_notes(void) {
+    if (nnotes > 0) {
+        fwrite(notes, 1, nnotes, stdout);
+        nnotes = 0;
+    }
+}
+
+/*
+ * reap_proc - account for wait status of pipeline stage `stage` of job,
+ *     whether it came from the SIGCHLD handler or from a pidfd waiter.
+ */
+static void reap_proc(struct job_t *job, int stage, int status,
+        const struct rusage *ru) {
+    /* job stopped or terminated */
+    if (WIFSTOPPED(status)) {
+        /* stopped - message it once and change status to ST */
+        if (job->state != ST) {
+            note("Job [%d] (%d) stopped by signal %d\n",
+                    job->jid, job->pid, WSTOPSIG(status));
+            if (job->state == FG)
+                last_status = 128 + WSTOPSIG(status);
             job->state = ST;
+            PROBE4(job_state, job->pid, job->jid, job->cmdline, ST);
+            publish(job);
         }
-        else {
-            /* message if it was terminated by signal */
-            if (WIFSIGNALED(status))
-                printf("Job [%d] (%d) terminated by signal 2\n", job->jid, job->pid);
+        return;
+    }
 
-            /* terminated - delete from job list */
-            deletejob(jobs, pid);
+    job->cpu += (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000000LL +
+        (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1000LL;
+    job->pids[stage] = 0;
+    if (job->pidfds[stage] >= 0)
+        close(job->pidfds[stage]);
+    job->nlive--;
+    /* the last stage decides the status of a pipeline */
+    if (stage == job->nprocs - 1) {
+        job->status = status;
+        /* message if it was terminated by signal */
+        if (WIFSIGNALED(status)) {
+            note("Job [%d] (%d) terminated by signal %d\n",
+                    job->jid, job->pid, WTERMSIG(status));
+            if (job->state == FG && WTERMSIG(status) == SIGINT &&
+                    !job->timedout)
+                intr = 1;   /* ctrl-c, not a timeout -s INT */
         }
     }
 
-    /* exited while loop by error */
-    if (pid == -1 && errno != ECHILD)
-        unix_error("waitpid");
+    /* terminated - delete from job list */
+    if (job->nlive == 0) {
+        if (job->state == FG)
+            last_status = job_exit_status(job);
+        deletejob(jobs, job->pid);
+    }
+    else
+        publish(job);
+}
+
+/* publish - copy job's slot to the status page (tsh -s); not in sessions */
+static void publish(struct job_t *job) {
+    if (session == NULL)
+        jobpage_put(job - jobs, job, jobs_top);
 }
 
 /*
@@ -437,10 +2073,12 @@ static void sigint_handler(int sig) {
     pid_t pid;
 
     pid = fgpid(jobs);
-    if (pid == 0)
+    if (pid == 0) {
+        intr = 1;   /* stop a loop made only of builtins */
         return;
+    }
 
-    if (kill(-pid, SIGINT) == -1)
+    if (job_signal(getjobpid(jobs, pid), SIGINT) == -1)
         unix_error("kill");
 }
 
@@ -456,7 +2094,7 @@ static void sigtstp_handler(int sig) {
     if (pid == 0)
         return;
 
-    if (kill(-pid, SIGTSTP) == -1)
+    if (job_signal(getjobpid(jobs, pid), SIGTSTP) == -1)
         unix_error("kill");
 }
 
@@ -493,110 +2131,1344 @@ void init() {
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler);
 
+    /* one pidfd per live child: let us hold as many as allowed */
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0) {
+        struct rlimit rl = nofile;
+
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
     initjobs(jobs);
+    shell_pid = getpid();
+    pathidx_open();
+}
+
+static void func_release(struct func *f) {
+    if (--f->refs == 0) {
+        arena_free(&f->arena);
+        free(f);
+    }
+}
+
+static void func_define(const char *name, struct node *body) {
+    struct htab_ent *e;
+    struct func *f;
+
+    if ((f = malloc(sizeof(*f))) == NULL)
+        app_error("out of memory");
+    arena_init(&f->arena);
+    f->body = tree_copy(&f->arena, body);
+    f->refs = 1;
+
+    e = htab_insert(&funcs, name);
+    if (e->val != NULL)
+        func_release(e->val);
+    e->val = f;
+}
+
+int func_remove(const char *name) {
+    struct func *f = htab_remove(&funcs, name);
+
+    if (f == NULL)
+        return -1;
+    func_release(f);
+    return 0;
+}
+
+static struct func *getfunc(const char *name) {
+    struct htab_ent *e = htab_find(&funcs, name);
+
+    return (e != NULL) ? e->val : NULL;
 }
 
 /*
- * eval - Evaluate the command line that the user has just typed in
- *
- * If the user has requested a built-in command (quit, jobs, bg or fg)
- * then execute it immediately. Otherwise, fork a child process and
- * run the job in the context of the child. If the job is running in
- * the foreground, wait for it to terminate and then return.  Note:
- * each child process must have a unique process group ID so that our
- * background children don't receive SIGINT (SIGTSTP) from the kernel
- * when we type ctrl-c (ctrl-z) at the keyboard.
+ * call_func - run function f with argv as its positional parameters.
+ *     argv is borrowed, not copied: it stays valid in the scratch arena
+ *     for the duration of the call.
  */
-void eval(char *cmdline) {
-    char *argv/*[MAXPIPES]*/[MAXARGS];
-    int  bg;
-    pid_t pid;
-    pid_t fg_pid;           /* pid of foreground job (if any) */
+static int call_func(struct func *f, int argc, char **argv) {
+    int save_argc = pos_argc;
+    char **save_argv = pos_argv;
+    int save_loopdepth = loopdepth;
+    int status;
+
+    if (funcdepth >= MAXFUNCDEPTH) {
+        fprintf(stderr, "%s: maximum function nesting level exceeded\n", argv[0]);
+        return 1;
+    }
+    f->refs++;      /* survive being redefined by its own body */
+    funcdepth++;
+    pos_argc = argc;
+    pos_argv = argv;
+    loopdepth = 0;
+
+    status = exec_node(f->body);
+    if (returning) {
+        returning = 0;
+        status = last_status;
+    }
+
+    loopdepth = save_loopdepth;
+    pos_argc = save_argc;
+    pos_argv = save_argv;
+    funcdepth--;
+    func_release(f);
+    return status;
+}
+
+/*
+ * redirect - apply the redirections in list r.  If save is not NULL the
+ *     descriptors being replaced are stashed there so that
+ *     undo_redirect() can put them back; that is how builtins and
+ *     compound commands are redirected without forking.  Return 0 on
+ *     success, -1 after reporting an error.
+ */
+static int redirect(struct redir *r, struct saved_fd *save, int *nsaved) {
+    char *target;
+    char *end;
+    int flags;
+    int fd;
+
+    for (; r != NULL; r = r->next) {
+        target = expand_str(r->target, 0);
+        if (save != NULL) {
+            save[*nsaved].fd = r->fd;
+            save[*nsaved].copy = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);
+            (*nsaved)++;
+        }
+
+        if (r->type == R_DUPIN || r->type == R_DUPOUT) {
+            if (strcmp(target, "-") == 0) {
+                close(r->fd);
+                continue;
+            }
+            fd = strtol(target, &end, 10);
+            if (*target == '\0' || *end != '\0' || dup2(fd, r->fd) == -1) {
+                fprintf(stderr, "%s: bad file descriptor\n", target);
+                return -1;
+            }
+            continue;
+        }
+
+        if (r->type == R_IN)
+            flags = O_RDONLY;
+        else if (r->type == R_OUT)
+            flags = O_WRONLY|O_CREAT|O_TRUNC;
+        else
+            flags = O_WRONLY|O_CREAT|O_APPEND;
+        if ((fd = open(target, flags, 0666)) == -1) {
+            fprintf(stderr, "%s: %s\n", target, strerror(errno));
+            return -1;
+        }
+        if (fd != r->fd) {
+            dup2(fd, r->fd);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+static void undo_redirect(struct saved_fd *save, int nsaved) {
+    while (--nsaved >= 0) {
+        if (save[nsaved].copy >= 0) {
+            dup2(save[nsaved].copy, save[nsaved].fd);
+            close(save[nsaved].copy);
+        }
+        else
+            close(save[nsaved].fd);
+    }
+}
+
+static struct saved_fd *alloc_saved(struct redir *r) {
+    int n = 0;
+
+    for (; r != NULL; r = r->next)
+        n++;
+    return arena_alloc(&scratch, n * sizeof(struct saved_fd));
+}
+
+/*
+ * redir_push - apply r in the shell itself, keeping what it replaces
+ *     on the redirection stack.  Undo with redir_pop, even on failure.
+ */
+static int redir_push(struct redir *r) {
+    struct redir_frame *f = arena_alloc(&scratch, sizeof(*f));
+
+    f->save = alloc_saved(r);
+    f->nsaved = 0;
+    f->prev = redir_stack;
+    redir_stack = f;
+    fflush(stdout);
+    return redirect(r, f->save, &f->nsaved);
+}
+
+/* redir_pop - undo the innermost redirections */
+static void redir_pop(void) {
+    struct redir_frame *f = redir_stack;
+
+    fflush(stdout);
+    undo_redirect(f->save, f->nsaved);
+    redir_stack = f->prev;
+}
+
+/* scratch_argv - sv's vector moved to the scratch arena, which a jump frees */
+static char **scratch_argv(struct strvec *sv) {
+    char **v = arena_alloc(&scratch, (sv->n + 1) * sizeof(*v));
+
+    if (sv->n > 0)
+        memcpy(v, sv->v, sv->n * sizeof(*v));
+    v[sv->n] = NULL;
+    free(sv->v);
+    sv->v = NULL;
+    return v;
+}
+
+/*
+ * child_exit - leave a forked child that did not exec.  _exit() skips
+ *     the stdio cleanup that would otherwise rewind the stdin offset
+ *     shared with the shell.
+ */
+static void child_exit(int status) {
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+}
+
+/*
+ * exec_external - replace the current process with program argv[0],
+ *     looked up in the current directory and then along PATH.  Where
+ *     that finds the system's grep, wc, head or tail, a filter may run
+ *     here instead (filter.c).
+ */
+static void exec_external(int argc, char **argv) {
+    char path[MAXLINE];
+    char dirbuf[MAX_VAR_LEN];
+    char *dir;
+    int status;
+
+    if (strchr(argv[0], '/') != NULL)
+        execv(argv[0], argv);
+    else {
+        /* execute requested program (new process) */
+        if (access(argv[0], F_OK) == 0) {
+            if ((status = filter_run(argv[0], argc, argv)) >= 0)
+                child_exit(status);
+            execv(argv[0], argv);
+        }
+        if ((dir = search_env_variable("PATH", argv[0], dirbuf)) != NULL) {
+            snprintf(path, sizeof(path), "%s/%s", dir, argv[0]);
+            if ((status = filter_run(path, argc, argv)) >= 0)
+                child_exit(status);
+            execv(path, argv);
+        }
+        else
+            errno = ENOENT;
+    }
+
+    /* flow reaches here when execv fails */
+    PROBE4(exec_fail, getpid(), 0, argv[0], errno);
+    if (errno == ENOENT) {
+        fprintf(stderr, "%s: Command not found\n", argv[0]);
+        child_exit(127);
+    }
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+    child_exit(126);
+}
+
+/*
+ * child_run - body of a forked pipeline stage; never returns.  argv is
+ *     the already-expanded command line of a simple command, or NULL.
+ */
+static void child_run(struct node *n, char **argv) {
+    struct strvec sv = { 0 };
+    struct func *f;
+    builtin_fn *fn;
+    char *s, *eq;
+    int i, argc;
+
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGTSTP, SIG_DFL);
+    Signal(SIGQUIT, SIG_DFL);
+    if (nofile.rlim_cur != 0)
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    ev_close();
+    ev_yield = NULL;
+    dl_close();
+
+    if (n->type != N_CMD) {
+        /* a subshell: its jobs stay in our process group */
+        subshell = 1;
+        initjobs(jobs);
+        child_exit(exec_tree(n));
+    }
+
+    if (argv == NULL) {
+        for (i = 0; i < n->u.cmd.argc; i++)
+            expand_word(n->u.cmd.argv[i], X_SPLIT | X_GLOB, &sv);
+        argv = sv.v;
+    }
+    for (i = 0; i < n->u.cmd.nassign; i++) {
+        s = expand_str(n->u.cmd.assign[i], 0);
+        eq = strchr(s, '=');
+        *eq = '\0';
+        env_set(s, eq + 1);
+    }
+    if (redirect(n->redirs, NULL, NULL) < 0)
+        child_exit(1);
+    if (argv == NULL || argv[0] == NULL)
+        child_exit(0);
+
+    for (argc = 0; argv[argc] != NULL; argc++)
+        ;
+    if ((f = getfunc(argv[0])) != NULL) {
+        subshell = 1;
+        initjobs(jobs);
+        child_exit(call_func(f, argc, argv));
+    }
+    if ((fn = getbuiltin(argv[0])) != NULL)
+        child_exit(fn(argc, argv));
+    exec_external(argc, argv);
+}
+
+/*
+ * launch - fork one process per pipeline stage and register them as a
+ *     single job.  Each job gets its own process group (unless we are
+ *     a subshell) so that background children don't receive SIGINT
+ *     (SIGTSTP) from the kernel when we type ctrl-c (ctrl-z).  Wait for
+ *     a foreground job and return its status.
+ */
+static int launch(struct node **cmds, int n, int bg, const char *text,
+        char **argv, const struct jobopts *o) {
+    return launch_fan(cmds, n, NULL, 0, bg, text, argv, o);
+}
+
+/* launch_pipe - run pipeline or fan-out n as a job */
+static int launch_pipe(struct node *n, int bg) {
+    return launch_fan(n->u.pipe.cmds, n->u.pipe.n, n->u.pipe.fan,
+            n->u.pipe.nfan, bg, n->text, NULL, NULL);
+}
+
+/*
+ * launch_fan - launch, where stages fan[0..nfan) each start a consumer
+ *     of a fan-out: the stages before fan[0] are the producer, and one
+ *     more process of the job copies its output to every consumer
+ *     (fanout.c).  The job's status is that of the last stage.
+ */
+static int launch_fan(struct node **cmds, int n, const int *fan, int nfan,
+        int bg, const char *text, char **argv, const struct jobopts *o) {
+    pid_t pids[MAXPIPES];
+    int pidfds[MAXPIPES];
+    int qin[MAXPIPES], qout[MAXPIPES];     /* fan-out pipes, per consumer */
+    struct job_t *job;
+    pid_t pid, leader = 0;
+    int pd[2], infd = -1, outfd, capw = -1;
+    struct capture *cap = NULL;
+    char cmdline[MAXLINE];
     sigset_t set;
-    char cwd[128];
-    char* dir;
-    int dir_size;
-    // int is_pipe;
-    // is_pipe = ((strchr(cmdline, '|')) != NULL);
-    bg = parseline(cmdline, argv/*, is_pipe*/);
-
-    if (argv[0] == NULL)
-        return;
+    int i, j, k = -1, np = 0;
 
-    /* when input is NOT a built-in command... */
-    if (builtin_cmd(argv) == 0) {
-        /* ignore SIGCHLD from child process that is not a 'job' */
-        if (sigemptyset(&set) == -1)
-            unix_error("sigemptyset");
-        if (sigaddset(&set, SIGCHLD) == -1)
-            unix_error("sigaddset");
-        if (sigprocmask(SIG_BLOCK, &set, NULL) == -1)
-            unix_error("sigprocmask");
+    if (n + (nfan > 0) > MAXPIPES) {
+        fprintf(stderr, "tsh: too many pipeline stages\n");
+        return 1;
+    }
+    /* captured: the job's stdout and every stderr go to one pipe */
+    if (o != NULL && o->capture && (cap = cap_open(&capw)) == NULL) {
+        perror("tsh: capture");
+        return 1;
+    }
 
+    /* keep SIGCHLD out until the job is in the job list */
+    if (sigemptyset(&set) == -1)
+        unix_error("sigemptyset");
+    if (sigaddset(&set, SIGCHLD) == -1)
+        unix_error("sigaddset");
+    if (sigprocmask(SIG_BLOCK, &set, NULL) == -1)
+        unix_error("sigprocmask");
+
+    fflush(stdout);
+    pathidx_open();     /* a child may have rebuilt it */
+    for (i = 0; i <= n; i++) {
+        /* between the producer and the first consumer: the fan-out */
+        if (k + 1 < nfan && i == fan[k + 1]) {
+            k++;
+            if (k == 0) {
+                for (j = 0; j < nfan; j++) {
+                    if (pipe2(pd, O_CLOEXEC) == -1)
+                        unix_error("pipe");
+                    qin[j] = pd[0];
+                    qout[j] = pd[1];
+                }
+                PROBE4(fork_start, shell_pid, 0, text, np);
+                if ((pid = fork()) == -1)
+                    unix_error("fork");
+                if (pid == 0) {
+                    eval_jmp = NULL;
+                    sigprocmask(SIG_UNBLOCK, &set, NULL);
+                    if (!subshell && setpgid(0, leader) == -1)
+                        unix_error("setpgid");
+                    /* the copier is part of the job: placed like its stages */
+                    if (o != NULL && o->place.set != 0 && place_self(&o->place) < 0)
+                        child_exit(125);
+                    if (capw >= 0) {
+                        dup2(capw, 2);
+                        cap_child(cap, capw);
+                    }
+                    for (j = 0; j < nfan; j++)
+                        close(qin[j]);
+                    child_exit(fanout(infd, qout, nfan));
+                }
+                PROBE4(fork_done, pid, 0, text, np);
+                if (!subshell)
+                    setpgid(pid, leader);
+                pids[np] = pid;
+                pidfds[np++] = pidfd_open_(pid);
+                close(infd);
+                for (j = 0; j < nfan; j++)
+                    close(qout[j]);
+            }
+            infd = qin[k];
+        }
+        if (i == n)
+            break;
+
+        /* stdout: the next stage, unless the next consumer starts there */
+        outfd = -1;
+        if (i < n - 1 && !(k + 1 < nfan && k >= 0 && i + 1 == fan[k + 1])) {
+            if (pipe(pd) == -1)
+                unix_error("pipe");
+            outfd = pd[1];
+        }
+
+        PROBE4(fork_start, shell_pid, 0, text, np);
         switch (pid = fork()) {
             case -1:
                 unix_error("fork");
             case 0:
+                eval_jmp = NULL;
                 /* unblock */
                 if (sigprocmask(SIG_UNBLOCK, &set, NULL) == -1)
                     unix_error("sigprocmask");
 
                 /* assign new process group */
-                if (setpgid(0, 0) == -1)
+                if (!subshell && setpgid(0, leader) == -1)
                     unix_error("setpgid");
-
-                #if 1
-                /* execute requested program (new process) */
-                if((getcwd(cwd, sizeof(cwd))) == NULL)
-                    fprintf(stdout, "Can't open current directory.\n");
-                if(search_dir(cwd, argv[0]) > 0) {
-                    execv(argv[0], argv);
-                } else {
-                    if((dir = search_env_variable("PATH", argv[0])) != NULL) {
-                        dir_size = strlen(dir);
-                        dir[dir_size] = '/';
-                        dir[dir_size+1] = '\0'; /* must be null-terminated */
-                        strcat(dir, argv[0]);
-                        execv(dir, argv);
-                    }
+                if (o != NULL && o->place.set != 0 && place_self(&o->place) < 0)
+                    child_exit(125);
+                if (capw >= 0) {
+                    if (outfd < 0)
+                        dup2(capw, 1);
+                    dup2(capw, 2);
+                    /* a stage that does not exec would hold them open */
+                    cap_child(cap, capw);
                 }
-                #endif
-                // execlp(argv[0], argv, NULL); /* Could search PATH automatically */
 
-                /* flow reaches here when execv fails */
-                if (errno == ENOENT) {
-                    fprintf(stderr, "%s: Command not found\n", argv[0]);
-                    exit(EXIT_FAILURE);
+                /* later consumers' pipes: holding them would hide EOF */
+                for (j = k + 1; k >= 0 && j < nfan; j++)
+                    close(qin[j]);
+                if (infd >= 0) {
+                    dup2(infd, 0);
+                    close(infd);
                 }
-                else {
-                    unix_error("execv");
+                if (outfd >= 0) {
+                    close(pd[0]);
+                    dup2(outfd, 1);
+                    close(outfd);
                 }
+                child_run(cmds[i], (n == 1) ? argv : NULL);
+        }
+
+        PROBE4(fork_done, pid, 0, text, np);
+        /* also set it here: whoever runs first wins the race */
+        if (!subshell)
+            setpgid(pid, leader ? leader : pid);
+        if (leader == 0)
+            leader = pid;
+        pids[np] = pid;
+        pidfds[np++] = pidfd_open_(pid);   /* not reaped yet: SIGCHLD is blocked */
+        if (infd >= 0)
+            close(infd);
+        infd = -1;
+        if (outfd >= 0) {
+            close(outfd);
+            infd = pd[0];
         }
+    }
 
-        addjob(jobs, pid, (bg ? BG : FG), cmdline);
+    snprintf(cmdline, sizeof(cmdline), "%s%s\n", text, bg ? " &" : "");
+    addjob(jobs, pids, pidfds, np, (bg ? BG : FG), cmdline);
+    if (o != NULL && o->timeout > 0 && (job = getjobpid(jobs, leader)) != NULL) {
+        job->deadline = now_ns() + o->timeout;
+        job->grace = o->grace;
+        job->tsig = o->tsig;
+        dl_insert(job);
+    }
+    if (cap != NULL) {
+        close(capw);
+        if ((job = getjobpid(jobs, leader)) != NULL) {
+            job->cap = cap;
+            ev_add(cap->fd, EV_CAPTURE, job - jobs);
+        }
+        else
+            cap_free(cap);
+    }
 
-        /* unblock */
-        if (sigprocmask(SIG_UNBLOCK, &set, NULL) == -1)
-            unix_error("sigprocmask");
+    /* unblock */
+    if (sigprocmask(SIG_UNBLOCK, &set, NULL) == -1)
+        unix_error("sigprocmask");
 
-        /* message that background process has started */
-        if (bg)
-            printf("[%d] (%d) %s", pid2jid(pid), pid, cmdline);
+    /* message that background process has started */
+    if (bg) {
+        last_bgpid = pids[np - 1];
+        if (o == NULL || !o->quiet)
+            printf("[%d] (%d) %s", pid2jid(leader), leader, cmdline);
+        return 0;
     }
 
-    /* wait for a foreground job gets done or suspended (if any) */
-    if ((fg_pid = fgpid(jobs)))
-        waitfg(fg_pid);
+    /* wait for a foreground job gets done or suspended */
+    waitfg(leader);
+    return last_status;
+}
+
+/*
+ * Command substitution.  Output is collected in a buffer that doubles
+ * when it fills up; each read() goes straight into its free space.
+ */
+struct capbuf {
+    char *buf;
+    size_t len, cap;
+};
+
+static void capbuf_reserve(struct capbuf *cb, size_t n) {
+    if (cb->len + n <= cb->cap)
+        return;
+    while (cb->len + n > cb->cap)
+        cb->cap = cb->cap ? cb->cap * 2 : 4096;
+    if ((cb->buf = realloc(cb->buf, cb->cap)) == NULL)
+        app_error("out of memory");
+}
+
+static ssize_t capbuf_write(void *cookie, const char *s, size_t n) {
+    struct capbuf *cb = cookie;
+
+    capbuf_reserve(cb, n);
+    memcpy(cb->buf + cb->len, s, n);
+    cb->len += n;
+    return n;
+}
+
+/* run a pure builtin in-process with stdout writing into cb */
+static int capture_builtin(builtin_fn *fn, char **argv, struct capbuf *cb) {
+    cookie_io_functions_t io = { NULL, capbuf_write, NULL, NULL };
+    FILE *saved = stdout;
+    int argc, status;
+
+    for (argc = 0; argv[argc] != NULL; argc++)
+        ;
+    fflush(stdout);
+    if ((stdout = fopencookie(cb, "w", io)) == NULL)
+        unix_error("fopencookie");
+    setvbuf(stdout, NULL, _IONBF, 0);
+    status = fn(argc, argv);
+    fclose(stdout);
+    stdout = saved;
+    return status;
+}
+
+/* run n in a child whose stdout is a pipe we drain into cb */
+static int capture_child(struct node *n, char **argv, struct capbuf *cb) {
+    sigset_t set, old;
+    int pd[2], status;
+    ssize_t r;
+    pid_t pid;
+
+    /* we reap this child ourselves, not the SIGCHLD handler */
+    if (sigemptyset(&set) == -1)
+        unix_error("sigemptyset");
+    if (sigaddset(&set, SIGCHLD) == -1)
+        unix_error("sigaddset");
+    if (sigprocmask(SIG_BLOCK, &set, &old) == -1)
+        unix_error("sigprocmask");
+
+    fflush(stdout);
+    if (pipe(pd) < 0)
+        unix_error("pipe error");
+    if ((pid = fork()) < 0)
+        unix_error("fork error");
+    if (pid == 0) {
+        eval_jmp = NULL;
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        close(pd[0]);
+        if (pd[1] != STDOUT_FILENO) {
+            dup2(pd[1], STDOUT_FILENO);
+            close(pd[1]);
+        }
+        child_run(n, argv);
+    }
+
+    close(pd[1]);
+    for (;;) {
+        capbuf_reserve(cb, 1);
+        wait_input(pd[0]);
+        r = read(pd[0], cb->buf + cb->len, cb->cap - cb->len);
+        if (r > 0)
+            cb->len += r;
+        else if (r == 0 || errno != EINTR)
+            break;
+    }
+    close(pd[0]);
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            unix_error("waitpid error");
+    if (sigprocmask(SIG_SETMASK, &old, NULL) == -1)
+        unix_error("sigprocmask");
+
+    if (WIFSIGNALED(status)) {
+        if (WTERMSIG(status) == SIGINT)
+            intr = 1;
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+/*
+ * cmd_subst - run n and return its output, minus trailing newlines,
+ *     in a malloc'd string.  A simple command naming a pure builtin
+ *     runs in-process: no fork and no pipe.
+ */
+char *cmd_subst(struct node *n) {
+    struct capbuf cb = { NULL, 0, 0 };
+    struct strvec sv = { 0 };
+    const struct builtin *b = NULL;
+    int i;
+
+    if (n == NULL)
+        last_status = 0;
+    else if (n->type == N_CMD && !n->bg && n->redirs == NULL &&
+            n->u.cmd.nassign == 0) {
+        for (i = 0; i < n->u.cmd.argc; i++)
+            expand_word(n->u.cmd.argv[i], X_SPLIT | X_GLOB, &sv);
+        if (sv.n > 0 && getfunc(sv.v[0]) == NULL)
+            b = findbuiltin(sv.v[0]);
+        if (sv.n == 0)
+            last_status = 0;
+        else if (b != NULL && b->pure)
+            last_status = capture_builtin(b->fn, sv.v, &cb);
+        else
+            last_status = capture_child(n, sv.v, &cb);
+        free(sv.v);
+    }
+    else
+        last_status = capture_child(n, NULL, &cb);
+    subst_status = last_status;
+
+    /* strip trailing newlines in place */
+    while (cb.len > 0 && cb.buf[cb.len - 1] == '\n')
+        cb.len--;
+    capbuf_reserve(&cb, 1);
+    cb.buf[cb.len] = '\0';
+    return cb.buf;
+}
+
+/*
+ * exec_simple - run a simple command.  Builtins run in the shell
+ *     itself; everything else becomes a job.
+ */
+static int exec_simple(struct node *n) {
+    struct strvec sv = { 0 };
+    struct func *f = NULL;
+    builtin_fn *fn = NULL;
+    char *s, *eq, **argv;
+    int i, argc, status = 0;
+
+    expand_error = 0;
+    subst_status = -1;
+    for (i = 0; i < n->u.cmd.argc; i++)
+        expand_word(n->u.cmd.argv[i], X_SPLIT | X_GLOB, &sv);
+    argc = sv.n;
+    argv = scratch_argv(&sv);
+    if (expand_error)
+        return 1;
+
+    if (argc > 0 && (f = getfunc(argv[0])) == NULL)
+        fn = getbuiltin(argv[0]);
+    if (argc > 0 && f == NULL && fn == NULL)
+        return launch(&n, 1, 0, n->text, argv, NULL);
+
+    for (i = 0; i < n->u.cmd.nassign; i++) {
+        s = expand_str(n->u.cmd.assign[i], 0);
+        if (expand_error)
+            return 1;
+        eq = strchr(s, '=');
+        *eq = '\0';
+        var_set(s, eq + 1);
+    }
+
+    if (redir_push(n->redirs) < 0)
+        status = 1;
+    else if (f != NULL)
+        status = call_func(f, argc, argv);
+    else if (fn != NULL)
+        status = fn(argc, argv);
+    else if (subst_status >= 0)
+        status = subst_status;      /* x=$(cmd) */
+    redir_pop();
+    return status;
+}
+
+/* after a loop body: should the loop stop? */
+static int loop_done(void) {
+    if (breaking) {
+        breaking--;
+        return 1;
+    }
+    if (continuing)
+        return --continuing > 0;
+    return intr || returning;
+}
+
+static int exec_for(struct node *n) {
+    struct strvec sv = { 0 };
+    char **words;
+    int i, nwords, status = 0;
+
+    if (n->u.loop.nwords < 0) {
+        for (i = 1; i < pos_argc; i++)
+            strvec_push(&sv, pos_argv[i]);
+    }
+    for (i = 0; i < n->u.loop.nwords; i++)
+        expand_word(n->u.loop.words[i], X_SPLIT | X_GLOB, &sv);
+    nwords = sv.n;
+    words = scratch_argv(&sv);
+
+    loopdepth++;
+    for (i = 0; i < nwords && !intr; i++) {
+        var_set(n->u.loop.var, words[i]);
+        status = exec_node(n->u.loop.body);
+        if (loop_done())
+            break;
+    }
+    loopdepth--;
+    return status;
+}
+
+static int exec_case(struct node *n) {
+    struct case_item *ci;
+    char *subject;
+    int i, k;
+
+    subject = expand_str(n->u.cas.subject, 0);
+    for (i = 0; i < n->u.cas.nitems; i++) {
+        ci = &n->u.cas.items[i];
+        for (k = 0; k < ci->npats; k++) {
+            if (fnmatch(expand_str(ci->pats[k], X_PATTERN), subject, 0) == 0)
+                return (ci->body != NULL) ? exec_node(ci->body) : 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * exec_tree - execute tree n in the foreground and return its exit
+ *     status.  The tree is walked directly: loop bodies are never
+ *     re-parsed, and expansion results are dropped from the scratch
+ *     arena when the node is done.
+ */
+static int exec_tree(struct node *n) {
+    struct arena_mark mark = arena_mark(&scratch);
+    int redirected = 0;
+    int status = 0;
+
+    if (n->type != N_CMD && n->redirs != NULL) {
+        redirected = 1;
+        if (redir_push(n->redirs) < 0) {
+            redir_pop();
+            arena_release(&scratch, mark);
+            return last_status = 1;
+        }
+    }
+
+    switch (n->type) {
+        case N_CMD:
+            status = exec_simple(n);
+            break;
+        case N_PIPE:
+            status = launch_pipe(n, 0);
+            break;
+        case N_AND:
+            status = exec_node(n->u.bin.left);
+            if (status == 0 && !UNWINDING())
+                status = exec_node(n->u.bin.right);
+            break;
+        case N_OR:
+            status = exec_node(n->u.bin.left);
+            if (status != 0 && !UNWINDING())
+                status = exec_node(n->u.bin.right);
+            break;
+        case N_SEQ:
+            status = exec_node(n->u.bin.left);
+            if (!UNWINDING())
+                status = exec_node(n->u.bin.right);
+            break;
+        case N_NOT:
+            status = !exec_node(n->u.bin.left);
+            break;
+        case N_BRACE:
+            status = exec_node(n->u.bin.left);
+            break;
+        case N_IF:
+            if (exec_node(n->u.cond.cond) == 0) {
+                if (!UNWINDING())
+                    status = exec_node(n->u.cond.body);
+            }
+            else if (n->u.cond.orelse != NULL && !UNWINDING())
+                status = exec_node(n->u.cond.orelse);
+            break;
+        case N_WHILE:
+        case N_UNTIL:
+            loopdepth++;
+            while (!intr && !returning) {
+                if ((exec_node(n->u.cond.cond) == 0) != (n->type == N_WHILE) ||
+                        UNWINDING())
+                    break;
+                status = exec_node(n->u.cond.body);
+                if (loop_done())
+                    break;
+            }
+            loopdepth--;
+            break;
+        case N_FUNC:
+            func_define(n->u.func.name, n->u.func.body);
+            break;
+        case N_FOR:
+            status = exec_for(n);
+            break;
+        case N_CASE:
+            status = exec_case(n);
+            break;
+    }
+
+    if (redirected)
+        redir_pop();
+    arena_release(&scratch, mark);
+    return last_status = status;
+}
+
+/* prefixes that change how a job runs, handled before launch */
+static int is_prefixed(struct node *n) {
+    struct word *w;
+
+    if (n->type != N_CMD || n->u.cmd.argc == 0)
+        return 0;
+    w = n->u.cmd.argv[0];
+    return (w->flags & W_LITERAL) && getprefix(w->text) != NULL;
+}
+
+/* run n, in the background if it was terminated by '&' */
+static int exec_node(struct node *n) {
+    struct strvec sv = { 0 };
+    int i;
+
+    if (!n->bg)
+        return exec_tree(n);
+    if (n->type == N_PIPE)
+        launch_pipe(n, 1);
+    else if (is_prefixed(n)) {
+        /* the shell itself runs the prefix: no extra process */
+        for (i = 0; i < n->u.cmd.argc; i++)
+            expand_word(n->u.cmd.argv[i], X_SPLIT | X_GLOB, &sv);
+        run_prefixed(n, sv.v, 1);
+        free(sv.v);
+    }
+    else
+        launch(&n, 1, 1, n->text, NULL, NULL);
+    return last_status = 0;
+}
+
+/*
+ * eval - Evaluate the command line that the user has just typed in
+ *
+ * The line is parsed once into a tree which is then executed.  If the
+ * line ends inside a construct (an open 'if', a trailing '|', ...) it
+ * is kept and the next line is appended to it; eval_incomplete() tells
+ * the caller to prompt for more.
+ */
+void eval(char *cmdline) {
+    struct node *tree;
+    char *text = cmdline;
+    sigset_t set, old;
+    size_t len;
+
+    if (pending != NULL) {
+        len = strlen(pending);
+        if ((text = realloc(pending, len + strlen(cmdline) + 1)) == NULL)
+            app_error("out of memory");
+        strcpy(text + len, cmdline);
+        pending = NULL;
+        line_text = text;
+    }
+
+    alias_gc();
+    arena_init(&line_ast);
+    PROBE3(eval_start, shell_pid, 0, text);
+    switch (parse(&line_ast, text, &tree)) {
+        case P_INCOMPLETE:
+            pending = (text == cmdline) ? strdup(cmdline) : text;
+            line_text = NULL;
+            arena_free(&line_ast);
+            return;
+        case P_ERROR:
+            last_status = 2;
+            break;
+        case P_OK:
+            intr = 0;
+            exec_node(tree);
+            break;
+    }
+    PROBE4(eval_done, shell_pid, 0, text, last_status);
+    arena_free(&line_ast);
+    free(line_text);
+    line_text = NULL;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, &old);
+    flush_notes();
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+int eval_incomplete(void) {
+    return pending != NULL;
+}
+
+/*
+ * eval_unwind - after a jump out of eval, put back the redirections the
+ *     abandoned line had made in the shell and free what it was using.
+ */
+static void eval_unwind(void) {
+    while (redir_stack != NULL)
+        redir_pop();
+    arena_free(&line_ast);
+    arena_free(&scratch);
+    free(line_text);
+    line_text = NULL;
+}
+
+/*
+ * Sessions - the shell keeps its state in the globals above.  A
+ * session holds a second copy of all of it, and session_swap exchanges
+ * the two around each tsh_eval, so the code above never needs to know
+ * which shell it is running.  Under tsh --multi sessions also switch
+ * in the middle of a line, whenever one would sleep, so the state of
+ * a line in progress (loop depth, $1, the scratch arena...) is swapped
+ * too.  The tsh program itself never swaps.
+ */
+struct tsh_session {
+    struct job_t *jobs;
+    int jobs_top, nextjid;
+    struct done_job *done_jobs;
+    unsigned ndone;
+    int *dl_heap;
+    int dl_n, dl_fd;
+    int epfd;
+    int last_status;
+    pid_t last_bgpid;
+    struct htab vars, funcs, aliases;
+    struct alias *dead_aliases;
+    struct env env;         /* its environ, see vars.c */
+    int cwdfd;              /* working directory, -1 to share ours */
+
+    /* a line in progress */
+    sig_atomic_t intr;
+    int breaking, continuing, returning, loopdepth, funcdepth;
+    int subst_status, expand_error;
+    char *pending;
+    int pos_argc;
+    char **pos_argv;
+    struct arena scratch;
+    struct redir_frame *redir_stack;
+    struct arena line_ast;
+    char *line_text;
+    sigjmp_buf *eval_jmp;
+
+    struct job_graph graph;
+    int outfd, errfd;       /* capture files, fds 1 and 2 in tsh_eval */
+    off_t outpos, errpos;   /* read up to here */
+};
+
+#define SWAP(type, a, b) do { type t_ = (a); (a) = (b); (b) = t_; } while (0)
+
+/* chdir to directory fd, returning a descriptor for where we were */
+static int swap_cwd(int fd) {
+    int here = open(".", O_PATH|O_DIRECTORY|O_CLOEXEC);
+
+    if (here < 0 || fchdir(fd) < 0) {
+        if (here >= 0)
+            close(here);
+        return fd;
+    }
+    close(fd);
+    return here;
+}
+
+static void session_swap(struct tsh_session *s) {
+    SWAP(struct job_t *, jobs, s->jobs);
+    SWAP(int, jobs_top, s->jobs_top);
+    SWAP(int, nextjid, s->nextjid);
+    SWAP(struct done_job *, done_jobs, s->done_jobs);
+    SWAP(unsigned, ndone, s->ndone);
+    SWAP(int *, dl_heap, s->dl_heap);
+    SWAP(int, dl_n, s->dl_n);
+    SWAP(int, dl_fd, s->dl_fd);
+    SWAP(int, last_status, s->last_status);
+    SWAP(pid_t, last_bgpid, s->last_bgpid);
+    SWAP(struct htab, funcs, s->funcs);
+    env_swap(&s->env);
+    var_swap(&s->vars);
+    alias_swap(&s->aliases, &s->dead_aliases);
+    s->epfd = ev_swap(s->epfd);
+    if (s->cwdfd >= 0)
+        s->cwdfd = swap_cwd(s->cwdfd);
+
+    SWAP(sig_atomic_t, intr, s->intr);
+    SWAP(int, breaking, s->breaking);
+    SWAP(int, continuing, s->continuing);
+    SWAP(int, returning, s->returning);
+    SWAP(int, loopdepth, s->loopdepth);
+    SWAP(int, funcdepth, s->funcdepth);
+    SWAP(int, subst_status, s->subst_status);
+    SWAP(int, expand_error, s->expand_error);
+    SWAP(char *, pending, s->pending);
+    SWAP(int, pos_argc, s->pos_argc);
+    SWAP(char **, pos_argv, s->pos_argv);
+    SWAP(struct arena, scratch, s->scratch);
+    SWAP(struct redir_frame *, redir_stack, s->redir_stack);
+    SWAP(struct arena, line_ast, s->line_ast);
+    SWAP(char *, line_text, s->line_text);
+    SWAP(sigjmp_buf *, eval_jmp, s->eval_jmp);
+    SWAP(struct job_graph, graph, s->graph);
+}
+
+void session_enter(struct tsh_session *s) {
+    session_swap(s);
+    session = s;
+}
+
+void session_leave(struct tsh_session *s) {
+    session = NULL;
+    session_swap(s);
+}
+
+static void session_reap(void);
+
+/*
+ * session_run - run script text, named name, in the entered session the
+ *     way the tsh program runs its input, and return its exit status.
+ */
+int session_run(const char *name, const char *text) {
+    char *argv0[2] = { (char *)name, NULL };
+    const char *p, *next;
+    sigjmp_buf jb;
+    char *volatile line = NULL;
+
+    pos_argc = 1;
+    pos_argv = argv0;
+    if (sigsetjmp(jb, 1) == 0) {
+        eval_jmp = &jb;
+        for (p = text; *p != '\0'; p = next) {
+            next = strchr(p, '\n');
+            next = (next != NULL) ? next + 1 : p + strlen(p);
+            if ((line = strndup(p, next - p)) == NULL)
+                app_error("out of memory");
+            session_reap();
+            eval(line);
+            free(line);
+            line = NULL;
+            fflush(stdout);
+        }
+        if (pending != NULL) {
+            fprintf(stderr, "%s: syntax error: unexpected end of file\n", name);
+            last_status = 2;
+        }
+    }
+    else {
+        eval_unwind();
+        free(line);
+        if (eval_err[0] != '\0') {
+            fprintf(stderr, "%s: %s\n", name, eval_err);
+            eval_err[0] = '\0';
+            last_status = 1;
+        }
+    }
+    eval_jmp = NULL;
+    free(pending);
+    pending = NULL;
+    fflush(stdout);
+    return last_status;
+}
+
+static void session_free(struct tsh_session *s) {
+    int i;
+
+    for (i = 0; s->jobs != NULL && i < MAXJOBS; i++)
+        cap_free(s->jobs[i].cap);
+    for (i = 0; s->done_jobs != NULL && i < MAXDONE; i++)
+        cap_free(s->done_jobs[i].cap);
+    for (i = 0; i < s->graph.n; i++)
+        free(s->graph.v[i].deps);
+    free(s->graph.v);
+    free(s->jobs);
+    free(s->done_jobs);
+    free(s->dl_heap);
+    env_free(&s->env);
+    arena_free(&s->scratch);
+    arena_free(&s->line_ast);
+    free(s->line_text);
+    if (s->cwdfd >= 0)
+        close(s->cwdfd);
+    if (s->outfd >= 0)
+        close(s->outfd);
+    if (s->errfd >= 0)
+        close(s->errfd);
+    free(s);
+}
+
+/* tsh_open - a new session, with a copy of our environment; NULL on error */
+struct tsh_session *tsh_open(void) {
+    struct tsh_session *s = calloc(1, sizeof(*s));
+    int env;
+
+    if (s == NULL)
+        return NULL;
+    env = env_copy(&s->env);
+    s->jobs = calloc(MAXJOBS, sizeof(*s->jobs));
+    s->done_jobs = calloc(MAXDONE, sizeof(*s->done_jobs));
+    s->dl_heap = calloc(MAXJOBS, sizeof(*s->dl_heap));
+    s->cwdfd = open(".", O_PATH|O_DIRECTORY|O_CLOEXEC);
+    s->outfd = memfd_create("tsh-out", MFD_CLOEXEC);
+    s->errfd = memfd_create("tsh-err", MFD_CLOEXEC);
+    if (s->jobs == NULL || s->done_jobs == NULL || s->dl_heap == NULL ||
+            env < 0 || s->outfd < 0 || s->errfd < 0) {
+        session_free(s);
+        return NULL;
+    }
+    s->nextjid = 1;
+    s->dl_fd = -1;
+    s->epfd = -1;
+    s->subst_status = -1;
+    s->pos_argc = pos_argc;
+    s->pos_argv = pos_argv;
+    if (shell_pid == 0)
+        shell_pid = getpid();
+    return s;
+}
+
+/*
+ * session_reap - a session has no SIGCHLD handler: reap its children
+ *     that finished between lines, and act on deadlines that passed.
+ */
+static void session_reap(void) {
+    struct rusage ru;
+    int i, k, status;
+
+    for (i = 0; i < jobs_top; i++)
+        for (k = 0; jobs[i].pid != 0 && k < jobs[i].nprocs; k++)
+            if (jobs[i].pids[k] != 0 && wait4(jobs[i].pids[k], &status,
+                        WNOHANG|WUNTRACED, &ru) > 0)
+                reap_proc(&jobs[i], k, status, &ru);
+    if (dl_n > 0)
+        dl_expire();
+    if (graph.dirty)
+        after_run();
+}
+
+/* capture_read - what was written to fd past *pos, NUL-terminated */
+static char *capture_read(int fd, off_t *pos, size_t *len) {
+    struct stat st;
+    size_t size, got = 0;
+    ssize_t r;
+    char *buf;
+
+    size = (fstat(fd, &st) == 0 && st.st_size > *pos) ? st.st_size - *pos : 0;
+    if ((buf = malloc(size + 1)) == NULL)
+        return NULL;
+    while (got < size && (r = pread(fd, buf + got, size - got, *pos + got)) > 0)
+        got += r;
+    buf[got] = '\0';
+    *len = got;
+    *pos += got;
+    return buf;
+}
+
+/* start a capture file over; only safe once no job can write to it */
+static void capture_reset(int fd, off_t *pos) {
+    if (ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0)
+        *pos = 0;
+}
+
+/* r += a - b, for the fields a line's usage is measured in */
+static void ru_add(struct rusage *r, const struct rusage *a,
+        const struct rusage *b) {
+    struct timeval t;
+
+    timersub(&a->ru_utime, &b->ru_utime, &t);
+    timeradd(&r->ru_utime, &t, &r->ru_utime);
+    timersub(&a->ru_stime, &b->ru_stime, &t);
+    timeradd(&r->ru_stime, &t, &r->ru_stime);
+    r->ru_minflt += a->ru_minflt - b->ru_minflt;
+    r->ru_majflt += a->ru_majflt - b->ru_majflt;
+    r->ru_inblock += a->ru_inblock - b->ru_inblock;
+    r->ru_oublock += a->ru_oublock - b->ru_oublock;
+    r->ru_nvcsw += a->ru_nvcsw - b->ru_nvcsw;
+    r->ru_nivcsw += a->ru_nivcsw - b->ru_nivcsw;
+    if (a->ru_maxrss > r->ru_maxrss)
+        r->ru_maxrss = a->ru_maxrss;
+}
+
+/*
+ * tsh_eval - run line in session s.  Its output is returned in r along
+ *     with its status and resource usage; free it with tsh_result_free.
+ *     Output of background jobs is returned by the tsh_eval after they
+ *     write it.  Return 0, or -1 if the shell failed (r->errmsg says
+ *     why; the line was abandoned but the session is still usable).
+ */
+int tsh_eval(struct tsh_session *s, const char *line, struct tsh_result *r) {
+    struct rusage self0, kids0, self1, kids1;
+    FILE *out = stdout;
+    int save_argc;
+    char **save_argv;
+    sigjmp_buf jb;
+    char *text;
+    int save1 = -1, save2 = -1, how, ret = 0;
+
+    memset(r, 0, sizeof(*r));
+    if ((text = strdup(line)) == NULL) {
+        snprintf(r->errmsg, sizeof(r->errmsg), "out of memory");
+        return -1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    if ((save1 = dup(STDOUT_FILENO)) < 0 || (save2 = dup(STDERR_FILENO)) < 0 ||
+            dup2(s->outfd, STDOUT_FILENO) < 0 || dup2(s->errfd, STDERR_FILENO) < 0) {
+        snprintf(r->errmsg, sizeof(r->errmsg), "dup: %s", strerror(errno));
+        if (save1 >= 0) {
+            dup2(save1, STDOUT_FILENO);
+            close(save1);
+        }
+        if (save2 >= 0) {
+            dup2(save2, STDERR_FILENO);
+            close(save2);
+        }
+        free(text);
+        return -1;
+    }
+    getrusage(RUSAGE_SELF, &self0);
+    getrusage(RUSAGE_CHILDREN, &kids0);
+
+    session_enter(s);
+    save_argc = pos_argc;
+    save_argv = pos_argv;
+    if ((how = sigsetjmp(jb, 1)) == 0) {
+        eval_jmp = &jb;
+        session_reap();
+        eval(text);
+    }
+    else {
+        /* left in the middle of the line: undo what it had changed */
+        stdout = out;
+        eval_unwind();
+        pos_argc = save_argc;
+        pos_argv = save_argv;
+        breaking = continuing = returning = 0;
+        loopdepth = funcdepth = 0;
+        flush_notes();
+        if (how == 1) {
+            snprintf(r->errmsg, sizeof(r->errmsg), "%s", eval_err);
+            eval_err[0] = '\0';
+            ret = -1;
+        }
+        else
+            r->exited = 1;
+    }
+    eval_jmp = NULL;
+    if (pending != NULL) {
+        fprintf(stderr, "tsh: syntax error: unexpected end of input\n");
+        free(pending);
+        pending = NULL;
+        last_status = 2;
+    }
+    r->status = last_status;
+    session_leave(s);
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(save1, STDOUT_FILENO);
+    dup2(save2, STDERR_FILENO);
+    close(save1);
+    close(save2);
+    getrusage(RUSAGE_SELF, &self1);
+    getrusage(RUSAGE_CHILDREN, &kids1);
+    ru_add(&r->ru, &self1, &self0);
+    ru_add(&r->ru, &kids1, &kids0);
+
+    r->out = capture_read(s->outfd, &s->outpos, &r->outlen);
+    r->err = capture_read(s->errfd, &s->errpos, &r->errlen);
+    if (r->out == NULL || r->err == NULL) {
+        snprintf(r->errmsg, sizeof(r->errmsg), "out of memory");
+        ret = -1;
+    }
+    if (s->jobs_top == 0) {
+        capture_reset(s->outfd, &s->outpos);
+        capture_reset(s->errfd, &s->errpos);
+    }
+    free(text);
+    return ret;
+}
+
+void tsh_result_free(struct tsh_result *r) {
+    free(r->out);
+    free(r->err);
+    r->out = r->err = NULL;
+}
+
+static void func_free(void *f) {
+    func_release(f);
+}
+
+/* tsh_close - end session s, killing any jobs it still has */
+void tsh_close(struct tsh_session *s) {
+    int i, k;
+
+    if (s == NULL)
+        return;
+    session_swap(s);
+    for (i = 0; i < jobs_top; i++) {
+        if (jobs[i].pid == 0)
+            continue;
+        job_signal(&jobs[i], SIGKILL);
+        for (k = 0; k < jobs[i].nprocs; k++)
+            if (jobs[i].pids[k] != 0)
+                waitpid(jobs[i].pids[k], NULL, 0);
+    }
+    initjobs(jobs);
+    dl_close();
+    ev_close();
+    alias_clear();
+    session_swap(s);
+    htab_clear(&s->vars, free);
+    htab_clear(&s->funcs, func_free);
+    session_free(s);
 }
 
 /*
  * usage - print a help message
  */
 void usage(void) {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvps]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -s   publish the job table in shared memory (/tsh.PID)\n");
     exit(1);
 }
 
@@ -604,6 +3476,19 @@ void usage(void) {
  * app_error - application-style error routine
  */
 void app_error(char *msg) {
+    if (eval_jmp != NULL) {
+        snprintf(eval_err, sizeof(eval_err), "%s", msg);
+        siglongjmp(*eval_jmp, 1);
+    }
     fprintf(stdout, "%s\n", msg);
     exit(1);
 }
+
+/* shell_exit - the exit builtin: end tsh, or the tsh_eval running us */
+static void shell_exit(int status) {
+    if (eval_jmp != NULL) {
+        last_status = status;
+        siglongjmp(*eval_jmp, 2);
+    }
+    exit(status);
+}
@@ -1,10 +1,13 @@
 #ifndef _TINY_SHELL
 #define _TINY_SHELL
 
+#include <sys/types.h>
+#include <signal.h>
+#include "parse.h"
+
 #define MAXLINE    1024   /* max line size */
-#define MAXARGS     128   /* max args on a command line */
 #define MAXPIPES	 16	  /* max number of piping operations */
-#define MAXJOBS      16   /* max jobs at any point in time */
+#define MAXJOBS    4096   /* max jobs at any point in time */
 #define MAXJID    1<<16   /* max job ID */
 #define MAX_VAR_LEN 256
 
@@ -26,21 +29,207 @@
 
 struct job_t
 {
-    pid_t pid;
+    pid_t pid;              /* process group leader */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, BG, FG, or ST */
+    pid_t pids[MAXPIPES];   /* one process per pipeline stage, 0 once reaped */
+    int nprocs;             /* number of pipeline stages */
+    int nlive;              /* processes not reaped yet */
+    int status;             /* wait status of the last stage */
+    int pidfds[MAXPIPES];   /* pidfd of each live stage, or -1 */
+    long long deadline;     /* CLOCK_MONOTONIC ns of the next timeout action */
+    long long grace;        /* SIGKILL this long after tsig, 0 for never */
+    int tsig;               /* signal sent when the timeout expires */
+    int timedout;           /* 1 once tsig was sent, 2 once SIGKILL was */
+    int heappos;            /* index in the deadline heap, -1 if none */
+    long long start;        /* CLOCK_REALTIME ns when launched */
+    long long cpu;          /* ns of CPU used by the stages reaped */
+    struct capture *cap;    /* its output, if started with capture */
     char cmdline[MAXLINE];
 };
 
 extern char **environ;      /* defined in libc */
 
+extern int last_status;     /* $? */
+extern pid_t last_bgpid;    /* $! */
+extern pid_t shell_pid;     /* $$ */
 
 void eval(char *cmdline);
+int eval_incomplete(void);
 
 void usage(void);
 void app_error(char *msg);
+void unix_error(char *msg);
 typedef void handler_t(int);
 
 void init();
+void wait_input(int fd);
+
+/* capture.c - a job's stdout and stderr, kept for `output` */
+#define CAP_BUF   (64 * 1024)       /* drained into memory, then spilled */
+#define CAP_KEEP  (64LL << 20)      /* the most of one job's output kept */
+
+struct capture {
+    int fd;                 /* read end of the job's pipe, -1 at EOF */
+    int memfd;              /* spilled output, -1 until the first spill */
+    long long lo, hi;       /* memfd holds output bytes [lo, hi) */
+    size_t len;             /* buf holds bytes [hi, hi + len) */
+    char *buf;              /* CAP_BUF bytes, NULL once the job is gone */
+};
+
+extern int cap_live;
+struct capture *cap_open(int *wfd);
+long cap_drain(struct capture *c);
+void cap_child(struct capture *c, int wfd);
+void cap_close(struct capture *c);
+void cap_free(struct capture *c);
+long long cap_copy(const struct capture *c, long long from, int out);
+long long cap_tail(const struct capture *c, int lines);
+
+/* event.c - the epoll set the shell sleeps on */
+#define EV_PIDFD  1         /* id: job slot * MAXPIPES + stage */
+#define EV_TIMER  2         /* the deadline timerfd */
+#define EV_INPUT  3         /* a descriptor the caller reads */
+#define EV_CAPTURE 4        /* id: job slot whose output is captured */
+
+struct ev {
+    unsigned kind;
+    unsigned id;
+};
+
+int ev_add(int fd, unsigned kind, unsigned id);
+void ev_del(int fd);
+int ev_wait(struct ev *evs, int max, int timeout, const sigset_t *mask);
+int ev_swap(int fd);
+void ev_close(void);
+extern void (*ev_yield)(int fd, int timeout);
+
+/* fanout.c - copying one pipe to several, for prod |+ cons |+ ... */
+int fanout(int in, int *out, int n);
+
+/* filter.c - grep -F, wc -l, head and tail run in a stage without exec */
+int filter_run(const char *path, int argc, char **argv);
+
+/* jobpage.c - the job table in shared memory, for monitors (tsh -s) */
+int jobpage_open(void);
+void jobpage_put(int slot, const struct job_t *job, int top);
+
+/* place.c - the CPUs and memory nodes a job may use, and its priority */
+#define MAXCPUS 1024        /* also bounds memory node numbers */
+
+struct cpumask {
+    unsigned long bits[MAXCPUS / (8 * sizeof(unsigned long))];
+};
+
+#define PL_CPUS   0x1
+#define PL_MEMS   0x2
+#define PL_NICE   0x4
+#define PL_IOPRIO 0x8
+
+struct placement {
+    int set;                /* PL_* bits: what to change */
+    struct cpumask cpus;
+    struct cpumask mems;    /* NUMA nodes to allocate from */
+    int nice;
+    int ioprio;             /* as ioprio_set(2) takes it */
+};
+
+int place_option(struct placement *pl, const char *cmd, const char *opt,
+        const char *arg);
+int place_self(const struct placement *pl);
+int place_job(pid_t pgid, const pid_t *pids, int n, const struct placement *pl);
+void place_show(pid_t pid, char *buf, size_t size);
+
+/* pathidx.c - where PATH's commands are, from an index on disk */
+void pathidx_open(void);
+char *pathidx_lookup(const char *path, const char *fn, char *buf);
+
+/* vars.c - string-keyed hash table and shell variables */
+struct htab_ent
+{
+    struct htab_ent *next;
+    unsigned hash;
+    char *key;
+    void *val;
+};
+
+struct htab
+{
+    struct htab_ent **buckets;
+    unsigned nbuckets;
+    unsigned count;
+};
+
+struct htab_ent *htab_find(struct htab *t, const char *key);
+struct htab_ent *htab_insert(struct htab *t, const char *key);
+void *htab_remove(struct htab *t, const char *key);
+void htab_clear(struct htab *t, void (*release)(void *));
+
+const char *var_get(const char *name);
+void var_set(const char *name, const char *value);
+void var_unset(const char *name);
+void var_export(const char *name, const char *value);
+void var_swap(struct htab *t);
+
+/* an environ array of ours; cap is 0 while it is still libc's */
+struct env {
+    char **v;
+    char *own;              /* own[i]: v[i] was allocated by env_set */
+    int n, cap;
+};
+
+void env_set(const char *name, const char *value);
+int env_copy(struct env *e);
+void env_swap(struct env *e);
+void env_free(struct env *e);
+
+/* expand.c - word expansion into argument vectors */
+struct strvec
+{
+    char **v;
+    int n, cap;
+};
+
+#define X_SPLIT    0x1  /* split unquoted expansions into fields */
+#define X_PATTERN  0x2  /* escape glob characters that were quoted */
+#define X_GLOB     0x4  /* expand fields with unquoted *, ? or [ to pathnames */
+
+void strvec_push(struct strvec *sv, char *s);
+int expand_word(struct word *w, int flags, struct strvec *out);
+char *expand_str(struct word *w, int flags);
+
+extern struct arena scratch;    /* expansion results, released per command */
+extern int pos_argc;            /* positional parameters, $0 included */
+extern char **pos_argv;
+extern int expand_error;        /* set when an expansion fails */
+
+/* builtin.c - builtins that do not touch the job table */
+int builtin_echo(int argc, char **argv);
+int builtin_test(int argc, char **argv);
+int builtin_true(int argc, char **argv);
+int builtin_false(int argc, char **argv);
+int builtin_export(int argc, char **argv);
+int builtin_unset(int argc, char **argv);
+int builtin_alias(int argc, char **argv);
+int builtin_unalias(int argc, char **argv);
+int builtin_pwd(int argc, char **argv);
+int builtin_cd(int argc, char **argv);
+
+/* arith.c */
+int arith_eval(const char *expr, long long *result);
+int builtin_let(int argc, char **argv);
+
+/* tinyshell.c - shell functions */
+int func_remove(const char *name);
+char *cmd_subst(struct node *n);
+
+/* tinyshell.c - running a session (tsh.h) on a stack of our own */
+struct tsh_session;
+void session_enter(struct tsh_session *s);
+void session_leave(struct tsh_session *s);
+int session_run(const char *name, const char *text);
+
+/* multi.c */
+int multi_main(int argc, char **argv);
 
 #endif
\ No newline at end of file
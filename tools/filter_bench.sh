@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# filter_bench.sh - the in-process filters (filter.c) against the tools
+#
+# Usage: tools/filter_bench.sh path/to/tsh [corpus] [runs]
+#
+# Each case is run by tsh twice: with bare names, which the filters
+# take, and with the tools' full paths, which are exec'd.  Prints the
+# best of runs (default 5) for each, in ms and MB/s of corpus.  Output
+# goes to a file, not /dev/null, which GNU grep would notice and stop
+# at the first match.  Without a corpus, ~150MB of log lines are made
+# under ${TMPDIR:-/tmp} and removed afterwards.
+
+tsh=${1:?usage: filter_bench.sh path/to/tsh [corpus] [runs]}
+corpus=$2
+runs=${3:-5}
+tmp=${TMPDIR:-/tmp}/filter_bench.$$
+mkdir -p "$tmp" || exit 1
+trap 'rm -rf "$tmp"' EXIT INT TERM
+
+if [ -z "$corpus" ]; then
+    corpus=$tmp/corpus
+    awk 'BEGIN {
+        split("ERROR WARN INFO debug user=alice user=bob GET POST timeout /api/v1/items", w, " ")
+        srand(1)
+        for (i = 0; i < 3000000; i++) {
+            line = sprintf("2026-10-19T12:%02d:%02d.%03d", i % 60, i % 59, i % 1000)
+            for (j = int(rand() * 8); j > 0; j--)
+                line = line " " w[int(rand() * 10) + 1]
+            print line
+        }
+    }' > "$corpus" || exit 1
+fi
+mb=$(( $(wc -c < "$corpus") / 1000000 ))
+[ "$mb" -gt 0 ] || mb=1
+
+# best - the least ms of $runs runs of the tsh command line $1
+best() {
+    b=
+    i=0
+    while [ $i -lt "$runs" ]; do
+        s=$(date +%s%N)
+        echo "$1" | "$tsh" > "$tmp/out" 2>&1
+        e=$(date +%s%N)
+        t=$(( (e - s) / 1000000 ))
+        if [ -z "$b" ] || [ $t -lt $b ]; then
+            b=$t
+        fi
+        i=$((i + 1))
+    done
+    echo "$b"
+}
+
+grep=$(command -v grep) wc=$(command -v wc) head=$(command -v head)
+tail=$(command -v tail) cat=$(command -v cat)
+
+printf '%-36s %10s %10s %10s\n' "case ($mb MB)" "filter ms" "tool ms" "filter MB/s"
+while IFS=';' read -r name line; do
+    tool=$(echo "$line" | sed "s|\bgrep |$grep |g; s|\bwc |$wc |g;
+            s|\bhead |$head |g; s|\btail |$tail |g")
+    f=$(best "$line")
+    t=$(best "$tool")
+    printf '%-36s %10d %10d %10d\n' "$name" "$f" "$t" $(( mb * 1000 / (f > 0 ? f : 1) ))
+done <<EOF
+wc -l;wc -l $corpus
+grep -c, dense matches;grep -c ERROR $corpus
+grep -F, rare matches;grep -F :34:56.789 $corpus
+grep -Fv | wc -l;grep -Fv user= $corpus | wc -l
+cat | grep -F | wc -l;$cat $corpus | grep -F timeout | wc -l
+cat | head -n 1000000;$cat $corpus | head -n 1000000
+tail -n 1000;tail -n 1000 $corpus
+cat | tail -n 1000;$cat $corpus | tail -n 1000
+EOF
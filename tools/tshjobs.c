@@ -0,0 +1,107 @@
+/*
+ * tshjobs - print the job table of a running tsh -s
+ *
+ * Usage: tshjobs pid [interval]
+ *
+ * Reads the shell's job status page (jobpage.h) without making any
+ * system call per snapshot and without the shell noticing.  With an
+ * interval in seconds it prints a snapshot that often until the shell
+ * is gone.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../jobpage.h"
+
+static const char *states[] = { "?", "Foreground", "Running", "Stopped" };
+
+/* copy a consistent snapshot of pg into snap; return the number of slots */
+static unsigned snapshot(const struct jp_page *pg, struct jp_page *snap,
+        unsigned maxslots) {
+    uint32_t seq;
+    unsigned top;
+
+    do {
+        while ((seq = __atomic_load_n(&pg->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        memcpy(snap, pg, sizeof(*pg));
+        top = (snap->top < maxslots) ? snap->top : maxslots;
+        memcpy(snap->jobs, pg->jobs, top * sizeof(struct jp_job));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (seq != __atomic_load_n(&pg->seq, __ATOMIC_RELAXED));
+    return top;
+}
+
+static void print(const struct jp_page *snap, unsigned top) {
+    const struct jp_job *j;
+    struct timespec now;
+    double age;
+    unsigned i;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (i = 0; i < top; i++) {
+        j = &snap->jobs[i];
+        if (j->pid == 0)
+            continue;
+        age = now.tv_sec + now.tv_nsec / 1e9 - j->start_ns / 1e9;
+        printf("[%d] (%d) %-10s %d/%d live  up %.1fs  cpu %.3fs  %s\n",
+                j->jid, j->pid, states[(j->state >= 1 && j->state <= 3) ? j->state : 0],
+                j->nlive, j->nprocs, age, j->cpu_ns / 1e9, j->cmd);
+    }
+}
+
+int main(int argc, char **argv) {
+    const struct jp_page *pg;
+    struct jp_page *snap;
+    struct stat st;
+    char name[64];
+    unsigned top;
+    double interval = 0;
+    int fd, pid;
+
+    if (argc < 2 || argc > 3 || (pid = atoi(argv[1])) <= 0) {
+        fprintf(stderr, "usage: tshjobs pid [interval]\n");
+        return 2;
+    }
+    if (argc == 3)
+        interval = atof(argv[2]);
+    snprintf(name, sizeof(name), "/tsh.%d", pid);
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "tshjobs: %d: no job status page (is it tsh -s?)\n", pid);
+        return 1;
+    }
+    pg = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pg == MAP_FAILED || (size_t)st.st_size < sizeof(*pg) ||
+            __atomic_load_n(&pg->magic, __ATOMIC_ACQUIRE) != JP_MAGIC ||
+            pg->version != JP_VERSION ||
+            sizeof(*pg) + pg->nslots * sizeof(struct jp_job) > (size_t)st.st_size) {
+        fprintf(stderr, "tshjobs: %s: not a job status page\n", name);
+        return 1;
+    }
+    if ((snap = malloc(st.st_size)) == NULL) {
+        fprintf(stderr, "tshjobs: out of memory\n");
+        return 1;
+    }
+
+    for (;;) {
+        top = snapshot(pg, snap, pg->nslots);
+        print(snap, top);
+        if (interval <= 0)
+            break;
+        if (kill(pid, 0) < 0) {
+            fprintf(stderr, "tshjobs: %d has exited\n", pid);
+            break;
+        }
+        fflush(stdout);
+        usleep(interval * 1e6);
+        printf("\n");
+    }
+    return 0;
+}
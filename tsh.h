@@ -0,0 +1,39 @@
+#ifndef _TSH_H
+#define _TSH_H
+
+/*
+ * tsh.h - running shell command lines inside another program
+ *
+ * A session is one shell: its variables, functions, aliases, exported
+ * environment and job table.  Sessions are independent of each other
+ * and of the tsh program, and several can be open in one process.
+ * They are not thread-safe: make all calls from one thread.
+ *
+ * While tsh_eval runs, descriptors 1 and 2 of the process point at the
+ * session's capture files.  Commands are forked as usual, but the
+ * session reaps only its own children, by pid; the caller must not
+ * ignore SIGCHLD or reap with waitpid(-1, ...).
+ */
+
+#include <stddef.h>
+#include <sys/resource.h>
+
+struct tsh_session;
+
+struct tsh_result {
+    int status;             /* $? after the line */
+    int exited;             /* the line ran exit: close the session */
+    struct rusage ru;       /* used by the shell and its reaped children */
+    char *out;              /* captured stdout, NUL-terminated */
+    size_t outlen;
+    char *err;              /* captured stderr, NUL-terminated */
+    size_t errlen;
+    char errmsg[256];       /* why tsh_eval returned -1 */
+};
+
+struct tsh_session *tsh_open(void);
+int tsh_eval(struct tsh_session *s, const char *line, struct tsh_result *r);
+void tsh_result_free(struct tsh_result *r);
+void tsh_close(struct tsh_session *s);
+
+#endif
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tinyshell.h"
+
+#define HTAB_MIN 64
+
+static struct htab vars;    /* unexported shell variables */
+
+/* FNV-1a */
+static unsigned htab_hash(const char *s) {
+    unsigned h = 2166136261u;
+
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static void *xcalloc(size_t n, size_t size) {
+    void *p = calloc(n, size);
+
+    if (p == NULL)
+        app_error("out of memory");
+    return p;
+}
+
+static void htab_grow(struct htab *t) {
+    struct htab_ent **old = t->buckets, *e, *next;
+    unsigned i, n = t->nbuckets;
+
+    t->nbuckets = n ? n * 2 : HTAB_MIN;
+    t->buckets = xcalloc(t->nbuckets, sizeof(*t->buckets));
+    for (i = 0; i < n; i++) {
+        for (e = old[i]; e != NULL; e = next) {
+            next = e->next;
+            e->next = t->buckets[e->hash & (t->nbuckets - 1)];
+            t->buckets[e->hash & (t->nbuckets - 1)] = e;
+        }
+    }
+    free(old);
+}
+
+struct htab_ent *htab_find(struct htab *t, const char *key) {
+    struct htab_ent *e;
+    unsigned h;
+
+    if (t->nbuckets == 0)
+        return NULL;
+    h = htab_hash(key);
+    for (e = t->buckets[h & (t->nbuckets - 1)]; e != NULL; e = e->next)
+        if (e->hash == h && strcmp(e->key, key) == 0)
+            return e;
+    return NULL;
+}
+
+/* find key, adding an entry with a NULL value if it is missing */
+struct htab_ent *htab_insert(struct htab *t, const char *key) {
+    struct htab_ent *e;
+    unsigned h;
+
+    if ((e = htab_find(t, key)) != NULL)
+        return e;
+    if (t->count >= t->nbuckets)
+        htab_grow(t);
+    h = htab_hash(key);
+    e = xcalloc(1, sizeof(*e));
+    e->hash = h;
+    e->key = strdup(key);
+    e->next = t->buckets[h & (t->nbuckets - 1)];
+    t->buckets[h & (t->nbuckets - 1)] = e;
+    t->count++;
+    return e;
+}
+
+/* unlink key and return its value (NULL if absent) */
+void *htab_remove(struct htab *t, const char *key) {
+    struct htab_ent **pp, *e;
+    void *val;
+    unsigned h;
+
+    if (t->nbuckets == 0)
+        return NULL;
+    h = htab_hash(key);
+    for (pp = &t->buckets[h & (t->nbuckets - 1)]; (e = *pp); pp = &e->next) {
+        if (e->hash == h && strcmp(e->key, key) == 0) {
+            *pp = e->next;
+            val = e->val;
+            free(e->key);
+            free(e);
+            t->count--;
+            return val;
+        }
+    }
+    return NULL;
+}
+
+/* htab_clear - empty t, handing each value to release */
+void htab_clear(struct htab *t, void (*release)(void *)) {
+    struct htab_ent *e, *next;
+    unsigned i;
+
+    for (i = 0; i < t->nbuckets; i++) {
+        for (e = t->buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            release(e->val);
+            free(e->key);
+            free(e);
+        }
+    }
+    free(t->buckets);
+    memset(t, 0, sizeof(*t));
+}
+
+/*
+ * The environment - environ is made an array of ours on the first
+ * change, and is changed only here, never by setenv(3): glibc keeps
+ * the array it last allocated, and would reallocate away from each
+ * session's array as sessions swap environ, leaking the old one.
+ * env_own marks the strings we allocated, to free when replaced.
+ */
+static char *env_own;
+static int env_n, env_cap;  /* env_cap 0: environ is not ours yet */
+
+/* env_find - index of name's entry in environ, or -1 */
+static int env_find(const char *name) {
+    size_t len = strlen(name);
+    int i;
+
+    for (i = 0; environ[i] != NULL; i++)
+        if (strncmp(environ[i], name, len) == 0 && environ[i][len] == '=')
+            return i;
+    return -1;
+}
+
+/* env_grow - make environ ours, with room for one more entry */
+static void env_grow(void) {
+    char **v, *own;
+    int cap;
+
+    if (env_cap == 0)
+        for (env_n = 0; environ[env_n] != NULL; env_n++)
+            ;
+    if (env_n + 2 <= env_cap)
+        return;
+    cap = 2 * (env_n + 2);
+    v = malloc(cap * sizeof(*v));
+    own = calloc(cap, 1);
+    if (v == NULL || own == NULL)
+        app_error("out of memory");
+    memcpy(v, environ, (env_n + 1) * sizeof(*v));
+    if (env_cap > 0) {
+        memcpy(own, env_own, env_n);
+        free(environ);
+        free(env_own);
+    }
+    environ = v;
+    env_own = own;
+    env_cap = cap;
+}
+
+/* env_set - set name=value in environ, as setenv(name, value, 1) */
+void env_set(const char *name, const char *value) {
+    char *s;
+    int i;
+
+    env_grow();
+    if ((s = malloc(strlen(name) + strlen(value) + 2)) == NULL)
+        app_error("out of memory");
+    sprintf(s, "%s=%s", name, value);
+    if ((i = env_find(name)) < 0) {
+        i = env_n++;
+        environ[env_n] = NULL;
+    }
+    else if (env_own[i])
+        free(environ[i]);
+    environ[i] = s;
+    env_own[i] = 1;
+}
+
+/* env_unset - take name out of environ, as unsetenv(name) */
+static void env_unset(const char *name) {
+    int i;
+
+    if (env_find(name) < 0)
+        return;
+    env_grow();
+    i = env_find(name);
+    if (env_own[i])
+        free(environ[i]);
+    memmove(environ + i, environ + i + 1, (env_n - i) * sizeof(*environ));
+    memmove(env_own + i, env_own + i + 1, env_n - i);
+    env_n--;
+}
+
+/* env_copy - a copy of environ for a session; its strings stay shared */
+int env_copy(struct env *e) {
+    for (e->n = 0; environ[e->n] != NULL; e->n++)
+        ;
+    e->cap = e->n + 1;
+    e->v = malloc(e->cap * sizeof(*e->v));
+    e->own = calloc(e->cap, 1);
+    if (e->v == NULL || e->own == NULL) {
+        env_free(e);
+        return -1;
+    }
+    memcpy(e->v, environ, e->cap * sizeof(*e->v));
+    return 0;
+}
+
+/* env_swap - exchange environ with *e (a session's own) */
+void env_swap(struct env *e) {
+    struct env tmp;
+
+    tmp.v = environ;
+    tmp.own = env_own;
+    tmp.n = env_n;
+    tmp.cap = env_cap;
+    environ = e->v;
+    env_own = e->own;
+    env_n = e->n;
+    env_cap = e->cap;
+    *e = tmp;
+}
+
+/* env_free - release a session's environment, swapped out */
+void env_free(struct env *e) {
+    int i;
+
+    for (i = 0; e->cap > 0 && i < e->n; i++)
+        if (e->own[i])
+            free(e->v[i]);
+    if (e->cap > 0) {
+        free(e->v);
+        free(e->own);
+    }
+    memset(e, 0, sizeof(*e));
+}
+
+/*
+ * Shell variables live in the hash table until they are exported;
+ * exported variables live only in environ so children inherit them.
+ */
+const char *var_get(const char *name) {
+    struct htab_ent *e = htab_find(&vars, name);
+
+    if (e != NULL)
+        return e->val;
+    return getenv(name);
+}
+
+void var_set(const char *name, const char *value) {
+    struct htab_ent *e;
+
+    if (getenv(name) != NULL) {
+        env_set(name, value);
+        return;
+    }
+    e = htab_insert(&vars, name);
+    free(e->val);
+    e->val = strdup(value);
+}
+
+void var_unset(const char *name) {
+    free(htab_remove(&vars, name));
+    env_unset(name);
+}
+
+void var_export(const char *name, const char *value) {
+    char *old = htab_remove(&vars, name);
+
+    if (value == NULL)
+        value = old;
+    if (value != NULL)
+        env_set(name, value);
+    free(old);
+}
+
+/* var_swap - exchange the variable table with *t (a session's own) */
+void var_swap(struct htab *t) {
+    struct htab tmp = vars;
+
+    vars = *t;
+    *t = tmp;
+}